@@ -0,0 +1,58 @@
+#include "alloc_guard.h"
+
+#ifdef ALLOC_GUARD
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// glibc's own entry points, so the wrappers below do not recurse.
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static volatile sig_atomic_t armed = 0;
+
+static void check(void)
+{
+	static const char message[] = "heap allocation in the control loop\n";
+
+	if (armed) {
+		// stdio might allocate, so write the message directly.
+		ssize_t r = write(STDERR_FILENO, message, sizeof(message) - 1);
+		(void)r;
+		abort();
+	}
+}
+
+void alloc_guard_arm(void)
+{
+	armed = 1;
+}
+
+void alloc_guard_disarm(void)
+{
+	armed = 0;
+}
+
+void *malloc(size_t size)
+{
+	check();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	check();
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	check();
+	return __libc_realloc(ptr, size);
+}
+
+#endif
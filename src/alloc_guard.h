@@ -0,0 +1,21 @@
+#ifndef ALLOC_GUARD_H
+#define ALLOC_GUARD_H
+
+// Build with -DALLOC_GUARD to abort on any heap allocation made while the
+// guard is armed. The control loop arms it once all buffers exist, so a
+// debug run proves the steady state never allocates. Release builds
+// compile the calls away.
+#ifdef ALLOC_GUARD
+void alloc_guard_arm(void);
+void alloc_guard_disarm(void);
+#else
+static inline void alloc_guard_arm(void)
+{
+}
+
+static inline void alloc_guard_disarm(void)
+{
+}
+#endif
+
+#endif
@@ -0,0 +1,465 @@
+// For accept4().
+#define _GNU_SOURCE
+
+#include "api.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define API_BACKLOG 4
+// Owner and group may talk to the daemon. Overrides only ever raise fan
+// speed, but they are still not for everyone.
+#define API_SOCKET_MODE 0660
+
+void api_init(struct api *api)
+{
+	api->listen_fd = -1;
+	*api->path = '\0';
+	for (int i = 0; i < API_CLIENTS; i++) {
+		api->clients[i] = -1;
+	}
+	api->next_id = 1;
+	memset(api->overrides, 0, sizeof(api->overrides));
+}
+
+static int fill_address(struct sockaddr_un *addr, const char *path)
+{
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, strlen(path) + 1);
+
+	return 0;
+}
+
+int api_open(struct api *api, const char *path)
+{
+	struct sockaddr_un addr;
+	if (fill_address(&addr, path)) {
+		return -1;
+	}
+	api->listen_fd = socket(AF_UNIX,
+				SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (api->listen_fd < 0) {
+		perror("socket(AF_UNIX) failed");
+		return -1;
+	}
+	if (unlink(path) && errno != ENOENT) {
+		fprintf(stderr, "unlink(%s) failed: %s\n", path,
+			strerror(errno));
+		goto cleanup;
+	}
+	if (bind(api->listen_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "bind(%s) failed: %s\n", path, strerror(errno));
+		goto cleanup;
+	}
+	memcpy(api->path, path, strlen(path) + 1);
+	if (chmod(path, API_SOCKET_MODE)) {
+		perror("chmod() failed");
+		goto cleanup;
+	}
+	if (listen(api->listen_fd, API_BACKLOG)) {
+		perror("listen() failed");
+		goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	api_close(api);
+
+	return -1;
+}
+
+static void close_client(struct api *api, int client)
+{
+	if (close(api->clients[client])) {
+		perror("close() failed");
+	}
+	api->clients[client] = -1;
+}
+
+void api_close(struct api *api)
+{
+	for (int i = 0; i < API_CLIENTS; i++) {
+		if (api->clients[i] >= 0) {
+			close_client(api, i);
+		}
+	}
+	if (api->listen_fd >= 0 && close(api->listen_fd)) {
+		perror("close() failed");
+	}
+	api->listen_fd = -1;
+	if (*api->path && unlink(api->path) && errno != ENOENT) {
+		perror("unlink() failed");
+	}
+	*api->path = '\0';
+}
+
+int api_accept(struct api *api)
+{
+	int fd = accept4(api->listen_fd, NULL, NULL,
+			 SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("accept4() failed");
+		}
+		return -1;
+	}
+	for (int i = 0; i < API_CLIENTS; i++) {
+		if (api->clients[i] < 0) {
+			api->clients[i] = fd;
+			return i;
+		}
+	}
+	fprintf(stderr, "too many api clients, at most %d\n", API_CLIENTS);
+	close(fd);
+
+	return -1;
+}
+
+static uint32_t remaining_ms(const struct api_override_slot *slot,
+			     uint64_t now_ns)
+{
+	return slot->expires_ns > now_ns
+		       ? (uint32_t)((slot->expires_ns - now_ns) / 1000000)
+		       : 0;
+}
+
+static void copy_name(char *out, const char *name)
+{
+	memcpy(out, name, strnlen(name, DEVICE_NAME_SIZE - 1));
+	out[strnlen(name, DEVICE_NAME_SIZE - 1)] = '\0';
+}
+
+static size_t fill_status(struct api *api, const struct api_view *view,
+			  uint64_t now_ns)
+{
+	const struct zone_table *zones = view->zones;
+	struct api_status *status = &api->response.status;
+
+	memset(status, 0, sizeof(*status));
+	status->ticks = view->ticks;
+	status->floor = view->floor;
+	status->emergency = view->emergency;
+	status->throttled = view->throttled;
+	status->throttle_events = view->throttle_events;
+	status->throttled_ms = view->throttled_ms;
+	status->curve_shift = zones->curve_shift;
+	status->sensor_count = zones->sensor_count;
+	for (int i = 0; i < zones->sensor_count; i++) {
+		copy_name(status->sensors[i].name, zones->sensors[i].name);
+		copy_name(status->sensors[i].node, zones->sensors[i].node);
+		status->sensors[i].temp = zones->sensors[i].temp;
+		status->sensors[i].filtered = zones->sensors[i].filtered;
+	}
+	status->fan_count = zones->fan_count;
+	for (int i = 0; i < zones->fan_count; i++) {
+		const struct fan *fan = &zones->fans[i];
+		struct api_fan *out = &status->fans[i];
+		copy_name(out->name, fan->name);
+		copy_name(out->node, fan->node);
+		out->speed = fan->speed;
+		out->target = fan->target;
+		out->rpm = (int32_t)fan->tach.rpm;
+		out->stalled = fan->tach.stalled;
+	}
+	for (int i = 0; i < API_OVERRIDES; i++) {
+		const struct api_override_slot *slot = &api->overrides[i];
+		if (!slot->id) {
+			continue;
+		}
+		status->overrides[status->override_count++] =
+			(struct api_override){
+				.id = slot->id,
+				.pwm = slot->pwm,
+				.remaining_ms = remaining_ms(slot, now_ns),
+			};
+	}
+
+	return sizeof(*status);
+}
+
+static void fill_channel(struct api_channel *out, const struct zone *zone,
+			 int zone_index, int channel)
+{
+	const struct controller_config *config =
+		&zone->channels[channel].config;
+
+	out->zone = zone_index;
+	out->sensor = zone->combine == ZONE_COMBINE_CURVE
+			      ? zone->sensors[channel].sensor
+			      : -1;
+	out->type = config->type;
+	out->min_fan_speed = config->min_fan_speed;
+	out->min_temp = config->min_temp;
+	out->max_temp = config->max_temp;
+	out->pid_target = config->pid_target;
+	switch (config->type) {
+	case CONTROLLER_CURVE:
+		out->point_count = config->curve.point_count;
+		for (int i = 0; i < config->curve.point_count; i++) {
+			out->points[i].temp = config->curve.points[i].temp;
+			out->points[i].speed = config->curve.points[i].speed;
+		}
+		break;
+	case CONTROLLER_LINEAR:
+		out->point_count = 2;
+		out->points[0].temp = config->min_temp;
+		out->points[0].speed = config->min_fan_speed;
+		out->points[1].temp = config->max_temp;
+		out->points[1].speed = MAX_FAN_SPEED;
+		break;
+	default:
+		out->point_count = 0;
+		break;
+	}
+}
+
+static size_t fill_curves(struct api *api, const struct zone_table *zones)
+{
+	struct api_curves *curves = &api->response.curves;
+
+	memset(curves, 0, sizeof(*curves));
+	for (int i = 0; i < zones->zone_count; i++) {
+		const struct zone *zone = &zones->zones[i];
+		for (int j = 0; j < zone->channel_count; j++) {
+			fill_channel(&curves->channels[curves->channel_count++],
+				     zone, i, j);
+		}
+	}
+
+	return offsetof(struct api_curves, channels) +
+	       curves->channel_count * sizeof(*curves->channels);
+}
+
+static int set_override(struct api *api, const struct api_request *request,
+			uint64_t now_ns)
+{
+	if (request->pwm < 0 || request->pwm > MAX_FAN_SPEED ||
+	    !request->duration_ms ||
+	    request->duration_ms > API_MAX_OVERRIDE_MS) {
+		return -EINVAL;
+	}
+	struct api_override_slot *slot = NULL;
+	for (int i = 0; i < API_OVERRIDES && !slot; i++) {
+		if (!api->overrides[i].id) {
+			slot = &api->overrides[i];
+		}
+	}
+	if (!slot) {
+		return -ENOSPC;
+	}
+	slot->id = api->next_id++;
+	// 0 marks a free slot.
+	if (!api->next_id) {
+		api->next_id = 1;
+	}
+	slot->pwm = request->pwm;
+	slot->expires_ns = now_ns + (uint64_t)request->duration_ms * 1000000;
+	api->response.override = (struct api_override){
+		.id = slot->id,
+		.pwm = slot->pwm,
+		.remaining_ms = request->duration_ms,
+	};
+
+	return 0;
+}
+
+static int clear_override(struct api *api, uint32_t id)
+{
+	int status = -ENOENT;
+
+	for (int i = 0; i < API_OVERRIDES; i++) {
+		if (api->overrides[i].id && (!id || api->overrides[i].id == id)) {
+			api->overrides[i].id = 0;
+			status = 0;
+		}
+	}
+
+	return status;
+}
+
+// Returns the response's body size in out_length, and 1 if the overrides
+// changed.
+static int dispatch(struct api *api, const struct api_request *request,
+		    const struct api_view *view, uint64_t now_ns,
+		    size_t *out_length)
+{
+	struct api_response *response = &api->response;
+	int changed = 0;
+
+	*out_length = 0;
+	response->error = 0;
+	if (request->version != API_VERSION) {
+		response->error = -EPROTONOSUPPORT;
+		return 0;
+	}
+	switch (request->command) {
+	case API_GET_STATUS:
+		*out_length = fill_status(api, view, now_ns);
+		break;
+	case API_GET_CURVES:
+		*out_length = fill_curves(api, view->zones);
+		break;
+	case API_SET_OVERRIDE:
+		response->error = set_override(api, request, now_ns);
+		*out_length = response->error ? 0 : sizeof(response->override);
+		changed = !response->error;
+		break;
+	case API_CLEAR_OVERRIDE:
+		response->error = clear_override(api, request->id);
+		changed = !response->error;
+		break;
+	default:
+		response->error = -EOPNOTSUPP;
+		break;
+	}
+
+	return changed;
+}
+
+int api_handle(struct api *api, int client, const struct api_view *view,
+	       uint64_t now_ns, bool *out_more)
+{
+	struct api_response *response = &api->response;
+	int changed = 0;
+
+	*out_more = false;
+	for (int i = 0; i < API_REQUESTS_PER_WAKEUP; i++) {
+		struct api_request request;
+		ssize_t length = recv(api->clients[client], &request,
+				      sizeof(request), MSG_TRUNC);
+		if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return changed;
+		}
+		if (length != (ssize_t)sizeof(request)) {
+			// 0 is a hang up, anything else is not our protocol.
+			if (length < 0) {
+				perror("recv() failed");
+			} else if (length) {
+				fprintf(stderr, "api request of %zd bytes\n",
+					length);
+			}
+			close_client(api, client);
+			return changed;
+		}
+
+		size_t body_length = 0;
+		changed |= dispatch(api, &request, view, now_ns, &body_length);
+		response->version = API_VERSION;
+		response->command = request.command;
+		size_t response_length =
+			offsetof(struct api_response, status) + body_length;
+		if (send(api->clients[client], response, response_length,
+			 MSG_DONTWAIT | MSG_NOSIGNAL) !=
+		    (ssize_t)response_length) {
+			// A client too slow to read its answers is dropped.
+			perror("send() failed");
+			close_client(api, client);
+			return changed;
+		}
+	}
+	*out_more = true;
+
+	return changed;
+}
+
+int api_floor(struct api *api, uint64_t now_ns)
+{
+	int floor = 0;
+
+	for (int i = 0; i < API_OVERRIDES; i++) {
+		struct api_override_slot *slot = &api->overrides[i];
+		if (!slot->id) {
+			continue;
+		}
+		if (now_ns >= slot->expires_ns) {
+			slot->id = 0;
+			continue;
+		}
+		if (slot->pwm > floor) {
+			floor = slot->pwm;
+		}
+	}
+
+	return floor;
+}
+
+long api_expiry_ms(const struct api *api, uint64_t now_ns)
+{
+	uint64_t expires_ns = 0;
+
+	for (int i = 0; i < API_OVERRIDES; i++) {
+		const struct api_override_slot *slot = &api->overrides[i];
+		if (slot->id && (!expires_ns || slot->expires_ns < expires_ns)) {
+			expires_ns = slot->expires_ns;
+		}
+	}
+	if (!expires_ns) {
+		return -1;
+	}
+	// Rounded up, and never 0, which would disarm the timer.
+	if (expires_ns <= now_ns) {
+		return 1;
+	}
+
+	return (long)((expires_ns - now_ns + 999999) / 1000000);
+}
+
+int api_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	if (fill_address(&addr, path)) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket(AF_UNIX) failed");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "connect(%s) failed: %s\n", path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int api_call(int fd, const struct api_request *request,
+	     struct api_response *out_response)
+{
+	if (send(fd, request, sizeof(*request), MSG_NOSIGNAL) !=
+	    (ssize_t)sizeof(*request)) {
+		perror("send() failed");
+		return -1;
+	}
+	ssize_t length = recv(fd, out_response, sizeof(*out_response), 0);
+	if (length < 0) {
+		perror("recv() failed");
+		return -1;
+	}
+	if ((size_t)length < offsetof(struct api_response, status) ||
+	    out_response->version != API_VERSION ||
+	    out_response->command != request->command) {
+		fprintf(stderr, "unexpected api response\n");
+		return -1;
+	}
+	// Whatever was not sent reads as zero.
+	memset((char *)out_response + length, 0,
+	       sizeof(*out_response) - (size_t)length);
+
+	return 0;
+}
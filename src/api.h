@@ -0,0 +1,180 @@
+#ifndef API_H
+#define API_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+#include "curve.h"
+#include "zone.h"
+
+#define DEFAULT_API_SOCKET_PATH "/run/rockpro64fanadjust.sock"
+#define API_SOCKET_PATH_SIZE sizeof(((struct sockaddr_un *)0)->sun_path)
+#define API_VERSION 1
+#define API_CLIENTS 8
+#define API_OVERRIDES 8
+// Requests answered per client and wakeup, so a client that keeps sending
+// can't keep the loop from its next tick.
+#define API_REQUESTS_PER_WAKEUP 4
+#define API_MAX_OVERRIDE_MS (24 * 60 * 60 * 1000)
+#define API_CHANNELS (MAX_ZONES * ZONE_MAX_SENSORS)
+
+// One request and one response per SOCK_SEQPACKET message, in host byte
+// order since both ends run on the same machine. Every response starts
+// with the version and command of its request.
+enum api_command {
+	API_GET_STATUS = 1,
+	API_GET_CURVES,
+	// Runs every fan at least at pwm for duration_ms.
+	API_SET_OVERRIDE,
+	// Ends override id early, every override for id 0.
+	API_CLEAR_OVERRIDE,
+};
+
+struct api_request {
+	uint32_t version;
+	uint32_t command;
+	uint32_t id;
+	int32_t pwm;
+	uint32_t duration_ms;
+};
+
+struct api_override {
+	uint32_t id;
+	int32_t pwm;
+	uint32_t remaining_ms;
+};
+
+struct api_sensor {
+	char name[DEVICE_NAME_SIZE];
+	char node[DEVICE_NAME_SIZE];
+	int64_t temp;
+	// After the sensor's filter, what the curves see.
+	int64_t filtered;
+};
+
+struct api_fan {
+	char name[DEVICE_NAME_SIZE];
+	char node[DEVICE_NAME_SIZE];
+	int32_t speed;
+	int32_t target;
+	// -1 without a tachometer.
+	int32_t rpm;
+	int32_t stalled;
+};
+
+struct api_status {
+	uint64_t ticks;
+	// Highest override or shared memory floor merged into the last tick.
+	int32_t floor;
+	int32_t emergency;
+	int32_t throttled;
+	uint64_t throttle_events;
+	uint64_t throttled_ms;
+	// How far auto-tune has lowered the curves, in millidegrees.
+	int64_t curve_shift;
+	int32_t sensor_count;
+	int32_t fan_count;
+	int32_t override_count;
+	struct api_sensor sensors[MAX_SENSORS];
+	struct api_fan fans[MAX_FANS];
+	struct api_override overrides[API_OVERRIDES];
+};
+
+struct api_curve_point {
+	int64_t temp;
+	int32_t speed;
+};
+
+struct api_channel {
+	int32_t zone;
+	// Index into the status' sensors, -1 for a zone that combines all
+	// of its sensors first.
+	int32_t sensor;
+	// enum controller_type.
+	int32_t type;
+	int32_t min_fan_speed;
+	int64_t min_temp;
+	int64_t max_temp;
+	int64_t pid_target;
+	// The linear ramp is sent as its two end points, pid channels have
+	// none.
+	int32_t point_count;
+	struct api_curve_point points[CURVE_MAX_POINTS];
+};
+
+struct api_curves {
+	int32_t channel_count;
+	struct api_channel channels[API_CHANNELS];
+};
+
+struct api_response {
+	uint32_t version;
+	uint32_t command;
+	// 0 or a negative errno.
+	int32_t error;
+	union {
+		struct api_status status;
+		struct api_curves curves;
+		struct api_override override;
+	};
+};
+
+struct api_override_slot {
+	// 0 for a free slot.
+	uint32_t id;
+	int pwm;
+	// CLOCK_MONOTONIC.
+	uint64_t expires_ns;
+};
+
+// The daemon's end: a listening socket and a few connected clients, all
+// non-blocking and polled by the event loop, so a stuck client never
+// holds up a tick.
+struct api {
+	int listen_fd;
+	char path[API_SOCKET_PATH_SIZE];
+	int clients[API_CLIENTS];
+	uint32_t next_id;
+	struct api_override_slot overrides[API_OVERRIDES];
+	// Built here rather than on the stack, curves make it large.
+	struct api_response response;
+};
+
+// What a status response reports beyond the zone table.
+struct api_view {
+	const struct zone_table *zones;
+	uint64_t ticks;
+	int floor;
+	bool emergency;
+	bool throttled;
+	uint64_t throttle_events;
+	uint64_t throttled_ms;
+};
+
+void api_init(struct api *api);
+// Replaces a socket left behind at path by an earlier run.
+int api_open(struct api *api, const char *path);
+void api_close(struct api *api);
+// Accepts a pending connection and returns its client index, -1 if there
+// is none or every client slot is taken.
+int api_accept(struct api *api);
+// Answers up to API_REQUESTS_PER_WAKEUP requests client has sent, and
+// sets *out_more if it may have sent others. Returns 1 if the overrides
+// changed, so the fans should be updated right away. A client that hung
+// up or misbehaved is closed.
+int api_handle(struct api *api, int client, const struct api_view *view,
+	       uint64_t now_ns, bool *out_more);
+// Highest live override at now_ns, 0 without any. Frees expired ones.
+int api_floor(struct api *api, uint64_t now_ns);
+// Milliseconds from now_ns until an override expires, -1 if none is live.
+long api_expiry_ms(const struct api *api, uint64_t now_ns);
+
+// Client side, blocking.
+int api_connect(const char *path);
+// Sends request and waits for its response. Fails on transport errors, a
+// request the daemon refused comes back with error set.
+int api_call(int fd, const struct api_request *request,
+	     struct api_response *out_response);
+
+#endif
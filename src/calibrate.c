@@ -0,0 +1,386 @@
+#include "calibrate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define BOARD_MODEL_PATH "/proc/device-tree/model"
+#define BOARD_DMI_PATH "/sys/class/dmi/id/board_name"
+#define BOARD_UNKNOWN "unknown"
+// Long enough for the fan to reach full speed and the tachometer, which
+// averages over a second or so, to catch up.
+#define CALIBRATE_SPIN_UP_MS 5000
+#define CALIBRATE_STOP_MS 15000
+// Time per step of the sweeps. A fan needs longer to break away than to
+// slow down.
+#define CALIBRATE_DOWN_MS 1500
+#define CALIBRATE_UP_MS 3000
+#define CALIBRATE_STEP 4
+
+struct profile_entry {
+	char name[DEVICE_NAME_SIZE];
+	char node[DEVICE_NAME_SIZE];
+	struct fan_profile profile;
+};
+
+// The device tree model on ARM boards, the DMI board name elsewhere.
+static void read_board(char *out_board)
+{
+	static const char *const paths[] = { BOARD_MODEL_PATH, BOARD_DMI_PATH };
+
+	for (size_t i = 0; i < sizeof(paths) / sizeof(*paths); i++) {
+		int fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		ssize_t length = read(fd, out_board, PROFILE_BOARD_SIZE - 1);
+		close(fd);
+		if (length <= 0) {
+			continue;
+		}
+		out_board[length] = '\0';
+		// The model is NUL terminated, the board name ends in a
+		// newline, and neither may break the profile format.
+		out_board[strcspn(out_board, "\t\n")] = '\0';
+		if (*out_board) {
+			return;
+		}
+	}
+	memcpy(out_board, BOARD_UNKNOWN, sizeof(BOARD_UNKNOWN));
+}
+
+static int parse_field(const char *str, long min, long max, long *out_value)
+{
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
+	if (errno || end == str || *end || value < min || value > max) {
+		return -1;
+	}
+	*out_value = value;
+
+	return 0;
+}
+
+// NAME NODE START STOP MAX_RPM after the fan keyword.
+static int parse_entry(char **save, struct profile_entry *out_entry)
+{
+	char *name = strtok_r(NULL, "\t\n", save);
+	char *node = strtok_r(NULL, "\t\n", save);
+	char *start = strtok_r(NULL, "\t\n", save);
+	char *stop = strtok_r(NULL, "\t\n", save);
+	char *max_rpm = strtok_r(NULL, "\t\n", save);
+	long start_pwm = 0;
+	long stop_pwm = 0;
+	if (!name || !node || !max_rpm || strlen(name) >= DEVICE_NAME_SIZE ||
+	    strlen(node) >= DEVICE_NAME_SIZE ||
+	    parse_field(start, 1, MAX_FAN_SPEED, &start_pwm) ||
+	    parse_field(stop, 0, MAX_FAN_SPEED, &stop_pwm) ||
+	    parse_field(max_rpm, 0, LONG_MAX, &out_entry->profile.max_rpm)) {
+		return -1;
+	}
+	memcpy(out_entry->name, name, strlen(name) + 1);
+	memcpy(out_entry->node, node, strlen(node) + 1);
+	out_entry->profile.start_pwm = (int)start_pwm;
+	out_entry->profile.stop_pwm = (int)stop_pwm;
+	out_entry->profile.kick_ms = 0;
+
+	return 0;
+}
+
+static void apply_entries(struct zone_table *table,
+			  const struct profile_entry *entries, int count)
+{
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		for (int j = 0; j < count; j++) {
+			if (!strcmp(entries[j].name, fan->name) &&
+			    !strcmp(entries[j].node, fan->node)) {
+				fan->profile = entries[j].profile;
+				break;
+			}
+		}
+	}
+}
+
+int calibrate_load(struct zone_table *table, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		// Never calibrated.
+		if (errno == ENOENT) {
+			return 0;
+		}
+		fprintf(stderr, "fopen(%s) failed: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	struct profile_entry entries[MAX_FANS];
+	int count = 0;
+	char board[PROFILE_BOARD_SIZE] = "";
+	char *line = NULL;
+	size_t line_length = 0;
+	while (getline(&line, &line_length, f) > 0) {
+		char *save = NULL;
+		char *keyword = strtok_r(line, "\t\n", &save);
+		if (!keyword || *keyword == '#') {
+			continue;
+		}
+		if (!strcmp(keyword, "board")) {
+			char *name = strtok_r(NULL, "\t\n", &save);
+			if (name && strlen(name) < sizeof(board)) {
+				memcpy(board, name, strlen(name) + 1);
+			}
+		} else if (strcmp(keyword, "fan") || count == MAX_FANS ||
+			   parse_entry(&save, &entries[count])) {
+			fprintf(stderr, "%s: skipping bad line\n", path);
+		} else {
+			count++;
+		}
+	}
+	free(line);
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return -1;
+	}
+
+	char current[PROFILE_BOARD_SIZE];
+	read_board(current);
+	if (strcmp(board, current)) {
+		fprintf(stderr, "%s is for %s, not %s, ignoring it\n", path,
+			*board ? board : BOARD_UNKNOWN, current);
+		return 0;
+	}
+	apply_entries(table, entries, count);
+
+	return 0;
+}
+
+static int save(const struct zone_table *table, const char *path)
+{
+	char tmp_path[PROFILE_PATH_SIZE + 4];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+	    (int)sizeof(tmp_path)) {
+		fprintf(stderr, "profile path too long\n");
+		return -1;
+	}
+	char board[PROFILE_BOARD_SIZE];
+	read_board(board);
+
+	FILE *f = fopen(tmp_path, "w");
+	if (!f) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", tmp_path,
+			strerror(errno));
+		return -1;
+	}
+	int status = 0;
+	if (fprintf(f, "# fan NAME NODE START_PWM STOP_PWM MAX_RPM\n"
+		       "board\t%s\n",
+		    board) < 0) {
+		log_fail("fprintf", __FILE__, __LINE__);
+		status = -1;
+	}
+	for (int i = 0; !status && i < table->fan_count; i++) {
+		const struct fan *fan = &table->fans[i];
+		if (!profile_calibrated(&fan->profile)) {
+			continue;
+		}
+		if (fprintf(f, "fan\t%s\t%s\t%d\t%d\t%ld\n", fan->name,
+			    fan->node, fan->profile.start_pwm,
+			    fan->profile.stop_pwm, fan->profile.max_rpm) < 0) {
+			log_fail("fprintf", __FILE__, __LINE__);
+			status = -1;
+		}
+	}
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		status = -1;
+	}
+	if (!status && rename(tmp_path, path)) {
+		perror("rename() failed");
+		status = -1;
+	}
+	if (status) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static long lowest_max_temp(const struct zone_table *table)
+{
+	long temp = LONG_MAX;
+
+	for (int i = 0; i < table->zone_count; i++) {
+		const struct zone *zone = &table->zones[i];
+		for (int j = 0; j < zone->channel_count; j++) {
+			if (zone->channels[j].config.max_temp < temp) {
+				temp = zone->channels[j].config.max_temp;
+			}
+		}
+	}
+
+	return temp;
+}
+
+// Runs fan at pwm for ms and returns its rpm afterwards in out_rpm, or
+// fails if something got too hot in the meantime.
+static int hold(struct zone_table *table, struct fan *fan, int pwm, long ms,
+		long *out_rpm)
+{
+	if (write_fan_speed(fan->fd, pwm)) {
+		fprintf(stderr, "writing %s/%s failed\n", fan->name, fan->node);
+		return -1;
+	}
+	fan->speed = pwm;
+
+	struct timespec delay = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = ms % 1000 * 1000000,
+	};
+	// SIGTERM interrupts the sleep, and with it the calibration.
+	if (nanosleep(&delay, NULL)) {
+		fprintf(stderr, "calibration interrupted\n");
+		return -1;
+	}
+	if (zone_table_read(table)) {
+		log_fail("zone_table_read", __FILE__, __LINE__);
+		return -1;
+	}
+	long limit = lowest_max_temp(table);
+	for (int i = 0; i < table->sensor_count; i++) {
+		if (table->sensors[i].temp >= limit) {
+			fprintf(stderr, "%s/%s reached %ld, giving up\n",
+				table->sensors[i].name, table->sensors[i].node,
+				table->sensors[i].temp);
+			return -1;
+		}
+	}
+	*out_rpm = fan->tach.rpm;
+	if (*out_rpm == TACH_RPM_UNKNOWN) {
+		fprintf(stderr, "reading the tachometer of %s/%s failed\n",
+			fan->name, fan->node);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Fills in fan's profile. Returns 1 for a fan that can't be calibrated.
+static int sweep(struct zone_table *table, struct fan *fan)
+{
+	struct fan_profile profile = { 0 };
+	long rpm = 0;
+
+	if (hold(table, fan, MAX_FAN_SPEED, CALIBRATE_SPIN_UP_MS, &rpm)) {
+		return -1;
+	}
+	if (rpm < TACH_STALL_RPM) {
+		fprintf(stderr, "%s/%s doesn't turn at full speed\n",
+			fan->name, fan->node);
+		return 1;
+	}
+	profile.max_rpm = rpm;
+
+	profile.stop_pwm = MAX_FAN_SPEED;
+	for (int pwm = MAX_FAN_SPEED - CALIBRATE_STEP; pwm > 0;
+	     pwm -= CALIBRATE_STEP) {
+		if (hold(table, fan, pwm, CALIBRATE_DOWN_MS, &rpm)) {
+			return -1;
+		}
+		if (rpm < TACH_STALL_RPM) {
+			break;
+		}
+		profile.stop_pwm = pwm;
+	}
+
+	if (hold(table, fan, 0, CALIBRATE_STOP_MS, &rpm)) {
+		return -1;
+	}
+	if (rpm >= TACH_STALL_RPM) {
+		fprintf(stderr, "%s/%s doesn't stop at pwm 0\n", fan->name,
+			fan->node);
+		return 1;
+	}
+	for (int pwm = profile.stop_pwm; !profile.start_pwm;
+	     pwm += CALIBRATE_STEP) {
+		if (pwm > MAX_FAN_SPEED) {
+			pwm = MAX_FAN_SPEED;
+		}
+		if (hold(table, fan, pwm, CALIBRATE_UP_MS, &rpm)) {
+			return -1;
+		}
+		if (rpm >= TACH_STALL_RPM) {
+			profile.start_pwm = pwm;
+		} else if (pwm == MAX_FAN_SPEED) {
+			fprintf(stderr, "%s/%s doesn't start from standstill\n",
+				fan->name, fan->node);
+			return 1;
+		}
+	}
+	fan->profile = profile;
+
+	return 0;
+}
+
+int calibrate_run(struct zone_table *table, const char *path)
+{
+	int status = 0;
+	int calibrated = 0;
+
+	zone_table_write_max(table);
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		if (fan->tach_fd < 0) {
+			fprintf(stderr, "%s/%s has no tachometer, skipping\n",
+				fan->name, fan->node);
+			continue;
+		}
+		status = sweep(table, fan);
+		if (status < 0) {
+			log_fail("sweep", __FILE__, __LINE__);
+			goto cleanup;
+		}
+		// Back to full speed, so it cools while the next one is
+		// measured.
+		if (write_fan_speed(fan->fd, MAX_FAN_SPEED)) {
+			fprintf(stderr, "writing %s/%s failed\n", fan->name,
+				fan->node);
+			status = -1;
+			goto cleanup;
+		}
+		fan->speed = MAX_FAN_SPEED;
+		if (status) {
+			status = 0;
+			continue;
+		}
+		printf("%s/%s: starts at pwm %d, stops below %d, %ld rpm at "
+		       "full speed\n",
+		       fan->name, fan->node, fan->profile.start_pwm,
+		       fan->profile.stop_pwm, fan->profile.max_rpm);
+		calibrated++;
+	}
+	if (!calibrated) {
+		fprintf(stderr, "no fan could be calibrated\n");
+		status = -1;
+		goto cleanup;
+	}
+	if (save(table, path)) {
+		log_fail("save", __FILE__, __LINE__);
+		status = -1;
+	}
+
+cleanup:
+	zone_table_write_max(table);
+
+	return status;
+}
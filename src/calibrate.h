@@ -0,0 +1,21 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include "zone.h"
+
+#define DEFAULT_PROFILE_PATH "/var/lib/rockpro64fanadjust.profile"
+#define PROFILE_PATH_SIZE 128
+#define PROFILE_BOARD_SIZE 64
+
+// Fills in the profile of every fan in table that path has one for. A
+// profile is only used on the board it was calibrated on, a missing one or
+// one from another board leaves the fans uncalibrated.
+int calibrate_load(struct zone_table *table, const char *path);
+// Measures every fan that has a tachometer and saves the profiles to path:
+// full speed rpm first, then pwm is stepped down until the fan stops and
+// up again from standstill until it starts. All other fans run at full
+// speed meanwhile, and the sweep gives up if a sensor reaches the lowest
+// max_temp of the table. Takes a few minutes, table must be open.
+int calibrate_run(struct zone_table *table, const char *path);
+
+#endif
@@ -0,0 +1,172 @@
+#include "client.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "controller.h"
+#include "log.h"
+#include "shared.h"
+
+static int request_floor(const struct client_request *request,
+			 const char *shared_name)
+{
+	struct shared shared;
+	int slot = -1;
+	if (shared_attach(&shared, shared_name)) {
+		log_fail("shared_attach", __FILE__, __LINE__);
+		return -1;
+	}
+	int status = shared_request(&shared, &slot, request->pwm,
+				    request->duration_ms);
+	if (status) {
+		log_fail("shared_request", __FILE__, __LINE__);
+	} else if (shared_wake(&shared)) {
+		// Still merged on the next sample.
+		log_fail("shared_wake", __FILE__, __LINE__);
+	}
+	shared_detach(&shared);
+
+	return status;
+}
+
+static const char *controller_name(int type)
+{
+	switch (type) {
+	case CONTROLLER_LINEAR:
+		return "linear";
+	case CONTROLLER_PID:
+		return "pid";
+	case CONTROLLER_CURVE:
+		return "curve";
+	case CONTROLLER_MPC:
+		return "mpc";
+	default:
+		return "unknown";
+	}
+}
+
+static void print_status(const struct api_status *status)
+{
+	printf("ticks %llu, floor %d%s\n", (unsigned long long)status->ticks,
+	       status->floor, status->emergency ? ", emergency" : "");
+	printf("throttle events %llu, throttled %.3f s%s, curves lowered by "
+	       "%.3f C\n",
+	       (unsigned long long)status->throttle_events,
+	       status->throttled_ms / 1000.0,
+	       status->throttled ? ", throttled now" : "",
+	       status->curve_shift / 1000.0);
+	for (int i = 0; i < status->sensor_count && i < MAX_SENSORS; i++) {
+		const struct api_sensor *sensor = &status->sensors[i];
+		printf("sensor %d %s/%s %.3f C, filtered %.3f C\n", i,
+		       sensor->name, sensor->node, sensor->temp / 1000.0,
+		       sensor->filtered / 1000.0);
+	}
+	for (int i = 0; i < status->fan_count && i < MAX_FANS; i++) {
+		const struct api_fan *fan = &status->fans[i];
+		printf("fan %s/%s pwm %d target %d", fan->name, fan->node,
+		       fan->speed, fan->target);
+		if (fan->rpm >= 0) {
+			printf(" rpm %d%s", fan->rpm,
+			       fan->stalled ? " stalled" : "");
+		}
+		printf("\n");
+	}
+	for (int i = 0; i < status->override_count && i < API_OVERRIDES;
+	     i++) {
+		const struct api_override *override = &status->overrides[i];
+		printf("override %u pwm %d for %u ms\n", override->id,
+		       override->pwm, override->remaining_ms);
+	}
+}
+
+static void print_curves(const struct api_curves *curves)
+{
+	for (int i = 0; i < curves->channel_count && i < API_CHANNELS; i++) {
+		const struct api_channel *channel = &curves->channels[i];
+		printf("zone %d ", channel->zone);
+		if (channel->sensor >= 0) {
+			printf("sensor %d ", channel->sensor);
+		}
+		printf("%s", controller_name(channel->type));
+		if (channel->type == CONTROLLER_PID ||
+		    channel->type == CONTROLLER_MPC) {
+			printf(" target %.3f C",
+			       channel->pid_target / 1000.0);
+		}
+		for (int j = 0;
+		     j < channel->point_count && j < CURVE_MAX_POINTS; j++) {
+			printf(" %.3f:%d", channel->points[j].temp / 1000.0,
+			       channel->points[j].speed);
+		}
+		printf("\n");
+	}
+}
+
+// One request over a fresh connection. Prints and fails on a refusal.
+static int call(const char *socket_path, const struct api_request *request,
+		struct api_response *out_response)
+{
+	int fd = api_connect(socket_path);
+	if (fd < 0) {
+		log_fail("api_connect", __FILE__, __LINE__);
+		return -1;
+	}
+	int status = api_call(fd, request, out_response);
+	close(fd);
+	if (status) {
+		log_fail("api_call", __FILE__, __LINE__);
+		return -1;
+	}
+	if (out_response->error) {
+		fprintf(stderr, "the daemon refused: %s\n",
+			strerror(-out_response->error));
+		return -1;
+	}
+
+	return 0;
+}
+
+int client_run(const struct client_request *request, const char *shared_name,
+	       const char *socket_path)
+{
+	// Curves make it too large for the stack.
+	static struct api_response response;
+	struct api_request api_request = {
+		.version = API_VERSION,
+	};
+
+	switch (request->action) {
+	case CLIENT_REQUEST_FLOOR:
+		return request_floor(request, shared_name);
+	case CLIENT_STATUS:
+		api_request.command = API_GET_STATUS;
+		if (call(socket_path, &api_request, &response)) {
+			return -1;
+		}
+		print_status(&response.status);
+		api_request.command = API_GET_CURVES;
+		if (call(socket_path, &api_request, &response)) {
+			return -1;
+		}
+		print_curves(&response.curves);
+		return 0;
+	case CLIENT_OVERRIDE:
+		api_request.command = API_SET_OVERRIDE;
+		api_request.pwm = request->pwm;
+		api_request.duration_ms = (uint32_t)request->duration_ms;
+		if (call(socket_path, &api_request, &response)) {
+			return -1;
+		}
+		printf("override %u pwm %d for %u ms\n", response.override.id,
+		       response.override.pwm, response.override.remaining_ms);
+		return 0;
+	case CLIENT_CLEAR_OVERRIDE:
+		api_request.command = API_CLEAR_OVERRIDE;
+		api_request.id = (uint32_t)request->id;
+		return call(socket_path, &api_request, &response);
+	default:
+		return -1;
+	}
+}
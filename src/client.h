@@ -0,0 +1,26 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+// Talking to a running daemon from the command line, through shared
+// memory for floors and through the api socket for everything else.
+enum client_action {
+	CLIENT_NONE,
+	CLIENT_REQUEST_FLOOR,
+	CLIENT_STATUS,
+	CLIENT_OVERRIDE,
+	CLIENT_CLEAR_OVERRIDE,
+};
+
+struct client_request {
+	enum client_action action;
+	int pwm;
+	long duration_ms;
+	// Override to clear, 0 for all of them.
+	long id;
+};
+
+// Prints the outcome to stdout. Requests outlive this process.
+int client_run(const struct client_request *request, const char *shared_name,
+	       const char *socket_path);
+
+#endif
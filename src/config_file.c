@@ -0,0 +1,74 @@
+#include "config_file.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLANKS " \t\r\n"
+
+static char *trim(char *str)
+{
+	str += strspn(str, BLANKS);
+	size_t length = strlen(str);
+	while (length && strchr(BLANKS, str[length - 1])) {
+		length--;
+	}
+	str[length] = '\0';
+
+	return str;
+}
+
+static int apply_line(char *line, config_file_apply apply, void *ctx)
+{
+	line[strcspn(line, "#")] = '\0';
+	char *name = trim(line);
+	if (!*name) {
+		return 0;
+	}
+
+	size_t name_length = strcspn(name, "=" BLANKS);
+	char *value = name + name_length;
+	if (*value) {
+		*value++ = '\0';
+		value = trim(value);
+		if (*value == '=') {
+			value = trim(value + 1);
+		}
+	}
+	if (!*value) {
+		fprintf(stderr, "%s has no value\n", name);
+		return -1;
+	}
+
+	return apply(name, value, ctx);
+}
+
+int config_file_read(const char *path, config_file_apply apply, void *ctx)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	int status = 0;
+	char *line = NULL;
+	size_t line_length = 0;
+	for (int number = 1; getline(&line, &line_length, f) > 0; number++) {
+		if (apply_line(line, apply, ctx)) {
+			fprintf(stderr, "%s:%d: invalid setting\n", path,
+				number);
+			status = -1;
+			break;
+		}
+	}
+	free(line);
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return -1;
+	}
+
+	return status;
+}
@@ -0,0 +1,13 @@
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+// One setting per line, named like the long command-line option without
+// the dashes: "name = value" or "name value". Blank lines and anything
+// after '#' are ignored. Lines are applied in order, so zone, sensor and
+// fan lines build zones exactly like the options do.
+typedef int (*config_file_apply)(const char *name, char *value, void *ctx);
+
+// Calls apply for every setting and stops at the first one it rejects.
+int config_file_read(const char *path, config_file_apply apply, void *ctx);
+
+#endif
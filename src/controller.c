@@ -0,0 +1,232 @@
+#include "controller.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int clamp_speed(int speed)
+{
+	if (speed < 0) {
+		return 0;
+	}
+	if (speed > MAX_FAN_SPEED) {
+		return MAX_FAN_SPEED;
+	}
+	return speed;
+}
+
+#ifdef FLOAT_MATH
+// Reference implementation of the ramp in floating point, selected with
+// -DFLOAT_MATH to check the fixed-point path against.
+static int linear_update(struct controller *controller,
+			 const struct controller_input *input)
+{
+	const struct controller_config *config = controller->config;
+
+	if (input->temp <= config->min_temp) {
+		return 0;
+	}
+	if (input->temp >= config->max_temp) {
+		return MAX_FAN_SPEED;
+	}
+	double multiplier = (double)(MAX_FAN_SPEED - config->min_fan_speed) /
+			    (config->max_temp - config->min_temp);
+	return (int)(config->min_fan_speed +
+		     multiplier * (input->temp - config->min_temp) + 0.5);
+}
+#else
+static int linear_update(struct controller *controller,
+			 const struct controller_input *input)
+{
+	const struct controller_config *config = controller->config;
+
+	if (input->temp <= config->min_temp) {
+		return 0;
+	}
+	if (input->temp >= config->max_temp) {
+		return MAX_FAN_SPEED;
+	}
+	int64_t speed = ((int64_t)config->min_fan_speed << CURVE_FRACTION_BITS) +
+			controller->linear.slope *
+				(input->temp - config->min_temp);
+	return (int)((speed + (1 << (CURVE_FRACTION_BITS - 1))) >>
+		     CURVE_FRACTION_BITS);
+}
+#endif
+
+static int pid_update(struct controller *controller,
+		      const struct controller_input *input)
+{
+	const struct controller_config *config = controller->config;
+	struct pid_state *pid = &controller->pid;
+
+	if (input->temp >= config->max_temp) {
+		pid->last_temp = input->temp;
+		pid->has_last = 1;
+		return MAX_FAN_SPEED;
+	}
+	if (input->temp <= config->min_temp) {
+		// The fan is off, so whatever was accumulated no longer
+		// describes the plant.
+		pid->integral = 0.0;
+		pid->last_temp = input->temp;
+		pid->has_last = 1;
+		return 0;
+	}
+
+	double dt = input->dt_ms / 1000.0;
+	double error = input->temp - config->pid_target;
+	// Differentiate the measurement rather than the error so that a
+	// setpoint change does not kick the output.
+	double derivative = 0.0;
+	if (pid->has_last && dt > 0.0) {
+		derivative = (input->temp - pid->last_temp) / dt;
+	}
+	pid->last_temp = input->temp;
+	pid->has_last = 1;
+
+	double feed_forward = config->pid_ff * input->load * MAX_FAN_SPEED;
+	double unsaturated = feed_forward + config->pid_kp * error +
+			     config->pid_ki * pid->integral +
+			     config->pid_kd * derivative;
+	// Conditional integration: stop accumulating while the output is
+	// pinned and the error would push it further into saturation.
+	double step = error * dt;
+	if (!(unsaturated >= MAX_FAN_SPEED && step > 0.0) &&
+	    !(unsaturated <= config->min_fan_speed && step < 0.0)) {
+		pid->integral += step;
+	}
+
+	double speed = feed_forward + config->pid_kp * error +
+		       config->pid_ki * pid->integral +
+		       config->pid_kd * derivative;
+	if (speed < config->min_fan_speed) {
+		return config->min_fan_speed;
+	}
+	if (speed > MAX_FAN_SPEED) {
+		return MAX_FAN_SPEED;
+	}
+	return (int)(speed + 0.5);
+}
+
+static int curve_update(struct controller *controller,
+			const struct controller_input *input)
+{
+	return curve_lookup(controller->curve.lut, input->temp);
+}
+
+static int mpc_update(struct controller *controller,
+		      const struct controller_input *input)
+{
+	const struct controller_config *config = controller->config;
+	struct mpc *mpc = &controller->mpc;
+
+	// The model learns from every update, including those the bounds
+	// below decide.
+	mpc_observe(mpc, input->temp, input->load, input->speed,
+		    input->dt_ms, config->mpc_horizon_ms);
+	if (input->temp <= config->min_temp) {
+		return 0;
+	}
+	if (input->temp >= config->max_temp) {
+		return MAX_FAN_SPEED;
+	}
+	if (!mpc_ready(mpc)) {
+		return (int)(config->min_fan_speed +
+			     (double)(MAX_FAN_SPEED - config->min_fan_speed) *
+				     (input->temp - config->min_temp) /
+				     (config->max_temp - config->min_temp) +
+			     0.5);
+	}
+	int speed = mpc_plan(mpc, input->temp, config->pid_target,
+			     config->mpc_horizon_ms);
+	if (speed && speed < config->min_fan_speed) {
+		return config->min_fan_speed;
+	}
+	return speed;
+}
+
+// Temperature trails load by seconds. Busy cores running near their top
+// frequency are about to heat up, so spin the fan up before the sensor
+// notices.
+static int load_floor(const struct controller_config *config,
+		      const struct controller_input *input)
+{
+	if (config->load_boost <= 0.0) {
+		return 0;
+	}
+	double pressure = input->load * input->freq;
+	if (pressure <= config->load_threshold) {
+		return 0;
+	}
+	double floor = config->load_boost * MAX_FAN_SPEED *
+		       (pressure - config->load_threshold) /
+		       (1.0 - config->load_threshold);
+	if (floor < config->min_fan_speed) {
+		return config->min_fan_speed;
+	}
+	return (int)(floor + 0.5);
+}
+
+int controller_init(struct controller *controller,
+		    const struct controller_config *config)
+{
+	memset(controller, 0, sizeof(*controller));
+	controller->config = config;
+
+	switch (config->type) {
+	case CONTROLLER_LINEAR:
+		controller->update = linear_update;
+		controller->linear.slope =
+			((int64_t)(MAX_FAN_SPEED - config->min_fan_speed)
+			 << CURVE_FRACTION_BITS) /
+			(config->max_temp - config->min_temp);
+		break;
+	case CONTROLLER_PID:
+		controller->update = pid_update;
+		break;
+	case CONTROLLER_CURVE:
+		if (!config->curve.point_count) {
+			fprintf(stderr, "curve has no points\n");
+			return -1;
+		}
+		controller->update = curve_update;
+		curve_build_lut(&config->curve, controller->curve.lut);
+		break;
+	case CONTROLLER_MPC:
+		if (config->mpc_horizon_ms < MPC_STEP_MS) {
+			fprintf(stderr, "mpc horizon must be at least %d ms\n",
+				MPC_STEP_MS);
+			return -1;
+		}
+		controller->update = mpc_update;
+		mpc_reset(&controller->mpc);
+		break;
+	default:
+		fprintf(stderr, "unknown controller type %d\n", config->type);
+		return -1;
+	}
+
+	return 0;
+}
+
+void controller_adopt(struct controller *controller,
+		      const struct controller *old)
+{
+	// Linear and curve state only depends on the config.
+	if (controller->update == pid_update && old->update == pid_update) {
+		controller->pid = old->pid;
+	}
+	// A fitted model stays valid for the same hardware.
+	if (controller->update == mpc_update && old->update == mpc_update) {
+		controller->mpc = old->mpc;
+	}
+}
+
+int controller_update(struct controller *controller,
+		      const struct controller_input *input)
+{
+	int speed = controller->update(controller, input);
+	int floor = load_floor(controller->config, input);
+
+	return clamp_speed(speed > floor ? speed : floor);
+}
@@ -0,0 +1,100 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "curve.h"
+#include "hwmon.h"
+#include "mpc.h"
+
+// Fixed-point fraction bits used by the linear ramp.
+#define CURVE_FRACTION_BITS 24
+#define PID_TARGET_UNSET LONG_MIN
+
+enum controller_type {
+	CONTROLLER_LINEAR,
+	CONTROLLER_PID,
+	CONTROLLER_CURVE,
+	// Model-predictive: the lowest speed a thermal model fitted online
+	// predicts keeps the temperature below pid_target over a horizon.
+	CONTROLLER_MPC,
+};
+
+// Temperatures are in millidegrees Celsius, as sysfs reports them.
+struct controller_config {
+	enum controller_type type;
+	long min_temp;
+	long max_temp;
+	int min_fan_speed;
+	// PID only. Gains are per millidegree of error, the feed-forward gain
+	// is the share of MAX_FAN_SPEED added at 100% CPU utilisation.
+	long pid_target;
+	double pid_kp;
+	double pid_ki;
+	double pid_kd;
+	double pid_ff;
+	// Curve only. Without points the curve is the linear ramp.
+	struct curve curve;
+	// MPC only, it plans against pid_target. The linear ramp runs until
+	// the model is fitted.
+	long mpc_horizon_ms;
+	// Load prediction, applied to every controller type. Once the load
+	// pressure exceeds load_threshold the speed is raised to at least
+	// load_boost * MAX_FAN_SPEED, scaled by how far it exceeds it.
+	double load_boost;
+	double load_threshold;
+};
+
+struct controller_input {
+	long temp;
+	// CPU utilisation in [0, 1], 0 when not measured.
+	double load;
+	// Highest cur/max cpufreq ratio in [0, 1], 0 when not measured.
+	double freq;
+	// Milliseconds since the previous update, 0 on the first one.
+	long dt_ms;
+	// What the fans ran at since the previous update, the fastest of the
+	// zone's fans.
+	int speed;
+};
+
+struct linear_state {
+	// (MAX_FAN_SPEED - min_fan_speed) / (max_temp - min_temp), scaled by
+	// 2^CURVE_FRACTION_BITS.
+	int64_t slope;
+};
+
+struct curve_state {
+	uint8_t lut[CURVE_LUT_SIZE];
+};
+
+struct pid_state {
+	double integral;
+	long last_temp;
+	int has_last;
+};
+
+struct controller {
+	const struct controller_config *config;
+	int (*update)(struct controller *controller,
+		      const struct controller_input *input);
+	union {
+		struct linear_state linear;
+		struct pid_state pid;
+		struct curve_state curve;
+		struct mpc mpc;
+	};
+};
+
+int controller_init(struct controller *controller,
+		    const struct controller_config *config);
+// Keeps the runtime state of old, typically the controller a reloaded
+// config replaces, if it is the same type as controller.
+void controller_adopt(struct controller *controller,
+		      const struct controller *old);
+// Returns the fan speed to apply, in [0, MAX_FAN_SPEED].
+int controller_update(struct controller *controller,
+		      const struct controller_input *input);
+
+#endif
@@ -0,0 +1,75 @@
+#include "cpu_load.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "number.h"
+
+#define PROC_STAT_PATH "/proc/stat"
+#define PROC_STAT_FIELDS 8
+
+int cpu_load_open(struct cpu_load *load)
+{
+	memset(load, 0, sizeof(*load));
+	load->stat_fd = open(PROC_STAT_PATH, O_RDONLY | O_CLOEXEC);
+	if (load->stat_fd < 0) {
+		perror("open(" PROC_STAT_PATH ") failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+void cpu_load_close(struct cpu_load *load)
+{
+	if (close(load->stat_fd) < 0) {
+		perror("close() failed");
+	}
+	load->stat_fd = -1;
+}
+
+int cpu_load_read(struct cpu_load *load, double *out_utilisation)
+{
+	// Only the aggregate "cpu" line at the start of the file is needed, so
+	// a single short pread is enough. The kernel regenerates the contents
+	// on every read from offset 0.
+	ssize_t r = pread(load->stat_fd, load->buffer,
+			  sizeof(load->buffer) - 1, 0);
+	if (r < 0) {
+		perror("pread(" PROC_STAT_PATH ") failed");
+		return -1;
+	}
+	load->buffer[r] = '\0';
+	if (strncmp(load->buffer, "cpu ", 4)) {
+		fprintf(stderr, PROC_STAT_PATH " has unexpected format\n");
+		return -1;
+	}
+
+	// user nice system idle iowait irq softirq steal
+	unsigned long long fields[PROC_STAT_FIELDS] = { 0 };
+	const char *cursor = load->buffer + 4;
+	for (int i = 0; i < PROC_STAT_FIELDS; i++) {
+		long long field = 0;
+		if (parse_long_long(cursor, &cursor, &field) || field < 0) {
+			log_fail("parse_long_long", __FILE__, __LINE__);
+			return -1;
+		}
+		fields[i] = field;
+	}
+	unsigned long long total = 0;
+	for (int i = 0; i < PROC_STAT_FIELDS; i++) {
+		total += fields[i];
+	}
+	unsigned long long busy = total - fields[3] - fields[4];
+
+	unsigned long long total_delta = total - load->last_total;
+	unsigned long long busy_delta = busy - load->last_busy;
+	load->last_total = total;
+	load->last_busy = busy;
+	*out_utilisation = total_delta ? (double)busy_delta / total_delta : 0.0;
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef CPU_LOAD_H
+#define CPU_LOAD_H
+
+#define CPU_LOAD_BUFFER_SIZE 256
+
+struct cpu_load {
+	int stat_fd;
+	unsigned long long last_busy;
+	unsigned long long last_total;
+	char buffer[CPU_LOAD_BUFFER_SIZE];
+};
+
+int cpu_load_open(struct cpu_load *load);
+void cpu_load_close(struct cpu_load *load);
+// Returns the share of time all CPUs spent busy since the previous call, in
+// the range [0, 1]. The first call reports the average since boot.
+int cpu_load_read(struct cpu_load *load, double *out_utilisation);
+
+#endif
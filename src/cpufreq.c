@@ -0,0 +1,148 @@
+#include "cpufreq.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "number.h"
+
+static int read_freq(int fd, char *buffer, size_t buffer_length,
+		     double *out_freq)
+{
+	ssize_t r = pread(fd, buffer, buffer_length - 1, 0);
+	if (r < 0) {
+		perror("pread() failed");
+		return -1;
+	}
+	buffer[r] = '\0';
+	long long freq = 0;
+	if (parse_long_long(buffer, NULL, &freq)) {
+		log_fail("parse_long_long", __FILE__, __LINE__);
+		return -1;
+	}
+	*out_freq = freq;
+
+	return 0;
+}
+
+static int open_policy(char *policy_name, char *buffer, size_t buffer_length,
+		       struct cpufreq_policy *out_policy)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), CPUFREQ_DIR_PATH "%s/cpuinfo_max_freq",
+		     policy_name) < 0) {
+		log_fail("snprintf", __FILE__, __LINE__);
+		return -1;
+	}
+	int max_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (max_fd < 0) {
+		perror("open() failed");
+		return -1;
+	}
+	int status = read_freq(max_fd, buffer, buffer_length,
+			       &out_policy->max_freq);
+	if (close(max_fd) < 0) {
+		perror("close() failed");
+		status = -1;
+	}
+	if (status) {
+		log_fail("read_freq", __FILE__, __LINE__);
+		return -1;
+	}
+	if (out_policy->max_freq <= 0.0) {
+		fprintf(stderr, "%s has no maximum frequency\n", policy_name);
+		return -1;
+	}
+
+	if (snprintf(path, sizeof(path), CPUFREQ_DIR_PATH "%s/scaling_cur_freq",
+		     policy_name) < 0) {
+		log_fail("snprintf", __FILE__, __LINE__);
+		return -1;
+	}
+	out_policy->cur_freq_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (out_policy->cur_freq_fd < 0) {
+		perror("open() failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+int cpufreq_open(struct cpufreq *cpufreq)
+{
+	memset(cpufreq, 0, sizeof(*cpufreq));
+
+	DIR *dir = opendir(CPUFREQ_DIR_PATH);
+	if (!dir) {
+		perror("opendir(" CPUFREQ_DIR_PATH ") failed");
+		return -1;
+	}
+	errno = 0;
+	for (struct dirent *dir_entry = readdir(dir); dir_entry;
+	     dir_entry = readdir(dir)) {
+		if (strncmp(dir_entry->d_name, "policy", 6)) {
+			continue;
+		}
+		if (cpufreq->policy_count == CPUFREQ_MAX_POLICIES) {
+			fprintf(stderr, "too many cpufreq policies\n");
+			break;
+		}
+		if (open_policy(dir_entry->d_name, cpufreq->buffer,
+				sizeof(cpufreq->buffer),
+				&cpufreq->policies[cpufreq->policy_count])) {
+			log_fail("open_policy", __FILE__, __LINE__);
+			continue;
+		}
+		cpufreq->policy_count++;
+	}
+	if (errno) {
+		perror("readdir() failed");
+	}
+	if (closedir(dir)) {
+		perror("closedir(" CPUFREQ_DIR_PATH ") failed");
+	}
+
+	if (!cpufreq->policy_count) {
+		fprintf(stderr, "no usable cpufreq policies\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void cpufreq_close(struct cpufreq *cpufreq)
+{
+	for (int i = 0; i < cpufreq->policy_count; i++) {
+		if (close(cpufreq->policies[i].cur_freq_fd) < 0) {
+			perror("close() failed");
+		}
+	}
+	cpufreq->policy_count = 0;
+}
+
+int cpufreq_read(struct cpufreq *cpufreq, double *out_ratio)
+{
+	double ratio = 0.0;
+
+	for (int i = 0; i < cpufreq->policy_count; i++) {
+		struct cpufreq_policy *policy = &cpufreq->policies[i];
+		double freq = 0.0;
+		if (read_freq(policy->cur_freq_fd, cpufreq->buffer,
+			      sizeof(cpufreq->buffer), &freq)) {
+			log_fail("read_freq", __FILE__, __LINE__);
+			return -1;
+		}
+		if (freq / policy->max_freq > ratio) {
+			ratio = freq / policy->max_freq;
+		}
+	}
+	*out_ratio = ratio > 1.0 ? 1.0 : ratio;
+
+	return 0;
+}
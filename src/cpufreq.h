@@ -0,0 +1,26 @@
+#ifndef CPUFREQ_H
+#define CPUFREQ_H
+
+#define CPUFREQ_DIR_PATH "/sys/devices/system/cpu/cpufreq/"
+#define CPUFREQ_MAX_POLICIES 8
+#define CPUFREQ_BUFFER_SIZE 32
+
+struct cpufreq_policy {
+	int cur_freq_fd;
+	double max_freq;
+};
+
+struct cpufreq {
+	int policy_count;
+	struct cpufreq_policy policies[CPUFREQ_MAX_POLICIES];
+	char buffer[CPUFREQ_BUFFER_SIZE];
+};
+
+// Opens scaling_cur_freq of every cpufreq policy, one per cluster. On the
+// RK3399 that is policy0 for the A53 cores and policy4 for the A72 cores.
+int cpufreq_open(struct cpufreq *cpufreq);
+void cpufreq_close(struct cpufreq *cpufreq);
+// Returns the highest cur/max frequency ratio across all policies.
+int cpufreq_read(struct cpufreq *cpufreq, double *out_ratio);
+
+#endif
@@ -0,0 +1,116 @@
+#include "curve.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hwmon.h"
+#include "number.h"
+
+#ifdef BAKED_CURVE
+static const struct curve_point baked_points[] = { BAKED_CURVE };
+#endif
+
+static int check_points(const struct curve *curve)
+{
+	if (!curve->point_count) {
+		fprintf(stderr, "curve has no points\n");
+		return -1;
+	}
+	for (int i = 0; i < curve->point_count; i++) {
+		const struct curve_point *point = &curve->points[i];
+		if (point->speed < 0 || point->speed > MAX_FAN_SPEED) {
+			fprintf(stderr, "curve speed %d is not in [0, %d]\n",
+				point->speed, MAX_FAN_SPEED);
+			return -1;
+		}
+		if (i && point->temp <= curve->points[i - 1].temp) {
+			fprintf(stderr, "curve temperatures must increase\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int curve_parse(struct curve *curve, const char *spec)
+{
+	const char *str = spec;
+
+	memset(curve, 0, sizeof(*curve));
+	for (;;) {
+		long long temp = 0;
+		long long speed = 0;
+		if (curve->point_count == CURVE_MAX_POINTS) {
+			fprintf(stderr, "more than %d curve points\n",
+				CURVE_MAX_POINTS);
+			return -1;
+		}
+		if (parse_long_long(str, &str, &temp) || *str != ':' ||
+		    parse_long_long(str + 1, &str, &speed) ||
+		    speed < 0 || speed > MAX_FAN_SPEED) {
+			fprintf(stderr, "invalid curve point in %s\n", spec);
+			return -1;
+		}
+		curve->points[curve->point_count++] = (struct curve_point){
+			.temp = (long)temp,
+			.speed = (int)speed,
+		};
+		if (*str == '\0') {
+			break;
+		}
+		if (*str != ',') {
+			fprintf(stderr, "trailing characters: %s\n", str);
+			return -1;
+		}
+		str++;
+	}
+
+	return check_points(curve);
+}
+
+int curve_baked(struct curve *curve)
+{
+#ifdef BAKED_CURVE
+	_Static_assert(sizeof(baked_points) / sizeof(baked_points[0]) <=
+			       CURVE_MAX_POINTS,
+		       "too many BAKED_CURVE points");
+	memset(curve, 0, sizeof(*curve));
+	curve->point_count = sizeof(baked_points) / sizeof(baked_points[0]);
+	memcpy(curve->points, baked_points, sizeof(baked_points));
+	return check_points(curve);
+#else
+	(void)curve;
+	return -1;
+#endif
+}
+
+void curve_build_lut(const struct curve *curve, uint8_t *lut)
+{
+	const struct curve_point *first = &curve->points[0];
+	const struct curve_point *last = &curve->points[curve->point_count - 1];
+	int segment = 0;
+
+	for (int i = 0; i < CURVE_LUT_SIZE; i++) {
+		long temp = i * 1000L;
+		if (temp < first->temp) {
+			lut[i] = 0;
+			continue;
+		}
+		if (temp >= last->temp) {
+			lut[i] = (uint8_t)last->speed;
+			continue;
+		}
+		while (curve->points[segment + 1].temp <= temp) {
+			segment++;
+		}
+		const struct curve_point *from = &curve->points[segment];
+		const struct curve_point *to = &curve->points[segment + 1];
+		long span = to->temp - from->temp;
+		long rise = (long)(to->speed - from->speed) * (temp - from->temp);
+		// Round to the nearest step, rise may be negative.
+		lut[i] = (uint8_t)(from->speed +
+				   (rise >= 0 ? rise + span / 2
+					      : rise - span / 2) /
+					   span);
+	}
+}
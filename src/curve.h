@@ -0,0 +1,45 @@
+#ifndef CURVE_H
+#define CURVE_H
+
+#include <stdint.h>
+
+#define CURVE_MAX_POINTS 16
+// One entry per whole degree Celsius.
+#define CURVE_LUT_SIZE 256
+
+struct curve_point {
+	// Millidegrees Celsius.
+	long temp;
+	int speed;
+};
+
+// A piecewise linear fan curve. The fan is off below the first point,
+// runs at the last point's speed above the last one and is interpolated
+// in between.
+struct curve {
+	int point_count;
+	struct curve_point points[CURVE_MAX_POINTS];
+};
+
+// TEMP:SPEED[,TEMP:SPEED...] with strictly increasing temperatures.
+int curve_parse(struct curve *curve, const char *spec);
+// The points baked in with -DBAKED_CURVE, for example
+// -DBAKED_CURVE='{40000,0},{60000,128},{75000,255}'. Returns -1 when the
+// build has none.
+int curve_baked(struct curve *curve);
+// Samples the curve at every whole degree, so evaluating it is a single
+// table index.
+void curve_build_lut(const struct curve *curve, uint8_t *lut);
+
+static inline int curve_lookup(const uint8_t *lut, long temp)
+{
+	if (temp < 0) {
+		return lut[0];
+	}
+	if (temp >= CURVE_LUT_SIZE * 1000L) {
+		return lut[CURVE_LUT_SIZE - 1];
+	}
+	return lut[temp / 1000];
+}
+
+#endif
@@ -0,0 +1,212 @@
+#include "device_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+
+#define DEVICE_CACHE_NAME_SIZE 64
+
+struct device_cache_entry {
+	char dir_path[DEVICE_CACHE_PATH_SIZE];
+	char name[DEVICE_CACHE_NAME_SIZE];
+	char path[DEVICE_CACHE_PATH_SIZE];
+	ino_t ino;
+};
+
+static struct device_cache_entry entries[DEVICE_CACHE_ENTRIES];
+static int entry_count = 0;
+static bool dirty = false;
+
+static struct device_cache_entry *find_entry(const char *dir_path,
+					     const char *name,
+					     size_t name_length)
+{
+	for (int i = 0; i < entry_count; i++) {
+		struct device_cache_entry *entry = &entries[i];
+		if (!strcmp(entry->dir_path, dir_path) &&
+		    strlen(entry->name) == name_length &&
+		    !strncmp(entry->name, name, name_length)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static int copy_field(char *out, size_t out_length, const char *str,
+		      size_t length)
+{
+	if (length >= out_length) {
+		fprintf(stderr, "device cache field too long: %.*s\n",
+			(int)length, str);
+		return -1;
+	}
+	memcpy(out, str, length);
+	out[length] = '\0';
+
+	return 0;
+}
+
+static int parse_entry(char *line, struct device_cache_entry *out_entry)
+{
+	char *save = NULL;
+	char *dir_path = strtok_r(line, "\t", &save);
+	char *name = strtok_r(NULL, "\t", &save);
+	char *path = strtok_r(NULL, "\t", &save);
+	char *ino = strtok_r(NULL, "\t\n", &save);
+	if (!dir_path || !name || !path || !ino) {
+		return -1;
+	}
+	if (copy_field(out_entry->dir_path, sizeof(out_entry->dir_path),
+		       dir_path, strlen(dir_path)) ||
+	    copy_field(out_entry->name, sizeof(out_entry->name), name,
+		       strlen(name)) ||
+	    copy_field(out_entry->path, sizeof(out_entry->path), path,
+		       strlen(path))) {
+		return -1;
+	}
+	char *end = NULL;
+	errno = 0;
+	out_entry->ino = strtoull(ino, &end, 10);
+	if (errno || end == ino) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int device_cache_load(const char *cache_path)
+{
+	FILE *f = fopen(cache_path, "r");
+	if (!f) {
+		// First start after boot, /run is empty.
+		if (errno == ENOENT) {
+			return 0;
+		}
+		fprintf(stderr, "fopen(%s) failed: %s\n", cache_path,
+			strerror(errno));
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t line_length = 0;
+	entry_count = 0;
+	while (entry_count < DEVICE_CACHE_ENTRIES &&
+	       getline(&line, &line_length, f) > 0) {
+		// A bad entry only costs a rescan, so skip it.
+		if (!parse_entry(line, &entries[entry_count])) {
+			entry_count++;
+		}
+	}
+	free(line);
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return -1;
+	}
+	dirty = false;
+
+	return 0;
+}
+
+int device_cache_save(const char *cache_path)
+{
+	char tmp_path[DEVICE_CACHE_PATH_SIZE + 4];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path) >=
+	    (int)sizeof(tmp_path)) {
+		fprintf(stderr, "device cache path too long\n");
+		return -1;
+	}
+
+	FILE *f = fopen(tmp_path, "w");
+	if (!f) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", tmp_path,
+			strerror(errno));
+		return -1;
+	}
+	int status = 0;
+	for (int i = 0; i < entry_count; i++) {
+		struct device_cache_entry *entry = &entries[i];
+		if (fprintf(f, "%s\t%s\t%s\t%llu\n", entry->dir_path,
+			    entry->name, entry->path,
+			    (unsigned long long)entry->ino) < 0) {
+			log_fail("fprintf", __FILE__, __LINE__);
+			status = -1;
+			break;
+		}
+	}
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		status = -1;
+	}
+	// Write then rename so a crash never leaves a torn cache behind.
+	if (!status && rename(tmp_path, cache_path)) {
+		perror("rename() failed");
+		status = -1;
+	}
+	if (status) {
+		remove(tmp_path);
+		return -1;
+	}
+	dirty = false;
+
+	return 0;
+}
+
+bool device_cache_dirty(void)
+{
+	return dirty;
+}
+
+int device_cache_lookup(const char *dir_path, const char *name,
+			size_t name_length, char *out_path,
+			size_t out_path_length)
+{
+	struct device_cache_entry *entry =
+		find_entry(dir_path, name, name_length);
+	if (!entry) {
+		return -1;
+	}
+	struct stat st;
+	if (stat(entry->path, &st) || st.st_ino != entry->ino) {
+		return -1;
+	}
+	if (copy_field(out_path, out_path_length, entry->path,
+		       strlen(entry->path))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int device_cache_store(const char *dir_path, const char *name,
+		       size_t name_length, const char *path, ino_t ino)
+{
+	struct device_cache_entry new_entry = {
+		.ino = ino,
+	};
+	if (copy_field(new_entry.dir_path, sizeof(new_entry.dir_path),
+		       dir_path, strlen(dir_path)) ||
+	    copy_field(new_entry.name, sizeof(new_entry.name), name,
+		       name_length) ||
+	    copy_field(new_entry.path, sizeof(new_entry.path), path,
+		       strlen(path))) {
+		return -1;
+	}
+
+	struct device_cache_entry *entry =
+		find_entry(dir_path, name, name_length);
+	if (!entry) {
+		if (entry_count == DEVICE_CACHE_ENTRIES) {
+			fprintf(stderr, "device cache is full\n");
+			return -1;
+		}
+		entry = &entries[entry_count++];
+	}
+	*entry = new_entry;
+	dirty = true;
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DEFAULT_DEVICE_CACHE_PATH "/run/rockpro64fanadjust.cache"
+#define DEVICE_CACHE_ENTRIES 32
+#define DEVICE_CACHE_PATH_SIZE 128
+
+// Remembers which sysfs directory a device name resolved to, together with
+// the inode of that directory. hwmonN numbering is not stable across boots
+// and driver reloads, but a reloaded driver always gets a fresh kernfs
+// inode, so a single stat() tells whether a cached path is still right.
+int device_cache_load(const char *cache_path);
+int device_cache_save(const char *cache_path);
+bool device_cache_dirty(void);
+// Fills out_path and returns 0 if name was resolved under dir_path before
+// and the directory still has the inode it had back then.
+int device_cache_lookup(const char *dir_path, const char *name,
+			size_t name_length, char *out_path,
+			size_t out_path_length);
+int device_cache_store(const char *dir_path, const char *name,
+		       size_t name_length, const char *path, ino_t ino);
+
+#endif
@@ -0,0 +1,363 @@
+#include "emergency.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "number.h"
+
+#define TRIP_TYPE_SIZE 16
+
+// read_value() without the error messages, which would flood the log from
+// a sensor that stays broken for a while.
+static int read_quietly(int fd, char *value_str, size_t value_str_length,
+			long long *out_value)
+{
+	ssize_t r = pread(fd, value_str, value_str_length - 1, 0);
+	if (r <= 0) {
+		return -1;
+	}
+	value_str[r] = '\0';
+
+	return parse_long_long(value_str, NULL, out_value);
+}
+
+static int open_sibling(const char *dir_path, const char *node)
+{
+	char path[EMERGENCY_PATH_SIZE];
+	if (snprintf(path, sizeof(path), "%s/%s", dir_path, node) >=
+	    (int)sizeof(path)) {
+		return -1;
+	}
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// Missing attributes are expected, so this fails quietly when the node
+// can't be opened.
+static int read_sibling(const char *dir_path, const char *node,
+			long long *out_value)
+{
+	char value_str[SYSFS_VALUE_SIZE];
+	int fd = open_sibling(dir_path, node);
+	if (fd < 0) {
+		return -1;
+	}
+	int status = read_quietly(fd, value_str, sizeof(value_str), out_value);
+	close(fd);
+
+	return status;
+}
+
+static long thermal_threshold(const char *dir_path)
+{
+	long threshold = LONG_MAX;
+
+	for (int i = 0;; i++) {
+		char node[32];
+		char type[TRIP_TYPE_SIZE];
+		snprintf(node, sizeof(node), "trip_point_%d_type", i);
+		int fd = open_sibling(dir_path, node);
+		if (fd < 0) {
+			break;
+		}
+		ssize_t r = pread(fd, type, sizeof(type) - 1, 0);
+		close(fd);
+		if (r <= 0) {
+			continue;
+		}
+		type[r] = '\0';
+		type[strcspn(type, "\n")] = '\0';
+		if (strcmp(type, "hot") && strcmp(type, "critical")) {
+			continue;
+		}
+		long long temp = 0;
+		snprintf(node, sizeof(node), "trip_point_%d_temp", i);
+		if (!read_sibling(dir_path, node, &temp) && temp > 0 &&
+		    temp < threshold) {
+			threshold = (long)temp;
+		}
+	}
+
+	return threshold;
+}
+
+// tempN_input has its critical limit in tempN_crit.
+static long hwmon_threshold(const char *dir_path, const char *node)
+{
+	char crit_node[DEVICE_NAME_SIZE];
+	size_t length = strlen(node);
+	const char *suffix = "_input";
+	if (length < strlen(suffix) ||
+	    strcmp(node + length - strlen(suffix), suffix)) {
+		return LONG_MAX;
+	}
+	snprintf(crit_node, sizeof(crit_node), "%.*s_crit",
+		 (int)(length - strlen(suffix)), node);
+
+	long long temp = 0;
+	if (read_sibling(dir_path, crit_node, &temp) || temp <= 0) {
+		return LONG_MAX;
+	}
+	return (long)temp;
+}
+
+// LONG_MAX when the sensor has no trip point.
+static long sensor_threshold(const struct sensor *sensor)
+{
+	char path[EMERGENCY_PATH_SIZE];
+
+	// Where the sensor was resolved to is only known to the fd.
+	if (fd_path(sensor->fd, path, sizeof(path))) {
+		return LONG_MAX;
+	}
+	char *node = strrchr(path, '/');
+	if (!node) {
+		return LONG_MAX;
+	}
+	*node++ = '\0';
+
+	return sensor->source == SENSOR_SOURCE_THERMAL
+		       ? thermal_threshold(path)
+		       : hwmon_threshold(path, node);
+}
+
+static void force_full_speed(struct emergency *emergency)
+{
+	for (int i = 0; i < emergency->fan_count; i++) {
+		if (write_fan_speed(emergency->fan_fds[i], MAX_FAN_SPEED)) {
+			log_fail("write_fan_speed", __FILE__, __LINE__);
+		}
+	}
+}
+
+static void wake_loop(const struct emergency *emergency)
+{
+	uint64_t one = 1;
+	if (emergency->wake_fd >= 0 &&
+	    write(emergency->wake_fd, &one, sizeof(one)) < 0) {
+		perror("write() failed");
+	}
+}
+
+static void *watch(void *arg)
+{
+	struct emergency *emergency = arg;
+	bool woken = false;
+
+	for (;;) {
+		long margin = LONG_MAX;
+		bool hot = false;
+		bool cool = true;
+		bool idle = __atomic_load_n(&emergency->idle, __ATOMIC_ACQUIRE);
+		bool rising = false;
+		for (int i = 0; i < emergency->sensor_count; i++) {
+			struct emergency_sensor *sensor =
+				&emergency->sensors[i];
+			long long temp = 0;
+			// A sensor that can't be read may be the hot one.
+			if (read_quietly(sensor->fd, sensor->value_str,
+					 sizeof(sensor->value_str), &temp)) {
+				hot = true;
+				cool = false;
+				continue;
+			}
+			if (temp >= sensor->threshold) {
+				hot = true;
+			}
+			if (temp > sensor->threshold - EMERGENCY_RELEASE_MARGIN) {
+				cool = false;
+			}
+			if (sensor->threshold - temp < margin) {
+				margin = (long)(sensor->threshold - temp);
+			}
+			if (idle && temp >= __atomic_load_n(&sensor->wake_temp,
+							    __ATOMIC_RELAXED)) {
+				rising = true;
+			}
+		}
+
+		bool engaged = emergency_engaged(emergency);
+		if (hot && !engaged) {
+			force_full_speed(emergency);
+			__atomic_store_n(&emergency->engaged, true,
+					 __ATOMIC_RELEASE);
+			wake_loop(emergency);
+		} else if (cool && engaged) {
+			__atomic_store_n(&emergency->engaged, false,
+					 __ATOMIC_RELEASE);
+		}
+		// Once per idle spell, the sample takes the loop out of it.
+		if (rising && !woken) {
+			wake_loop(emergency);
+		}
+		woken = idle && (woken || rising);
+
+		long interval_ms = EMERGENCY_NEAR_INTERVAL_MS;
+		if (!hot && margin > EMERGENCY_NEAR_MARGIN) {
+			interval_ms += (margin - EMERGENCY_NEAR_MARGIN) /
+				       EMERGENCY_MAX_RISE;
+		}
+		long max_interval_ms = idle ? EMERGENCY_IDLE_MAX_INTERVAL_MS
+					    : EMERGENCY_MAX_INTERVAL_MS;
+		if (interval_ms > max_interval_ms) {
+			interval_ms = max_interval_ms;
+		}
+		// Sleeps on the stop eventfd, so stopping never waits for a
+		// long interval to pass.
+		struct pollfd stop = {
+			.fd = emergency->stop_fd,
+			.events = POLLIN,
+		};
+		if (poll(&stop, 1, (int)interval_ms) > 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void close_fds(struct emergency *emergency)
+{
+	for (int i = 0; i < emergency->sensor_count; i++) {
+		close(emergency->sensors[i].fd);
+	}
+	for (int i = 0; i < emergency->fan_count; i++) {
+		close(emergency->fan_fds[i]);
+	}
+	if (emergency->stop_fd >= 0) {
+		close(emergency->stop_fd);
+	}
+	emergency->sensor_count = 0;
+	emergency->fan_count = 0;
+	emergency->stop_fd = -1;
+}
+
+void emergency_init(struct emergency *emergency)
+{
+	memset(emergency, 0, sizeof(*emergency));
+	emergency->stop_fd = -1;
+	emergency->wake_fd = -1;
+}
+
+int emergency_start(struct emergency *emergency,
+		    const struct zone_table *zones, long temp, int priority)
+{
+	for (int i = 0; i < zones->sensor_count; i++) {
+		const struct sensor *sensor = &zones->sensors[i];
+		if (sensor->fd < 0) {
+			continue;
+		}
+		long threshold = sensor_threshold(sensor);
+		if (temp != EMERGENCY_TEMP_UNSET && temp < threshold) {
+			threshold = temp;
+		}
+		if (threshold == LONG_MAX) {
+			continue;
+		}
+		// pread() leaves the shared offset alone, so the dup can be
+		// read alongside the control loop's fd.
+		int fd = fcntl(sensor->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			perror("fcntl() failed");
+			goto cleanup;
+		}
+		emergency->sensors[emergency->sensor_count++] =
+			(struct emergency_sensor){
+				.sensor = i,
+				.fd = fd,
+				.threshold = threshold,
+				.wake_temp = LONG_MAX,
+			};
+	}
+	if (!emergency->sensor_count) {
+		return 0;
+	}
+	for (int i = 0; i < zones->fan_count; i++) {
+		if (zones->fans[i].fd < 0) {
+			continue;
+		}
+		int fd = fcntl(zones->fans[i].fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			perror("fcntl() failed");
+			goto cleanup;
+		}
+		emergency->fan_fds[emergency->fan_count++] = fd;
+	}
+
+	pthread_attr_t attr;
+	int r = pthread_attr_init(&attr);
+	if (r) {
+		fprintf(stderr, "pthread_attr_init() failed: %s\n",
+			strerror(r));
+		goto cleanup;
+	}
+	if (priority) {
+		struct sched_param param = {
+			.sched_priority = priority,
+		};
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	emergency->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (emergency->stop_fd < 0) {
+		perror("eventfd() failed");
+		pthread_attr_destroy(&attr);
+		goto cleanup;
+	}
+	emergency->engaged = false;
+	emergency->idle = false;
+	r = pthread_create(&emergency->thread, &attr, watch, emergency);
+	pthread_attr_destroy(&attr);
+	if (r) {
+		fprintf(stderr, "pthread_create() failed: %s\n", strerror(r));
+		goto cleanup;
+	}
+	emergency->running = true;
+
+	return 0;
+
+cleanup:
+	close_fds(emergency);
+
+	return -1;
+}
+
+void emergency_stop(struct emergency *emergency)
+{
+	if (emergency->running) {
+		uint64_t one = 1;
+		if (write(emergency->stop_fd, &one, sizeof(one)) < 0) {
+			perror("write() failed");
+		}
+		pthread_join(emergency->thread, NULL);
+		emergency->running = false;
+	}
+	close_fds(emergency);
+}
+
+void emergency_set_idle(struct emergency *emergency,
+			const struct zone_table *zones, long margin, bool idle)
+{
+	if (!emergency->running ||
+	    __atomic_load_n(&emergency->idle, __ATOMIC_RELAXED) == idle) {
+		return;
+	}
+	for (int i = 0; idle && i < emergency->sensor_count; i++) {
+		struct emergency_sensor *sensor = &emergency->sensors[i];
+		__atomic_store_n(&sensor->wake_temp,
+				 zone_table_sensor_min_temp(zones,
+							    sensor->sensor) -
+					 margin / 2,
+				 __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&emergency->idle, idle, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,81 @@
+#ifndef EMERGENCY_H
+#define EMERGENCY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "hwmon.h"
+#include "zone.h"
+
+// Off unless a sensor has a hot or critical trip point or a threshold is
+// configured.
+#define EMERGENCY_TEMP_UNSET 0
+// Sampling is fast only within EMERGENCY_NEAR_MARGIN of a threshold, so
+// a crossing is caught in under 10 ms without polling fast all the time.
+// Further away the watcher sleeps for as long as the temperature needs to
+// close the gap at EMERGENCY_MAX_RISE millidegrees per millisecond, but
+// no longer than EMERGENCY_MAX_INTERVAL_MS, or
+// EMERGENCY_IDLE_MAX_INTERVAL_MS while the control loop is idle and the
+// watcher samples in its place.
+#define EMERGENCY_NEAR_MARGIN 5000
+#define EMERGENCY_NEAR_INTERVAL_MS 5
+#define EMERGENCY_MAX_RISE 10
+#define EMERGENCY_MAX_INTERVAL_MS 2000
+#define EMERGENCY_IDLE_MAX_INTERVAL_MS 10000
+// How far below its threshold every sensor has to be before the control
+// loop gets the fans back.
+#define EMERGENCY_RELEASE_MARGIN 5000
+#define EMERGENCY_PATH_SIZE 256
+
+struct emergency_sensor {
+	// Index into the zone table's sensors.
+	int sensor;
+	int fd;
+	long threshold;
+	// Where the control loop wants a sample while idle.
+	long wake_temp;
+	char value_str[SYSFS_VALUE_SIZE];
+};
+
+// A watcher thread, independent of the control loop, with its own fds to
+// every sensor that has a threshold and to every fan. Crossing a threshold
+// writes full speed to the fans from the watcher itself and sets engaged,
+// which makes the control loop hold them there until every sensor is back
+// below its release point.
+struct emergency {
+	bool running;
+	pthread_t thread;
+	// Written to stop the watcher.
+	int stop_fd;
+	// Written by the watcher when the control loop should sample, -1 for
+	// none. Set by the caller and left open.
+	int wake_fd;
+	bool engaged;
+	bool idle;
+	int sensor_count;
+	struct emergency_sensor sensors[MAX_SENSORS];
+	int fan_count;
+	int fan_fds[MAX_FANS];
+};
+
+void emergency_init(struct emergency *emergency);
+// Watches the open sensors of zones against the lowest of their hot and
+// critical trip points and temp, if set. priority is the SCHED_FIFO
+// priority of the watcher, 0 for the normal scheduler. Nothing is started
+// if no sensor has a threshold.
+int emergency_start(struct emergency *emergency,
+		    const struct zone_table *zones, long temp, int priority);
+void emergency_stop(struct emergency *emergency);
+// Follows the control loop in and out of idle mode. While idle the
+// watcher wakes the loop once some sensor climbs halfway into margin,
+// where a borrowed trip point would have, and when it forces full speed.
+void emergency_set_idle(struct emergency *emergency,
+			const struct zone_table *zones, long margin,
+			bool idle);
+
+static inline bool emergency_engaged(const struct emergency *emergency)
+{
+	return __atomic_load_n(&emergency->engaged, __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include "filter.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "number.h"
+
+static const struct {
+	const char *name;
+	enum filter_type type;
+	int param_count;
+} filter_types[] = {
+	{ "none", FILTER_NONE, 0 },
+	{ "ema", FILTER_EMA, 1 },
+	{ "median", FILTER_MEDIAN, 1 },
+	{ "kalman", FILTER_KALMAN, 2 },
+};
+
+int filter_parse(struct filter_config *config, const char *spec,
+		 const char **out_end)
+{
+	size_t length = strspn(spec, "abcdefghijklmnopqrstuvwxyz");
+	int type = -1;
+	for (size_t i = 0; i < sizeof(filter_types) / sizeof(*filter_types);
+	     i++) {
+		if (strlen(filter_types[i].name) == length &&
+		    !strncmp(spec, filter_types[i].name, length)) {
+			type = (int)i;
+			break;
+		}
+	}
+	if (type < 0) {
+		fprintf(stderr, "unknown filter: %.*s\n", (int)length, spec);
+		return -1;
+	}
+
+	long long values[2] = { 0 };
+	int found = 0;
+	spec += length;
+	while (*spec == ',' && found < filter_types[type].param_count) {
+		if (parse_long_long(spec + 1, &spec, &values[found]) ||
+		    values[found] <= 0 || values[found] > 1000000000) {
+			fprintf(stderr, "invalid filter parameter\n");
+			return -1;
+		}
+		found++;
+	}
+	if (found && found != filter_types[type].param_count) {
+		fprintf(stderr, "%s filter takes %d parameters\n",
+			filter_types[type].name,
+			filter_types[type].param_count);
+		return -1;
+	}
+
+	*config = (struct filter_config){
+		.type = filter_types[type].type,
+		.tau_ms = found ? (long)values[0] : DEFAULT_FILTER_TAU_MS,
+		.window = found ? (int)values[0] : DEFAULT_FILTER_WINDOW,
+		.process_noise = found ? (long)values[0]
+				       : DEFAULT_FILTER_PROCESS_NOISE,
+		.measurement_noise = found ? (long)values[1]
+					   : DEFAULT_FILTER_MEASUREMENT_NOISE,
+	};
+	if (config->type == FILTER_MEDIAN &&
+	    (config->window > FILTER_MAX_WINDOW || !(config->window & 1))) {
+		fprintf(stderr, "median window must be odd and at most %d\n",
+			FILTER_MAX_WINDOW);
+		return -1;
+	}
+	*out_end = spec;
+
+	return 0;
+}
+
+void filter_reset(struct filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+}
+
+static long round_temp(double temp)
+{
+	return (long)(temp < 0.0 ? temp - 0.5 : temp + 0.5);
+}
+
+// Insertion sort of a copy, the window is tiny.
+static long median(const struct filter *filter)
+{
+	long sorted[FILTER_MAX_WINDOW];
+
+	for (int i = 0; i < filter->count; i++) {
+		int j = i;
+		for (; j > 0 && sorted[j - 1] > filter->ring[i]; j--) {
+			sorted[j] = sorted[j - 1];
+		}
+		sorted[j] = filter->ring[i];
+	}
+	return sorted[filter->count / 2];
+}
+
+long filter_next(struct filter *filter, const struct filter_config *config,
+		 long temp, long dt_ms)
+{
+	if (config->type == FILTER_MEDIAN) {
+		if (filter->count < config->window) {
+			filter->ring[filter->count++] = temp;
+		} else {
+			filter->ring[filter->head] = temp;
+			filter->head = (filter->head + 1) % config->window;
+		}
+		return median(filter);
+	}
+	if (config->type == FILTER_NONE) {
+		return temp;
+	}
+	if (!filter->primed) {
+		filter->primed = true;
+		filter->estimate = temp;
+		filter->variance = (double)config->measurement_noise *
+				   config->measurement_noise;
+		return temp;
+	}
+
+	if (config->type == FILTER_EMA) {
+		filter->estimate += (temp - filter->estimate) * dt_ms /
+				    (double)(config->tau_ms + dt_ms);
+	} else {
+		double r = (double)config->measurement_noise *
+			   config->measurement_noise;
+		filter->variance += (double)config->process_noise *
+				    config->process_noise * dt_ms / 1000.0;
+		double gain = filter->variance / (filter->variance + r);
+		filter->estimate += gain * (temp - filter->estimate);
+		filter->variance *= 1.0 - gain;
+	}
+
+	return round_temp(filter->estimate);
+}
@@ -0,0 +1,60 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+
+#define FILTER_MAX_WINDOW 15
+#define DEFAULT_FILTER_TAU_MS 2000
+#define DEFAULT_FILTER_WINDOW 5
+#define DEFAULT_FILTER_PROCESS_NOISE 200
+#define DEFAULT_FILTER_MEASUREMENT_NOISE 1000
+
+// Sits between a sensor and the curves it feeds. A single noisy reading
+// would otherwise move the fans by a step and back on the next tick.
+enum filter_type {
+	FILTER_NONE,
+	// Exponential moving average with a time constant, so it lags the
+	// same whatever the sampling interval.
+	FILTER_EMA,
+	// Median of the last readings, drops spikes without any lag on
+	// steady ramps.
+	FILTER_MEDIAN,
+	// One dimensional Kalman filter tracking a randomly drifting
+	// temperature.
+	FILTER_KALMAN,
+};
+
+struct filter_config {
+	enum filter_type type;
+	long tau_ms;
+	// Odd, at most FILTER_MAX_WINDOW readings.
+	int window;
+	// How far the temperature drifts in a second and how far a reading
+	// strays from it, as standard deviations in millidegrees.
+	long process_noise;
+	long measurement_noise;
+};
+
+struct filter {
+	bool primed;
+	// EMA and Kalman estimate and the Kalman variance, in millidegrees.
+	double estimate;
+	double variance;
+	// The last readings for the median, head is the oldest once full.
+	int count;
+	int head;
+	long ring[FILTER_MAX_WINDOW];
+};
+
+// none, ema[,TAU_MS], median[,N] or kalman[,PROCESS_NOISE,MEASUREMENT_NOISE].
+// Parses up to the first character that can't continue the spec and
+// leaves out_end there.
+int filter_parse(struct filter_config *config, const char *spec,
+		 const char **out_end);
+void filter_reset(struct filter *filter);
+// Takes in a reading dt_ms after the previous one and returns the filtered
+// temperature. The first reading after a reset passes through unchanged.
+long filter_next(struct filter *filter, const struct filter_config *config,
+		 long temp, long dt_ms);
+
+#endif
@@ -0,0 +1,684 @@
+#include "governor.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/thermal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "number.h"
+#include "sysfs_state.h"
+
+#define USER_SPACE_POLICY "user_space"
+#define FALLBACK_POLICY "step_wise"
+#define TRIP_TYPE_SIZE 16
+
+static int open_at(int dir_fd, const char *entry, const char *node, int flags)
+{
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", entry, node) >=
+	    (int)sizeof(path)) {
+		fprintf(stderr, "path too long: %s/%s\n", entry, node);
+		return -1;
+	}
+	return openat(dir_fd, path, flags | O_CLOEXEC);
+}
+
+// Reads a sysfs text attribute without its newline. Missing attributes
+// are expected, so this fails quietly.
+static int read_text(int dir_fd, const char *entry, const char *node,
+		     char *out, size_t out_size)
+{
+	int fd = open_at(dir_fd, entry, node, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t r = read(fd, out, out_size - 1);
+	close(fd);
+	if (r <= 0) {
+		return -1;
+	}
+	out[r] = '\0';
+	out[strcspn(out, "\n")] = '\0';
+
+	return 0;
+}
+
+static int write_text(int dir_fd, const char *entry, const char *node,
+		      const char *text)
+{
+	int fd = open_at(dir_fd, entry, node, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s/%s) failed: %s\n", entry, node,
+			strerror(errno));
+		return -1;
+	}
+	int status = 0;
+	if (write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+		fprintf(stderr, "write(%s/%s) failed: %s\n", entry, node,
+			strerror(errno));
+		status = -1;
+	}
+	if (close(fd) < 0) {
+		perror("close() failed");
+	}
+
+	return status;
+}
+
+static int read_at(struct governor *governor, int dir_fd, const char *entry,
+		   const char *node, long long *out_value)
+{
+	int fd = open_at(dir_fd, entry, node, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	int status = read_value(fd, governor->value_str,
+				sizeof(governor->value_str), out_value);
+	close(fd);
+
+	return status;
+}
+
+// LONG_MAX when the zone has no passive trip point.
+static long passive_trip(struct governor *governor, int dir_fd,
+			 const char *entry)
+{
+	long passive = LONG_MAX;
+
+	for (int i = 0;; i++) {
+		char node[32];
+		char type[TRIP_TYPE_SIZE];
+		snprintf(node, sizeof(node), "trip_point_%d_type", i);
+		if (read_text(dir_fd, entry, node, type, sizeof(type))) {
+			break;
+		}
+		if (strcmp(type, "passive")) {
+			continue;
+		}
+		long long temp = 0;
+		snprintf(node, sizeof(node), "trip_point_%d_temp", i);
+		if (!read_at(governor, dir_fd, entry, node, &temp) &&
+		    temp > 0 && temp < passive) {
+			passive = (long)temp;
+		}
+	}
+
+	return passive;
+}
+
+// A zone found in user_space was left there by someone who can't give it
+// back, so it goes to step_wise, or else the first other policy on offer.
+static int return_policy(char *available, char *out_policy,
+			 size_t out_policy_size)
+{
+	char *first = NULL;
+	char *save_ptr = NULL;
+
+	for (char *policy = strtok_r(available, " ", &save_ptr); policy;
+	     policy = strtok_r(NULL, " ", &save_ptr)) {
+		if (!strcmp(policy, USER_SPACE_POLICY)) {
+			continue;
+		}
+		if (!strcmp(policy, FALLBACK_POLICY)) {
+			first = policy;
+			break;
+		}
+		if (!first) {
+			first = policy;
+		}
+	}
+	if (!first || strlen(first) >= out_policy_size) {
+		return -1;
+	}
+	memcpy(out_policy, first, strlen(first) + 1);
+
+	return 0;
+}
+
+static int take_zone(struct governor *governor, int dir_fd, const char *entry)
+{
+	struct governor_zone *zone = &governor->zones[governor->zone_count];
+	char available[256];
+
+	zone->id = 0;
+	sscanf(entry, "thermal_zone%d", &zone->id);
+	zone->passive = passive_trip(governor, dir_fd, entry);
+	if (zone->passive == LONG_MAX) {
+		return 0;
+	}
+	if (read_text(dir_fd, entry, "policy", zone->policy,
+		      sizeof(zone->policy)) ||
+	    read_text(dir_fd, entry, "available_policies", available,
+		      sizeof(available))) {
+		fprintf(stderr, "%s has no thermal policy\n", entry);
+		return -1;
+	}
+	if (!strstr(available, USER_SPACE_POLICY)) {
+		fprintf(stderr, "%s has no " USER_SPACE_POLICY " governor\n",
+			entry);
+		return -1;
+	}
+	if (!strcmp(zone->policy, USER_SPACE_POLICY) &&
+	    return_policy(available, zone->policy, sizeof(zone->policy))) {
+		fprintf(stderr, "%s has no policy to go back to\n", entry);
+		return -1;
+	}
+	snprintf(zone->policy_path, sizeof(zone->policy_path),
+		 THERMAL_DIR_PATH "%s/policy", entry);
+	zone->temp_fd = open_at(dir_fd, entry, "temp", O_RDONLY);
+	if (zone->temp_fd < 0) {
+		fprintf(stderr, "open(%s/temp) failed: %s\n", entry,
+			strerror(errno));
+		return -1;
+	}
+	// Recorded first, so a crash never leaves the zone taken.
+	if (sysfs_state_remember(zone->policy_path, zone->policy)) {
+		log_fail("sysfs_state_remember", __FILE__, __LINE__);
+		close(zone->temp_fd);
+		return -1;
+	}
+	if (write_text(dir_fd, entry, "policy", USER_SPACE_POLICY)) {
+		log_fail("write_text", __FILE__, __LINE__);
+		sysfs_state_forget(zone->policy_path);
+		close(zone->temp_fd);
+		return -1;
+	}
+	governor->zone_count++;
+
+	return 0;
+}
+
+static void take_zones(struct governor *governor)
+{
+	DIR *dir = opendir(THERMAL_DIR_PATH);
+	if (!dir) {
+		perror("opendir(" THERMAL_DIR_PATH ") failed");
+		return;
+	}
+	errno = 0;
+	for (struct dirent *dir_entry = readdir(dir); dir_entry;
+	     dir_entry = readdir(dir)) {
+		if (strncmp(dir_entry->d_name, "thermal_zone", 12)) {
+			continue;
+		}
+		if (governor->zone_count == GOVERNOR_MAX_ZONES) {
+			fprintf(stderr, "too many thermal zones\n");
+			break;
+		}
+		if (take_zone(governor, dirfd(dir), dir_entry->d_name)) {
+			log_fail("take_zone", __FILE__, __LINE__);
+		}
+		errno = 0;
+	}
+	if (errno) {
+		perror("readdir() failed");
+	}
+	if (closedir(dir)) {
+		perror("closedir(" THERMAL_DIR_PATH ") failed");
+	}
+}
+
+static void open_policies(struct governor *governor)
+{
+	DIR *dir = opendir(CPUFREQ_DIR_PATH);
+	if (!dir) {
+		perror("opendir(" CPUFREQ_DIR_PATH ") failed");
+		return;
+	}
+	errno = 0;
+	for (struct dirent *dir_entry = readdir(dir); dir_entry;
+	     dir_entry = readdir(dir)) {
+		if (strncmp(dir_entry->d_name, "policy", 6)) {
+			continue;
+		}
+		if (governor->policy_count == CPUFREQ_MAX_POLICIES) {
+			fprintf(stderr, "too many cpufreq policies\n");
+			break;
+		}
+		struct governor_policy *policy =
+			&governor->policies[governor->policy_count];
+		policy->id = 0;
+		sscanf(dir_entry->d_name, "policy%d", &policy->id);
+		policy->max_freq_fd = open_at(dirfd(dir), dir_entry->d_name,
+					      "scaling_max_freq", O_RDWR);
+		if (policy->max_freq_fd < 0) {
+			fprintf(stderr,
+				"open(%s/scaling_max_freq) failed: %s\n",
+				dir_entry->d_name, strerror(errno));
+			errno = 0;
+			continue;
+		}
+		// A cap can't go below scaling_min_freq, the kernel rejects
+		// it. The top comes from cpuinfo_max_freq, scaling_max_freq
+		// may still hold someone else's cap.
+		if (read_value(policy->max_freq_fd, governor->value_str,
+			       sizeof(governor->value_str),
+			       &policy->saved_freq) ||
+		    read_at(governor, dirfd(dir), dir_entry->d_name,
+			    "cpuinfo_max_freq", &policy->max_freq) ||
+		    read_at(governor, dirfd(dir), dir_entry->d_name,
+			    "scaling_min_freq", &policy->min_freq)) {
+			log_fail("read_value", __FILE__, __LINE__);
+			close(policy->max_freq_fd);
+			errno = 0;
+			continue;
+		}
+		if (fd_path(policy->max_freq_fd, policy->max_freq_path,
+			    sizeof(policy->max_freq_path))) {
+			log_fail("fd_path", __FILE__, __LINE__);
+			close(policy->max_freq_fd);
+			errno = 0;
+			continue;
+		}
+		governor->policy_count++;
+		errno = 0;
+	}
+	if (errno) {
+		perror("readdir() failed");
+	}
+	if (closedir(dir)) {
+		perror("closedir(" CPUFREQ_DIR_PATH ") failed");
+	}
+}
+
+// Whichever attribute of type comes first among the length bytes at attrs,
+// NULL if there is none.
+static const struct nlattr *find_attr(const uint8_t *attrs, size_t length,
+				      uint16_t type)
+{
+	while (length >= NLA_HDRLEN) {
+		const struct nlattr *attr = (const struct nlattr *)attrs;
+		if (attr->nla_len < NLA_HDRLEN || attr->nla_len > length) {
+			return NULL;
+		}
+		if ((attr->nla_type & NLA_TYPE_MASK) == type) {
+			return attr;
+		}
+		size_t aligned = NLA_ALIGN(attr->nla_len);
+		if (aligned >= length) {
+			return NULL;
+		}
+		attrs += aligned;
+		length -= aligned;
+	}
+
+	return NULL;
+}
+
+static const uint8_t *attr_data(const struct nlattr *attr)
+{
+	return (const uint8_t *)attr + NLA_HDRLEN;
+}
+
+static size_t attr_length(const struct nlattr *attr)
+{
+	return attr->nla_len - NLA_HDRLEN;
+}
+
+// The id of the group named name in a CTRL_ATTR_MCAST_GROUPS nest, 0 if
+// it isn't there.
+static uint32_t find_group(const struct nlattr *groups, const char *name)
+{
+	const uint8_t *entry = attr_data(groups);
+	size_t length = attr_length(groups);
+
+	while (length >= NLA_HDRLEN) {
+		const struct nlattr *group = (const struct nlattr *)entry;
+		if (group->nla_len < NLA_HDRLEN || group->nla_len > length) {
+			break;
+		}
+		const struct nlattr *group_name =
+			find_attr(attr_data(group), attr_length(group),
+				  CTRL_ATTR_MCAST_GRP_NAME);
+		const struct nlattr *group_id =
+			find_attr(attr_data(group), attr_length(group),
+				  CTRL_ATTR_MCAST_GRP_ID);
+		if (group_name && group_id &&
+		    attr_length(group_id) >= sizeof(uint32_t) &&
+		    !strncmp((const char *)attr_data(group_name), name,
+			     attr_length(group_name))) {
+			uint32_t id;
+			memcpy(&id, attr_data(group_id), sizeof(id));
+			return id;
+		}
+		size_t aligned = NLA_ALIGN(group->nla_len);
+		if (aligned >= length) {
+			break;
+		}
+		entry += aligned;
+		length -= aligned;
+	}
+
+	return 0;
+}
+
+// Asks the generic netlink controller for the thermal family and joins
+// its event group. The answer is queued before send() returns.
+static int subscribe_events(struct governor *governor, int fd)
+{
+	struct {
+		struct nlmsghdr header;
+		struct genlmsghdr genl;
+		uint8_t attrs[NLA_HDRLEN +
+			      NLA_ALIGN(sizeof(THERMAL_GENL_FAMILY_NAME))];
+	} request = {
+		.header = {
+			.nlmsg_len = sizeof(request),
+			.nlmsg_type = GENL_ID_CTRL,
+			.nlmsg_flags = NLM_F_REQUEST,
+		},
+		.genl = {
+			.cmd = CTRL_CMD_GETFAMILY,
+			.version = 1,
+		},
+	};
+	struct nlattr name_attr = {
+		.nla_len = NLA_HDRLEN + sizeof(THERMAL_GENL_FAMILY_NAME),
+		.nla_type = CTRL_ATTR_FAMILY_NAME,
+	};
+	memcpy(request.attrs, &name_attr, sizeof(name_attr));
+	memcpy(request.attrs + NLA_HDRLEN, THERMAL_GENL_FAMILY_NAME,
+	       sizeof(THERMAL_GENL_FAMILY_NAME));
+	if (send(fd, &request, sizeof(request), 0) < 0) {
+		perror("send() failed");
+		return -1;
+	}
+
+	ssize_t r = recv(fd, governor->event_buffer,
+			 sizeof(governor->event_buffer), MSG_DONTWAIT);
+	if (r < 0) {
+		perror("recv() failed");
+		return -1;
+	}
+	const struct nlmsghdr *header =
+		(const struct nlmsghdr *)governor->event_buffer;
+	if (!NLMSG_OK(header, (size_t)r)) {
+		fprintf(stderr, "short genl reply\n");
+		return -1;
+	}
+	if (header->nlmsg_type == NLMSG_ERROR) {
+		const struct nlmsgerr *error = NLMSG_DATA(header);
+		fprintf(stderr, "no thermal genl family: %s\n",
+			strerror(-error->error));
+		return -1;
+	}
+	const uint8_t *attrs =
+		(const uint8_t *)NLMSG_DATA(header) + GENL_HDRLEN;
+	size_t length = NLMSG_PAYLOAD(header, GENL_HDRLEN);
+	const struct nlattr *family =
+		find_attr(attrs, length, CTRL_ATTR_FAMILY_ID);
+	const struct nlattr *groups =
+		find_attr(attrs, length, CTRL_ATTR_MCAST_GROUPS);
+	if (!family || attr_length(family) < sizeof(uint16_t) || !groups) {
+		fprintf(stderr, "incomplete genl family reply\n");
+		return -1;
+	}
+	memcpy(&governor->family, attr_data(family), sizeof(uint16_t));
+	uint32_t group = find_group(groups, THERMAL_GENL_EVENT_GROUP_NAME);
+	if (!group) {
+		fprintf(stderr, "no thermal genl event group\n");
+		return -1;
+	}
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+		       sizeof(group))) {
+		perror("setsockopt(NETLINK_ADD_MEMBERSHIP) failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_events(struct governor *governor)
+{
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_GENERIC);
+	if (fd < 0) {
+		perror("socket(NETLINK_GENERIC) failed");
+		return -1;
+	}
+	if (subscribe_events(governor, fd)) {
+		log_fail("subscribe_events", __FILE__, __LINE__);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int governor_open(struct governor *governor)
+{
+	memset(governor, 0, sizeof(*governor));
+	governor->event_fd = -1;
+
+	take_zones(governor);
+	if (!governor->zone_count) {
+		fprintf(stderr, "no thermal zone with a passive trip point "
+				"to govern\n");
+		return -1;
+	}
+	open_policies(governor);
+	governor->event_fd = open_events(governor);
+	if (governor->event_fd < 0) {
+		log_fail("open_events", __FILE__, __LINE__);
+	}
+
+	return 0;
+}
+
+static long long cap_freq(const struct governor *governor,
+			  const struct governor_policy *policy)
+{
+	return policy->max_freq - (policy->max_freq - policy->min_freq) *
+					  governor->cap_steps /
+					  GOVERNOR_CAP_STEPS;
+}
+
+static int write_caps(struct governor *governor)
+{
+	int status = 0;
+
+	for (int i = 0; i < governor->policy_count; i++) {
+		struct governor_policy *policy = &governor->policies[i];
+		if (!governor->cap_steps) {
+			if (write_value(policy->max_freq_fd,
+					policy->saved_freq)) {
+				log_fail("write_value", __FILE__, __LINE__);
+				status = -1;
+			} else {
+				sysfs_state_forget(policy->max_freq_path);
+			}
+			continue;
+		}
+		// Recorded first, so a crash never leaves the cap on.
+		char saved_str[NUMBER_STR_SIZE];
+		size_t length = format_long_long(policy->saved_freq, saved_str);
+		saved_str[length - 1] = '\0';
+		if (sysfs_state_remember(policy->max_freq_path, saved_str)) {
+			log_fail("sysfs_state_remember", __FILE__, __LINE__);
+			status = -1;
+			continue;
+		}
+		if (write_value(policy->max_freq_fd,
+				cap_freq(governor, policy))) {
+			log_fail("write_value", __FILE__, __LINE__);
+			status = -1;
+		}
+	}
+
+	return status;
+}
+
+void governor_close(struct governor *governor)
+{
+	if (governor->cap_steps) {
+		governor->cap_steps = 0;
+		if (write_caps(governor)) {
+			log_fail("write_caps", __FILE__, __LINE__);
+		}
+	}
+	for (int i = 0; i < governor->policy_count; i++) {
+		if (close(governor->policies[i].max_freq_fd) < 0) {
+			perror("close() failed");
+		}
+	}
+
+	int dir_fd = open(THERMAL_DIR_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		perror("open(" THERMAL_DIR_PATH ") failed");
+	}
+	for (int i = 0; i < governor->zone_count; i++) {
+		struct governor_zone *zone = &governor->zones[i];
+		char entry[32];
+		snprintf(entry, sizeof(entry), "thermal_zone%d", zone->id);
+		if (dir_fd < 0 ||
+		    write_text(dir_fd, entry, "policy", zone->policy)) {
+			log_fail("write_text", __FILE__, __LINE__);
+		} else {
+			sysfs_state_forget(zone->policy_path);
+		}
+		if (close(zone->temp_fd) < 0) {
+			perror("close() failed");
+		}
+	}
+	if (dir_fd >= 0 && close(dir_fd) < 0) {
+		perror("close() failed");
+	}
+
+	if (governor->event_fd >= 0 && close(governor->event_fd) < 0) {
+		perror("close() failed");
+	}
+	governor->event_fd = -1;
+	governor->zone_count = 0;
+	governor->policy_count = 0;
+}
+
+static bool governs(const struct governor *governor, uint32_t id)
+{
+	for (int i = 0; i < governor->zone_count; i++) {
+		if ((uint32_t)governor->zones[i].id == id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int governor_drain(struct governor *governor)
+{
+	int crossed = 0;
+
+	for (;;) {
+		ssize_t r = recv(governor->event_fd, governor->event_buffer,
+				 sizeof(governor->event_buffer), MSG_DONTWAIT);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// Events were dropped, any of them may have been a
+			// crossing.
+			if (errno == ENOBUFS) {
+				crossed = 1;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("recv() failed");
+			}
+			break;
+		}
+		int remaining = (int)r;
+		for (const struct nlmsghdr *header =
+			     (const struct nlmsghdr *)governor->event_buffer;
+		     NLMSG_OK(header, remaining);
+		     header = NLMSG_NEXT(header, remaining)) {
+			if (header->nlmsg_type != governor->family ||
+			    header->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) {
+				continue;
+			}
+			const struct genlmsghdr *genl = NLMSG_DATA(header);
+			if (genl->cmd != THERMAL_GENL_EVENT_TZ_TRIP_UP &&
+			    genl->cmd != THERMAL_GENL_EVENT_TZ_TRIP_DOWN) {
+				continue;
+			}
+			const struct nlattr *id = find_attr(
+				(const uint8_t *)genl + GENL_HDRLEN,
+				NLMSG_PAYLOAD(header, GENL_HDRLEN),
+				THERMAL_GENL_ATTR_TZ_ID);
+			uint32_t zone = 0;
+			if (id && attr_length(id) >= sizeof(zone)) {
+				memcpy(&zone, attr_data(id), sizeof(zone));
+				crossed |= governs(governor, zone);
+			}
+		}
+	}
+
+	return crossed;
+}
+
+int governor_read(struct governor *governor)
+{
+	bool hot = false;
+	bool cool = true;
+
+	for (int i = 0; i < governor->zone_count; i++) {
+		struct governor_zone *zone = &governor->zones[i];
+		long long temp = 0;
+		if (read_value(zone->temp_fd, governor->value_str,
+			       sizeof(governor->value_str), &temp)) {
+			log_fail("read_value", __FILE__, __LINE__);
+			return -1;
+		}
+		hot |= temp >= zone->passive;
+		cool &= temp < zone->passive - GOVERNOR_HYSTERESIS;
+	}
+	governor->hot = hot;
+	governor->cool = cool;
+
+	return 0;
+}
+
+int governor_update(struct governor *governor, bool fans_at_limit,
+		    long dt_ms)
+{
+	int direction = 0;
+	if (governor->hot && fans_at_limit &&
+	    governor->cap_steps < GOVERNOR_CAP_STEPS) {
+		direction = 1;
+	} else if (governor->cool && governor->cap_steps > 0) {
+		direction = -1;
+	}
+	if (direction != governor->direction) {
+		governor->direction = direction;
+		governor->elapsed_ms = 0;
+	}
+	if (!direction) {
+		return 0;
+	}
+	governor->elapsed_ms += dt_ms;
+	if (governor->elapsed_ms < GOVERNOR_STEP_MS) {
+		return 0;
+	}
+
+	governor->elapsed_ms = 0;
+	governor->cap_steps += direction;
+	return write_caps(governor);
+}
+
+long long governor_policy_cap(const struct governor *governor, int id)
+{
+	if (!governor->cap_steps) {
+		return LLONG_MAX;
+	}
+	for (int i = 0; i < governor->policy_count; i++) {
+		if (governor->policies[i].id == id) {
+			return cap_freq(governor, &governor->policies[i]);
+		}
+	}
+	return LLONG_MAX;
+}
@@ -0,0 +1,101 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpufreq.h"
+#include "hwmon.h"
+
+#define GOVERNOR_MAX_ZONES 8
+#define GOVERNOR_POLICY_SIZE 32
+#define GOVERNOR_PATH_SIZE 256
+#define GOVERNOR_EVENT_BUFFER_SIZE 4096
+// The caps only come off again once every zone is this far below its
+// passive trip point.
+#define GOVERNOR_HYSTERESIS 3000
+// The cpufreq range is capped GOVERNOR_CAP_STEPS steps deep, a step per
+// GOVERNOR_STEP_MS a zone stays hot with the fans at the acoustic limit.
+// The fans get the first step's time to themselves.
+#define GOVERNOR_CAP_STEPS 10
+#define GOVERNOR_STEP_MS 1000
+
+struct governor_zone {
+	// N of thermal_zoneN, what the trip events name.
+	int id;
+	int temp_fd;
+	// Lowest passive trip point, where step_wise would throttle.
+	long passive;
+	// What policy held before, put back on close. Never user_space, a
+	// zone found in it goes back to step_wise.
+	char policy[GOVERNOR_POLICY_SIZE];
+	char policy_path[GOVERNOR_PATH_SIZE];
+};
+
+struct governor_policy {
+	// N of policyN.
+	int id;
+	int max_freq_fd;
+	char max_freq_path[GOVERNOR_PATH_SIZE];
+	long long min_freq;
+	// cpuinfo_max_freq, where the caps start from.
+	long long max_freq;
+	// scaling_max_freq at startup, put back once the caps come off.
+	long long saved_freq;
+};
+
+// Cooperative cooling with the kernel thermal framework. Every thermal
+// zone with a passive trip point is handed to the user_space governor,
+// so the kernel no longer caps cpufreq behind the daemon's back, and trip
+// crossings arrive as thermal genl events. The daemon then makes one
+// decision for fans and frequency: a zone at its passive trip point runs
+// the fans at the acoustic limit first, and cpufreq is only capped while
+// that is not enough. The policies and frequency limits the zones and
+// cpufreq held before are remembered in the sysfs state file, so a crash
+// doesn't leave them taken.
+struct governor {
+	int zone_count;
+	struct governor_zone zones[GOVERNOR_MAX_ZONES];
+	int policy_count;
+	struct governor_policy policies[CPUFREQ_MAX_POLICIES];
+	// Subscribed to the thermal genl event group, -1 without it.
+	int event_fd;
+	uint16_t family;
+	// Set by governor_read(): some zone is at or above its passive trip
+	// point, or every zone is clear of it by the hysteresis.
+	bool hot;
+	bool cool;
+	// Steps of the frequency range capped off.
+	int cap_steps;
+	// Which way the caps want to move, and for how long they have.
+	int direction;
+	long elapsed_ms;
+	char value_str[SYSFS_VALUE_SIZE];
+	uint8_t event_buffer[GOVERNOR_EVENT_BUFFER_SIZE];
+};
+
+// Switches the zones over to user_space and opens the cpufreq policies.
+// Fails if there is no zone to take over. Without the genl family the
+// zones are still governed, only without trip wakeups.
+int governor_open(struct governor *governor);
+// Lifts the caps and puts the zones' previous policies back.
+void governor_close(struct governor *governor);
+// Reads every event waiting on event_fd. Returns 1 if a governed zone
+// crossed a trip point.
+int governor_drain(struct governor *governor);
+int governor_read(struct governor *governor);
+// Moves the caps a step once a zone has been hot with the fans at the
+// limit, or every zone cool, for GOVERNOR_STEP_MS.
+int governor_update(struct governor *governor, bool fans_at_limit,
+		    long dt_ms);
+
+static inline int governor_cap_permille(const struct governor *governor)
+{
+	return governor->cap_steps * 1000 / GOVERNOR_CAP_STEPS;
+}
+
+// The scaling_max_freq the caps hold policyN to, LLONG_MAX while it isn't
+// capped. Anything lower was the kernel.
+long long governor_policy_cap(const struct governor *governor, int id);
+
+#endif
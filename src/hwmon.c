@@ -0,0 +1,295 @@
+#include "hwmon.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "device_cache.h"
+#include "log.h"
+#include "number.h"
+
+#define DEVICE_NAME_VALUE_SIZE 64
+#define DEVICE_NODE_PATH_SIZE (DEVICE_CACHE_PATH_SIZE + 64)
+#define WRITE_ATTEMPTS 3
+
+struct device_class_info {
+	char *dir_path;
+	char *prefix;
+	char *name_node;
+};
+
+static const struct device_class_info device_classes[] = {
+	[DEVICE_CLASS_HWMON] = { HWMON_DIR_PATH, "hwmon", "name" },
+	[DEVICE_CLASS_THERMAL] = { THERMAL_DIR_PATH, "thermal_zone", "type" },
+};
+
+static int read_name(int dir_fd, char *entry, char *name_node,
+		     char *out_name, size_t out_name_length)
+{
+	char path[DEVICE_NODE_PATH_SIZE];
+	if (snprintf(path, sizeof(path), "%s/%s", entry, name_node) >=
+	    (int)sizeof(path)) {
+		fprintf(stderr, "path too long: %s/%s\n", entry, name_node);
+		return -1;
+	}
+	int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "openat(%s) failed: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	ssize_t r = read(fd, out_name, out_name_length - 1);
+	if (r < 0) {
+		perror("read() failed");
+	}
+	if (close(fd) < 0) {
+		perror("close() failed");
+	}
+	if (r < 1) {
+		return -1;
+	}
+	out_name[r] = '\0';
+
+	return 0;
+}
+
+static void open_request(struct device_request *request, int dir_fd,
+			 char *path)
+{
+	char node_path[DEVICE_NODE_PATH_SIZE];
+	if (snprintf(node_path, sizeof(node_path), "%s/%s", path,
+		     request->node) >= (int)sizeof(node_path)) {
+		fprintf(stderr, "path too long: %s/%s\n", path, request->node);
+		return;
+	}
+	request->fd = openat(dir_fd, node_path, request->oflag | O_CLOEXEC);
+	if (request->fd < 0) {
+		fprintf(stderr, "open(%s) failed: %s\n", node_path,
+			strerror(errno));
+	}
+}
+
+static int count_pending(struct device_request *requests, int count,
+			 enum device_class class)
+{
+	int pending = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (requests[i].class == class && requests[i].fd < 0) {
+			pending++;
+		}
+	}
+	return pending;
+}
+
+// Walks one class directory once and resolves every pending request of that
+// class against it. Paths are opened relative to the directory fd.
+static int scan_class(enum device_class class,
+		      struct device_request *requests, int count)
+{
+	const struct device_class_info *info = &device_classes[class];
+	int pending = count_pending(requests, count, class);
+	if (!pending) {
+		return 0;
+	}
+
+	DIR *dir = opendir(info->dir_path);
+	if (!dir) {
+		fprintf(stderr, "opendir(%s) failed: %s\n", info->dir_path,
+			strerror(errno));
+		return -1;
+	}
+	int dir_fd = dirfd(dir);
+	size_t prefix_length = strlen(info->prefix);
+	char name_value[DEVICE_NAME_VALUE_SIZE];
+
+	errno = 0;
+	for (struct dirent *dir_entry = readdir(dir); dir_entry && pending;
+	     dir_entry = readdir(dir)) {
+		if (strncmp(dir_entry->d_name, info->prefix, prefix_length)) {
+			continue;
+		}
+		if (read_name(dir_fd, dir_entry->d_name, info->name_node,
+			      name_value, sizeof(name_value))) {
+			log_fail("read_name", __FILE__, __LINE__);
+			errno = 0;
+			continue;
+		}
+		struct stat st;
+		bool has_stat = false;
+		for (int i = 0; i < count; i++) {
+			struct device_request *request = &requests[i];
+			if (request->class != class || request->fd >= 0 ||
+			    strncmp(request->name, name_value,
+				    request->name_length)) {
+				continue;
+			}
+			open_request(request, dir_fd, dir_entry->d_name);
+			pending--;
+			if (!has_stat) {
+				has_stat = !fstatat(dir_fd, dir_entry->d_name,
+						    &st, 0);
+			}
+			char path[DEVICE_CACHE_PATH_SIZE];
+			// Not fatal, the next start just scans again.
+			if (request->fd >= 0 && has_stat &&
+			    snprintf(path, sizeof(path), "%s%s",
+				     info->dir_path, dir_entry->d_name) <
+				    (int)sizeof(path)) {
+				device_cache_store(info->dir_path,
+						   request->name,
+						   request->name_length, path,
+						   st.st_ino);
+			}
+		}
+		errno = 0;
+	}
+	if (errno) {
+		perror("readdir() failed");
+	}
+	if (closedir(dir)) {
+		fprintf(stderr, "closedir(%s) failed: %s\n", info->dir_path,
+			strerror(errno));
+	}
+
+	return 0;
+}
+
+int open_devices(struct device_request *requests, int count)
+{
+	int status = 0;
+
+	// Anything the cache still vouches for costs one stat and one open.
+	for (int i = 0; i < count; i++) {
+		struct device_request *request = &requests[i];
+		const struct device_class_info *info =
+			&device_classes[request->class];
+		char path[DEVICE_CACHE_PATH_SIZE];
+		request->fd = -1;
+		if (!device_cache_lookup(info->dir_path, request->name,
+					 request->name_length, path,
+					 sizeof(path))) {
+			open_request(request, AT_FDCWD, path);
+		}
+	}
+	for (size_t class = 0;
+	     class < sizeof(device_classes) / sizeof(device_classes[0]);
+	     class++) {
+		if (scan_class(class, requests, count)) {
+			log_fail("scan_class", __FILE__, __LINE__);
+			status = -1;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		struct device_request *request = &requests[i];
+		if (request->fd < 0) {
+			fprintf(stderr, "no device named %.*s in %s\n",
+				(int)request->name_length, request->name,
+				device_classes[request->class].dir_path);
+			status = -1;
+		}
+	}
+
+	return status;
+}
+
+bool device_present(enum device_class class, char *name, size_t name_length)
+{
+	char path[DEVICE_CACHE_PATH_SIZE];
+
+	return !device_cache_lookup(device_classes[class].dir_path, name,
+				    name_length, path, sizeof(path));
+}
+
+int write_fan_speed(int fd, int value)
+{
+	if (value < 0) {
+		fprintf(stderr,
+			"can't set fan speed lower than 0, setting 0\n");
+		value = 0;
+	}
+	if (value > MAX_FAN_SPEED) {
+		fprintf(stderr,
+			"can't set fan speed higher than %d, setting %d\n",
+			MAX_FAN_SPEED, MAX_FAN_SPEED);
+		value = MAX_FAN_SPEED;
+	}
+
+	return write_value(fd, value);
+}
+
+int write_value(int fd, long long value)
+{
+	char value_str[NUMBER_STR_SIZE];
+	size_t length = format_long_long(value, value_str);
+	// sysfs parses every write() on its own, so the tail of a short write
+	// would be taken for a new value. Retry the whole value instead.
+	for (int attempt = 0; attempt < WRITE_ATTEMPTS;) {
+		ssize_t r = pwrite(fd, value_str, length, 0);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r < 0) {
+			perror("pwrite() failed");
+			return -1;
+		}
+		if ((size_t)r == length) {
+			return 0;
+		}
+		attempt++;
+	}
+	fprintf(stderr, "short write of %lld\n", value);
+
+	return -1;
+}
+
+int fd_path(int fd, char *out_path, size_t out_path_length)
+{
+	char link_path[32];
+	snprintf(link_path, sizeof(link_path), "/proc/self/fd/%d", fd);
+	ssize_t length = readlink(link_path, out_path, out_path_length - 1);
+	if (length < 0) {
+		perror("readlink() failed");
+		return -1;
+	}
+	if ((size_t)length == out_path_length - 1) {
+		fprintf(stderr, "path of fd %d too long\n", fd);
+		return -1;
+	}
+	out_path[length] = '\0';
+
+	return 0;
+}
+
+int read_value(int fd, char *value_str, size_t value_str_length,
+	       long long *out_value)
+{
+	// sysfs fills the whole attribute on the first read, so there are no
+	// partial reads to handle short of a value longer than value_str.
+	ssize_t r;
+	do {
+		r = pread(fd, value_str, value_str_length - 1, 0);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) {
+		perror("pread() failed");
+		return -1;
+	}
+
+	return parse_value(value_str, (size_t)r, out_value);
+}
+
+int parse_value(char *value_str, size_t length, long long *out_value)
+{
+	value_str[length] = '\0';
+	if (parse_long_long(value_str, NULL, out_value)) {
+		fprintf(stderr, "not a number: %s\n", value_str);
+		return -1;
+	}
+
+	return 0;
+}
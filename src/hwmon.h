@@ -0,0 +1,48 @@
+#ifndef HWMON_H
+#define HWMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HWMON_DIR_PATH "/sys/class/hwmon/"
+#define THERMAL_DIR_PATH "/sys/class/thermal/"
+#define MAX_FAN_SPEED 255
+#define SYSFS_VALUE_SIZE 16
+
+enum device_class {
+	DEVICE_CLASS_HWMON,
+	DEVICE_CLASS_THERMAL,
+};
+
+// A node to open under the device whose name (hwmon) or type (thermal zone)
+// starts with name.
+struct device_request {
+	enum device_class class;
+	char *name;
+	size_t name_length;
+	char *node;
+	int oflag;
+	// Set by open_devices(), -1 if it could not be opened.
+	int fd;
+};
+
+// Resolves every request with at most one directory walk per class,
+// however many sensors and fans are configured. Returns -1 if any request
+// is left unopened, the others stay open.
+int open_devices(struct device_request *requests, int count);
+// Whether the device opened by name is still the one that was resolved,
+// checked against the device cache with a single stat().
+bool device_present(enum device_class class, char *name, size_t name_length);
+int write_fan_speed(int fd, int value);
+int write_value(int fd, long long value);
+// Where the sysfs attribute open as fd lives, for finding its siblings.
+int fd_path(int fd, char *out_path, size_t out_path_length);
+// Reads a whole sysfs attribute holding one integer. value_str is scratch
+// space, at least SYSFS_VALUE_SIZE bytes.
+int read_value(int fd, char *value_str, size_t value_str_length,
+	       long long *out_value);
+// Parses length bytes already read into value_str, which must have room
+// for a terminator after them.
+int parse_value(char *value_str, size_t length, long long *out_value);
+
+#endif
@@ -0,0 +1,167 @@
+#include "idle.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sysfs_state.h"
+
+#define GOVERNOR_USER_SPACE "user_space"
+#define TRIP_TYPE_SIZE 16
+
+void idle_init(struct idle *idle)
+{
+	memset(idle, 0, sizeof(*idle));
+}
+
+// Reads a short string attribute without its newline. Fails quietly, most
+// zones have no such trip.
+static int read_sibling_str(const char *dir_path, const char *node,
+			    char *out_str, size_t out_str_length)
+{
+	char path[IDLE_PATH_SIZE];
+	if (snprintf(path, sizeof(path), "%s/%s", dir_path, node) >=
+	    (int)sizeof(path)) {
+		return -1;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t r = pread(fd, out_str, out_str_length - 1, 0);
+	close(fd);
+	if (r <= 0) {
+		return -1;
+	}
+	out_str[r] = '\0';
+	out_str[strcspn(out_str, "\n")] = '\0';
+
+	return 0;
+}
+
+// Opens the first writable active or passive trip of the zone sensor
+// reads from, -1 if the zone has none or is not under user_space. Its
+// path goes to out_path, IDLE_PATH_SIZE bytes.
+static int open_trip(const struct sensor *sensor, char *out_path)
+{
+	char dir_path[IDLE_PATH_SIZE];
+	char governor[TRIP_TYPE_SIZE];
+
+	if (sensor->source != SENSOR_SOURCE_THERMAL || sensor->fd < 0 ||
+	    fd_path(sensor->fd, dir_path, sizeof(dir_path))) {
+		return -1;
+	}
+	char *node = strrchr(dir_path, '/');
+	if (!node) {
+		return -1;
+	}
+	*node = '\0';
+	// Any other governor acts on passive and active trips itself.
+	if (read_sibling_str(dir_path, "policy", governor, sizeof(governor)) ||
+	    strcmp(governor, GOVERNOR_USER_SPACE)) {
+		return -1;
+	}
+
+	for (int i = 0;; i++) {
+		char trip_node[32];
+		char type[TRIP_TYPE_SIZE];
+		snprintf(trip_node, sizeof(trip_node), "trip_point_%d_type", i);
+		if (read_sibling_str(dir_path, trip_node, type, sizeof(type))) {
+			return -1;
+		}
+		if (strcmp(type, "active") && strcmp(type, "passive")) {
+			continue;
+		}
+		if (snprintf(out_path, IDLE_PATH_SIZE, "%s/trip_point_%d_temp",
+			     dir_path, i) >= IDLE_PATH_SIZE) {
+			return -1;
+		}
+		// Only writable with CONFIG_THERMAL_WRITABLE_TRIPS.
+		int fd = open(out_path, O_RDWR | O_CLOEXEC);
+		if (fd >= 0) {
+			return fd;
+		}
+	}
+}
+
+static void borrow_trips(struct idle *idle, const struct zone_table *zones,
+			 long margin)
+{
+	for (int i = 0; i < zones->sensor_count; i++) {
+		struct idle_trip *trip = &idle->trips[idle->trip_count];
+		trip->fd = open_trip(&zones->sensors[i], trip->path);
+		if (trip->fd < 0) {
+			continue;
+		}
+		long wake_temp =
+			zone_table_sensor_min_temp(zones, i) - margin / 2;
+		if (read_value(trip->fd, trip->value_str,
+			       sizeof(trip->value_str), &trip->original)) {
+			log_fail("read_value", __FILE__, __LINE__);
+			close(trip->fd);
+			continue;
+		}
+		// Recorded first, so a crash never leaves the trip lowered.
+		size_t length = format_long_long(trip->original,
+						 trip->value_str);
+		trip->value_str[length - 1] = '\0';
+		if (sysfs_state_remember(trip->path, trip->value_str)) {
+			log_fail("sysfs_state_remember", __FILE__, __LINE__);
+			close(trip->fd);
+			continue;
+		}
+		if (write_value(trip->fd, wake_temp)) {
+			log_fail("write_value", __FILE__, __LINE__);
+			sysfs_state_forget(trip->path);
+			close(trip->fd);
+			continue;
+		}
+		idle->trip_count++;
+	}
+}
+
+void idle_leave(struct idle *idle)
+{
+	for (int i = 0; i < idle->trip_count; i++) {
+		struct idle_trip *trip = &idle->trips[i];
+		if (write_value(trip->fd, trip->original)) {
+			fprintf(stderr, "restoring a trip point to %lld failed\n",
+				trip->original);
+		} else {
+			sysfs_state_forget(trip->path);
+		}
+		close(trip->fd);
+	}
+	idle->trip_count = 0;
+	idle->active = false;
+}
+
+long idle_next(struct idle *idle, const struct zone_table *zones,
+	       const struct idle_config *config, long interval_ms)
+{
+	if (!config->max_interval_ms ||
+	    !zone_table_idle(zones, config->margin)) {
+		if (idle->active) {
+			idle_leave(idle);
+		}
+		return interval_ms;
+	}
+	if (!idle->active) {
+		idle->active = true;
+		idle->interval_ms = interval_ms;
+		borrow_trips(idle, zones, config->margin);
+	}
+	if (idle->trip_count == zones->sensor_count) {
+		return config->max_interval_ms;
+	}
+	if (idle->interval_ms < config->max_interval_ms) {
+		idle->interval_ms *= 2;
+	}
+	if (idle->interval_ms > config->max_interval_ms) {
+		idle->interval_ms = config->max_interval_ms;
+	}
+
+	return idle->interval_ms;
+}
@@ -0,0 +1,54 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdbool.h>
+
+#include "hwmon.h"
+#include "number.h"
+#include "zone.h"
+
+#define DEFAULT_IDLE_MARGIN 5000
+#define DEFAULT_IDLE_MAX_INTERVAL_MS 600000
+#define IDLE_PATH_SIZE 256
+
+struct idle_config {
+	// How far below min_temp every sensor has to be.
+	long margin;
+	// Longest sleep while idle, 0 disables idle mode.
+	long max_interval_ms;
+};
+
+// A trip point borrowed to wake the loop, put back on leaving idle. The
+// original is also kept in the sysfs state file, so a restart after a
+// crash puts it back too.
+struct idle_trip {
+	int fd;
+	long long original;
+	char path[IDLE_PATH_SIZE];
+	char value_str[NUMBER_STR_SIZE];
+};
+
+// Once nothing needs cooling the sampling interval doubles past
+// max_interval_ms on every tick. Thermal zones under the user_space
+// governor, which sends a uevent whenever a trip point is crossed and
+// otherwise leaves the trips to userspace, get a writable trip moved
+// halfway into the margin instead. When every sensor has one, the loop
+// sleeps for max_interval_ms right away and the uevent brings it back.
+// Without, the emergency watcher wakes the loop at the same point of any
+// sensor it watches.
+struct idle {
+	bool active;
+	long interval_ms;
+	int trip_count;
+	struct idle_trip trips[MAX_SENSORS];
+};
+
+void idle_init(struct idle *idle);
+// Called after every tick with the interval the scheduler picked. Returns
+// the delay until the next sample.
+long idle_next(struct idle *idle, const struct zone_table *zones,
+	       const struct idle_config *config, long interval_ms);
+// Puts every borrowed trip point back.
+void idle_leave(struct idle *idle);
+
+#endif
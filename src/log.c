@@ -0,0 +1,9 @@
+#include "log.h"
+
+#include <stdio.h>
+
+void log_fail(char *function_name, char *filename, int line)
+{
+	fprintf(stderr, "%s() failed at %s:%d\n", function_name, filename,
+		line);
+}
@@ -0,0 +1,6 @@
+#ifndef LOG_H
+#define LOG_H
+
+void log_fail(char *function_name, char *filename, int line);
+
+#endif
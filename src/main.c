@@ -1,19 +1,186 @@
-#include <dirent.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <linux/limits.h>
+#include <getopt.h>
+#include <linux/netlink.h>
+#include <limits.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
-#define HWMON_DIR_PATH "/sys/class/hwmon/"
-#define HWMON_NAME_CPU "cpu"
-#define HWMON_NAME_FAN "pwmfan"
-#define MAX_FAN_SPEED 255.0
+#include "alloc_guard.h"
+#include "api.h"
+#include "calibrate.h"
+#include "client.h"
+#include "config_file.h"
+#include "controller.h"
+#include "cpu_load.h"
+#include "cpufreq.h"
+#include "curve.h"
+#include "device_cache.h"
+#include "emergency.h"
+#include "filter.h"
+#include "governor.h"
+#include "hwmon.h"
+#include "idle.h"
+#include "log.h"
+#include "notify.h"
+#include "number.h"
+#include "realtime.h"
+#include "record.h"
+#include "replay.h"
+#include "shared.h"
+#include "sysfs_state.h"
+#include "telemetry.h"
+#include "throttle.h"
+#include "trace.h"
+#include "zone.h"
+
+#define DEFAULT_MIN_INTERVAL_MS 250
+#define DEFAULT_MAX_INTERVAL_MS 10000
+#define DEFAULT_PID_KP 0.02
+#define DEFAULT_PID_KI 0.0005
+#define DEFAULT_PID_KD 0.005
+#define DEFAULT_LOAD_THRESHOLD 0.5
+#define TEMP_UNSET LONG_MIN
+#define DEFAULT_TELEMETRY_INTERVAL_MS 15000
+#define DEFAULT_SLEW_UP_BAND 2
+#define DEFAULT_SLEW_DOWN_BAND 8
+#define DEFAULT_SLEW_UP_RATE 0
+#define DEFAULT_SLEW_DOWN_RATE 32
+// A failed tick is retried after TICK_RETRY_BASE_MS, doubling up to
+// max_interval_ms. The fans go to full speed once this many ticks in a row
+// failed, and stay there until one succeeds.
+#define TICK_RETRY_BASE_MS 100
+#define TICK_FAILURES_BEFORE_MAX 3
+#define UEVENT_BUFFER_SIZE 4096
+#define UEVENT_SUBSYSTEM_THERMAL "SUBSYSTEM=thermal"
+#define UEVENT_SUBSYSTEM_HWMON "SUBSYSTEM=hwmon"
+#define UEVENT_ACTION_ADD "ACTION=add"
+#define UEVENT_ACTION_REMOVE "ACTION=remove"
+
+enum event_source {
+	EVENT_SOURCE_TIMER,
+	EVENT_SOURCE_SENSOR,
+	EVENT_SOURCE_UEVENT,
+	EVENT_SOURCE_TELEMETRY,
+	EVENT_SOURCE_API,
+	EVENT_SOURCE_GOVERNOR,
+	EVENT_SOURCE_EMERGENCY,
+	// Client i of the api is EVENT_SOURCE_API_CLIENT + i.
+	EVENT_SOURCE_API_CLIENT,
+};
+
+struct config {
+	struct controller_config controller;
+	long min_interval_ms;
+	long max_interval_ms;
+	struct zone_table zones;
+	struct slew_config slew;
+	struct tach_config tach;
+	// For every sensor whose spec names no filter of its own.
+	struct filter_config filter;
+	// How far throttling may lower the curves, 0 to only report it.
+	long auto_tune_limit;
+	// Fans run up to this pwm before cpufreq is capped, with the thermal
+	// zones handed to the user_space governor. 0 leaves the throttling
+	// to the kernel. Only applied at startup.
+	int acoustic_limit;
+	// Only applied at startup, a reload keeps what is running.
+	struct realtime_config realtime;
+	// Emergency threshold on top of the trip points, 0 for trip points
+	// only.
+	long emergency_temp;
+	struct idle_config idle;
+	// Empty to disable the cache.
+	char device_cache_path[DEVICE_CACHE_PATH_SIZE];
+	// Where borrowed sysfs values are remembered across a crash, empty
+	// to only keep them in memory. Only applied at startup.
+	char state_path[SYSFS_STATE_PATH_SIZE];
+	// Empty to run without fan profiles.
+	char profile_path[PROFILE_PATH_SIZE];
+	// Set to measure the fans and write profile_path instead of driving
+	// them.
+	bool calibrate;
+	// Empty to neither share state nor guard against a second instance.
+	char shared_name[SHARED_NAME_SIZE];
+	// Empty to run without the api socket.
+	char api_socket_path[API_SOCKET_PATH_SIZE];
+	// Set to talk to the running daemon instead of driving the fans.
+	struct client_request client;
+	// Empty to disable the textfile export.
+	char telemetry_path[TELEMETRY_PATH_SIZE];
+	// Empty to disable recording a replay trace.
+	char trace_path[TELEMETRY_PATH_SIZE];
+	// The binary rolling record, empty to disable it. Only applied at
+	// startup.
+	char record_path[RECORD_PATH_SIZE];
+	// Set to print a record as CSV instead of driving the fans.
+	char record_dump_path[RECORD_PATH_SIZE];
+	long telemetry_interval_ms;
+	// Set to replay a trace, or the built-in ones, instead of driving the
+	// fans.
+	char replay_path[TELEMETRY_PATH_SIZE];
+	bool bench;
+	// Ticks to run and then report startup latency and cpu cost per
+	// tick for, 0 to run until SIGTERM.
+	long startup_bench_ticks;
+	struct replay_model replay_model;
+	long replay_threshold;
+	// Parsed again, together with the config file, on SIGHUP.
+	int argc;
+	char **argv;
+};
+
+// CLOCK_MONOTONIC_RAW on entering main(), which a static build reaches
+// within microseconds of exec.
+static uint64_t started_ns;
+
+enum uevent_flag {
+	UEVENT_THERMAL = 1 << 0,
+	UEVENT_DEVICES = 1 << 1,
+};
+
+struct event_loop {
+	int epoll_fd;
+	int timer_fd;
+	int uevent_fd;
+	int telemetry_fd;
+	// Written by the emergency watcher when it wants a sample.
+	int wake_fd;
+	// Set when an hwmon device or thermal zone appeared or disappeared.
+	bool devices_changed;
+	bool telemetry_due;
+	struct api api;
+	// Bit i is set when api client i sent something, bit API_CLIENTS
+	// when a connection is waiting to be accepted.
+	uint32_t api_pending;
+	// Set while the governor listens for trip events.
+	struct governor *governor;
+	// CLOCK_MONOTONIC expiry the timer was last armed for.
+	struct timespec deadline;
+	// CLOCK_MONOTONIC_RAW time of the last wakeup that asked for a
+	// sample, and how late the timer fired for it, -1 if something else
+	// woke the loop first.
+	uint64_t wake_ns;
+	int32_t jitter_us;
+};
 
 static volatile sig_atomic_t got_sigterm = 0;
+static volatile sig_atomic_t got_sighup = 0;
+static volatile sig_atomic_t got_sigusr1 = 0;
+// SIGUSR1 stays blocked outside epoll_pwait(), so a wake that arrives
+// mid-tick is still pending when the loop next blocks.
+static sigset_t wait_mask;
 
 static void handle_sigterm(int signum)
 {
@@ -26,236 +193,1961 @@ static void handle_sigterm(int signum)
 	}
 }
 
-static void log_fail(char *function_name, char *filename, int line)
+static void handle_sighup(int signum)
 {
-	fprintf(stderr, "%s() failed at %s:%d\n", function_name, filename,
-		line);
+	(void)signum;
+	got_sighup = 1;
 }
 
-static int read_line(char *file_path, char *out_line, size_t out_line_length)
+static void handle_sigusr1(int signum)
 {
-	int status = 0;
+	(void)signum;
+	got_sigusr1 = 1;
+}
 
-	FILE *f = fopen(file_path, "r");
-	if (!f) {
-		perror("fopen() failed");
+static int epoll_add(int epoll_fd, int fd, uint32_t events,
+		     enum event_source source)
+{
+	struct epoll_event event = {
+		.events = events,
+		.data.u32 = source,
+	};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+		perror("epoll_ctl() failed");
 		return -1;
 	}
-	if (getline(&out_line, &out_line_length, f) < 1) {
-		perror("getline() failed");
-		status = -1;
+
+	return 0;
+}
+
+static int open_uevent_socket(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		perror("socket(NETLINK_KOBJECT_UEVENT) failed");
+		return -1;
 	}
-	if (fclose(f) == EOF) {
-		perror("fclose() failed");
-		status = -1;
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind() failed");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void event_loop_cleanup(struct event_loop *loop)
+{
+	api_close(&loop->api);
+	if (loop->uevent_fd >= 0 && close(loop->uevent_fd) < 0) {
+		perror("close() failed");
+	}
+	if (close(loop->wake_fd) < 0) {
+		perror("close() failed");
+	}
+	if (close(loop->telemetry_fd) < 0) {
+		perror("close() failed");
 	}
+	if (close(loop->timer_fd) < 0) {
+		perror("close() failed");
+	}
+	if (close(loop->epoll_fd) < 0) {
+		perror("close() failed");
+	}
+}
+
+// Only some hwmon drivers call sysfs_notify() on temp1_input, and the
+// thermal framework only emits uevents on trip crossings. Both are optional,
+// the timer alone is enough to keep the loop going. Called again after
+// sensors are reopened, closed fds drop out of the epoll set by themselves.
+static void event_loop_add_sensors(struct event_loop *loop,
+				   const struct zone_table *zones)
+{
+	for (int i = 0; i < zones->sensor_count; i++) {
+		const struct sensor *sensor = &zones->sensors[i];
+		struct epoll_event event = {
+			.events = EPOLLPRI,
+			.data.u32 = EVENT_SOURCE_SENSOR,
+		};
+		if (sensor->fd < 0 ||
+		    !epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, sensor->fd,
+			       &event) ||
+		    errno == EEXIST) {
+			continue;
+		}
+		fprintf(stderr, "%s/%s is not pollable, using timer\n",
+			sensor->name, sensor->node);
+	}
+}
+
+static int event_loop_init(struct event_loop *loop,
+			   const struct zone_table *zones,
+			   const char *api_socket_path)
+{
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		perror("epoll_create1() failed");
+		return -1;
+	}
+	loop->timer_fd =
+		timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->timer_fd < 0) {
+		perror("timerfd_create() failed");
+		goto cleanup_epoll_fd;
+	}
+	if (epoll_add(loop->epoll_fd, loop->timer_fd, EPOLLIN,
+		      EVENT_SOURCE_TIMER)) {
+		log_fail("epoll_add", __FILE__, __LINE__);
+		goto cleanup_timer_fd;
+	}
+	// Telemetry is flushed on its own slow timer so the ticks never pay
+	// for it.
+	loop->telemetry_fd =
+		timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->telemetry_fd < 0) {
+		perror("timerfd_create() failed");
+		goto cleanup_timer_fd;
+	}
+	if (epoll_add(loop->epoll_fd, loop->telemetry_fd, EPOLLIN,
+		      EVENT_SOURCE_TELEMETRY)) {
+		log_fail("epoll_add", __FILE__, __LINE__);
+		goto cleanup_telemetry_fd;
+	}
+	loop->telemetry_due = false;
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wake_fd < 0) {
+		perror("eventfd() failed");
+		goto cleanup_telemetry_fd;
+	}
+	if (epoll_add(loop->epoll_fd, loop->wake_fd, EPOLLIN,
+		      EVENT_SOURCE_EMERGENCY)) {
+		log_fail("epoll_add", __FILE__, __LINE__);
+		goto cleanup_wake_fd;
+	}
+
+	event_loop_add_sensors(loop, zones);
+	loop->devices_changed = false;
+	loop->governor = NULL;
+	loop->uevent_fd = open_uevent_socket();
+	if (loop->uevent_fd >= 0 &&
+	    epoll_add(loop->epoll_fd, loop->uevent_fd, EPOLLIN,
+		      EVENT_SOURCE_UEVENT)) {
+		close(loop->uevent_fd);
+		loop->uevent_fd = -1;
+	}
+	if (loop->uevent_fd < 0) {
+		fprintf(stderr, "thermal uevents unavailable, using timer\n");
+	}
+
+	// The fans are still controlled without it.
+	api_init(&loop->api);
+	loop->api_pending = 0;
+	if (*api_socket_path &&
+	    (api_open(&loop->api, api_socket_path) ||
+	     epoll_add(loop->epoll_fd, loop->api.listen_fd, EPOLLIN,
+		       EVENT_SOURCE_API))) {
+		log_fail("api_open", __FILE__, __LINE__);
+		api_close(&loop->api);
+	}
+
+	return 0;
+
+cleanup_wake_fd:
+	close(loop->wake_fd);
+cleanup_telemetry_fd:
+	close(loop->telemetry_fd);
+cleanup_timer_fd:
+	close(loop->timer_fd);
+cleanup_epoll_fd:
+	close(loop->epoll_fd);
+
+	return -1;
+}
+
+static int event_loop_arm(struct event_loop *loop, long interval_ms)
+{
+	// An absolute expiry gives the jitter something to be measured
+	// against. timerfd runs on CLOCK_MONOTONIC, so the jitter does too.
+	if (clock_gettime(CLOCK_MONOTONIC, &loop->deadline)) {
+		perror("clock_gettime() failed");
+		return -1;
+	}
+	loop->deadline.tv_sec += interval_ms / 1000;
+	loop->deadline.tv_nsec += (interval_ms % 1000) * 1000000;
+	if (loop->deadline.tv_nsec >= 1000000000) {
+		loop->deadline.tv_sec++;
+		loop->deadline.tv_nsec -= 1000000000;
+	}
+	struct itimerspec spec = {
+		.it_value = loop->deadline,
+	};
+	if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+		perror("timerfd_settime() failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Fires every interval_ms until changed, 0 stops it.
+static int event_loop_arm_telemetry(struct event_loop *loop, long interval_ms)
+{
+	struct timespec period = {
+		.tv_sec = interval_ms / 1000,
+		.tv_nsec = (interval_ms % 1000) * 1000000,
+	};
+	struct itimerspec spec = {
+		.it_interval = period,
+		.it_value = period,
+	};
+	if (timerfd_settime(loop->telemetry_fd, 0, &spec, NULL)) {
+		perror("timerfd_settime() failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_uevent(char *buffer, ssize_t length)
+{
+	bool thermal = false;
+	bool hwmon = false;
+	bool hotplug = false;
+
+	// The payload is "action@devpath" followed by NUL-separated KEY=value
+	// pairs.
+	for (char *key = buffer; key < buffer + length; key += strlen(key) + 1) {
+		if (!strcmp(key, UEVENT_SUBSYSTEM_THERMAL)) {
+			thermal = true;
+		} else if (!strcmp(key, UEVENT_SUBSYSTEM_HWMON)) {
+			hwmon = true;
+		} else if (!strcmp(key, UEVENT_ACTION_ADD) ||
+			   !strcmp(key, UEVENT_ACTION_REMOVE)) {
+			hotplug = true;
+		}
+	}
+
+	int flags = 0;
+	if (thermal) {
+		flags |= UEVENT_THERMAL;
+	}
+	if ((thermal || hwmon) && hotplug) {
+		flags |= UEVENT_DEVICES;
+	}
+	return flags;
+}
+
+static int drain_uevents(int uevent_fd)
+{
+	char buffer[UEVENT_BUFFER_SIZE];
+	int flags = 0;
+
+	for (;;) {
+		ssize_t r = recv(uevent_fd, buffer, sizeof(buffer) - 1, 0);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				perror("recv() failed");
+			}
+			break;
+		}
+		buffer[r] = '\0';
+		flags |= parse_uevent(buffer, r);
+	}
+
+	return flags;
+}
+
+static int32_t timer_lateness_us(const struct event_loop *loop)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t late_us = (now.tv_sec - loop->deadline.tv_sec) * 1000000 +
+			  (now.tv_nsec - loop->deadline.tv_nsec) / 1000;
+
+	return late_us < 0 ? 0 : (int32_t)late_us;
+}
+
+// Blocks until the timer expires, a sensor is notified, a thermal zone
+// reports a trip, a device is hotplugged, the emergency watcher asks for
+// a sample or SIGUSR1 arrives and returns 1.
+// Returns early with 0 if SIGTERM or SIGHUP arrives, telemetry is due or
+// the api has something to handle.
+static int event_loop_wait(struct event_loop *loop)
+{
+	struct epoll_event events[MAX_SENSORS + 2];
+
+	while (!got_sigterm && !got_sighup) {
+		bool sample = false;
+		bool timer = false;
+		int n = epoll_pwait(loop->epoll_fd, events, MAX_SENSORS + 2, -1,
+				    &wait_mask);
+		if (n < 0) {
+			if (errno != EINTR) {
+				perror("epoll_pwait() failed");
+				return -1;
+			}
+			// SIGUSR1 comes from shared_wake().
+			n = 0;
+			sample = got_sigusr1;
+			got_sigusr1 = 0;
+		}
+		for (int i = 0; i < n; i++) {
+			uint64_t expirations = 0;
+			switch (events[i].data.u32) {
+			case EVENT_SOURCE_TIMER:
+				if (read(loop->timer_fd, &expirations,
+					 sizeof(expirations)) < 0 &&
+				    errno != EAGAIN) {
+					perror("read() failed");
+					return -1;
+				}
+				sample = true;
+				timer = true;
+				break;
+			case EVENT_SOURCE_SENSOR:
+				sample = true;
+				break;
+			case EVENT_SOURCE_TELEMETRY:
+				if (read(loop->telemetry_fd, &expirations,
+					 sizeof(expirations)) < 0 &&
+				    errno != EAGAIN) {
+					perror("read() failed");
+					return -1;
+				}
+				loop->telemetry_due = true;
+				break;
+			case EVENT_SOURCE_UEVENT: {
+				int flags = drain_uevents(loop->uevent_fd);
+				if (flags & UEVENT_DEVICES) {
+					loop->devices_changed = true;
+				}
+				if (flags) {
+					sample = true;
+				}
+				break;
+			}
+			case EVENT_SOURCE_API:
+				loop->api_pending |= 1u << API_CLIENTS;
+				break;
+			case EVENT_SOURCE_GOVERNOR:
+				if (governor_drain(loop->governor)) {
+					sample = true;
+				}
+				break;
+			case EVENT_SOURCE_EMERGENCY:
+				if (read(loop->wake_fd, &expirations,
+					 sizeof(expirations)) < 0 &&
+				    errno != EAGAIN) {
+					perror("read() failed");
+					return -1;
+				}
+				sample = true;
+				break;
+			default:
+				if (events[i].data.u32 >=
+					    EVENT_SOURCE_API_CLIENT &&
+				    events[i].data.u32 <
+					    EVENT_SOURCE_API_CLIENT + API_CLIENTS) {
+					loop->api_pending |=
+						1u << (events[i].data.u32 -
+						       EVENT_SOURCE_API_CLIENT);
+				}
+				break;
+			}
+		}
+		if (sample) {
+			loop->wake_ns = telemetry_now_ns();
+			loop->jitter_us = timer ? timer_lateness_us(loop) : -1;
+			TRACE_TICK_WAKE(loop->jitter_us);
+			return 1;
+		}
+		if (loop->telemetry_due || loop->api_pending) {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static long milliseconds_between(const struct timespec *from,
+				 const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+	       (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+struct control_state {
+	bool measure_load;
+	bool measure_freq;
+	struct cpu_load cpu_load;
+	struct cpufreq cpufreq;
+	struct controller_input input;
+	struct timespec last_time;
+	// When the loop woke up for this tick and how late its timer was,
+	// filled in from the event loop.
+	uint64_t wake_ns;
+	int32_t jitter_us;
+	struct telemetry telemetry;
+	struct emergency emergency;
+	bool emergency_seen;
+	struct notify notify;
+	struct idle idle;
+	struct shared *shared;
+	struct api *api;
+	// Off when there is nothing to watch.
+	bool watch_throttle;
+	struct throttle throttle;
+	// Off unless an acoustic limit is set and the zones could be taken.
+	bool govern;
+	struct governor governor;
+	struct record record;
+	// Successful ticks so far, the first one's write and the cpu time
+	// used up to it, for --startup-bench.
+	long ticks;
+	uint64_t first_write_ns;
+	uint64_t first_cpu_ns;
+};
+
+// CLOCK_MONOTONIC_RAW timestamps of the stages of one tick.
+struct tick_stamps {
+	uint64_t wake_ns;
+	uint64_t read_ns;
+	uint64_t eval_ns;
+	uint64_t write_ns;
+};
+
+static uint32_t since_wake_us(const struct tick_stamps *stamps,
+			      uint64_t stamp_ns)
+{
+	return (uint32_t)((stamp_ns - stamps->wake_ns) / 1000);
+}
+
+// Fills the tick's telemetry sample from memory only, the clocks are read
+// through the vDSO.
+static void record_tick(struct control_state *state,
+			const struct zone_table *zones,
+			const struct timespec *start,
+			const struct tick_stamps *stamps, long interval_ms)
+{
+	struct telemetry_sample sample = {
+		.time_ms = (uint64_t)start->tv_sec * 1000 +
+			   start->tv_nsec / 1000000,
+		.temp = zones->sensor_count ? zones->sensors[0].temp : 0,
+		.read_us = since_wake_us(stamps, stamps->read_ns),
+		.eval_us = since_wake_us(stamps, stamps->eval_ns),
+		.write_us = since_wake_us(stamps, stamps->write_ns),
+		.jitter_us = state->jitter_us,
+		.interval_ms = interval_ms,
+		.load_permille = (uint16_t)(state->input.load * 1000.0 + 0.5),
+		.freq_permille = (uint16_t)(state->input.freq * 1000.0 + 0.5),
+		.sensor_count = (uint8_t)zones->sensor_count,
+	};
+	for (int i = 0; i < zones->sensor_count; i++) {
+		sample.temps[i] = zones->sensors[i].temp;
+		if (zones->sensors[i].temp > sample.temp) {
+			sample.temp = zones->sensors[i].temp;
+		}
+	}
+	for (int i = 0; i < zones->fan_count; i++) {
+		sample.fan_speeds[i] = (uint8_t)zones->fans[i].speed;
+	}
+	telemetry_record(&state->telemetry, &sample);
+	TRACE_TICK_WRITE(sample.write_us);
+}
+
+// Highest floor other processes asked for, through shared memory or the
+// api socket.
+static int requested_floor(struct control_state *state, uint64_t now_ns,
+			   long dt_ms)
+{
+	int floor = shared_floor(state->shared, now_ns, dt_ms);
+	int api_floor_pwm = api_floor(state->api, now_ns);
+
+	return api_floor_pwm > floor ? api_floor_pwm : floor;
+}
+
+// Counts throttling into the telemetry, and with auto-tune lowers the
+// curves a step on every new throttle event. The fans then run faster at
+// the temperatures that ended up throttling.
+static void watch_throttle(struct control_state *state, struct config *config)
+{
+	if (!state->watch_throttle) {
+		return;
+	}
+	if (state->throttle.throttled) {
+		state->telemetry.throttled_ms += state->input.dt_ms;
+	}
+	int started = throttle_read(&state->throttle,
+				    state->govern ? &state->governor : NULL);
+	if (started < 0) {
+		log_fail("throttle_read", __FILE__, __LINE__);
+		return;
+	}
+	state->telemetry.throttled = state->throttle.throttled;
+	if (!started) {
+		return;
+	}
+	state->telemetry.throttle_events++;
+	long delta = config->auto_tune_limit - config->zones.curve_shift;
+	if (delta <= 0) {
+		return;
+	}
+	zone_table_lower_curves(&config->zones, delta < THROTTLE_TUNE_STEP
+							? delta
+							: THROTTLE_TUNE_STEP);
+	fprintf(stderr, "throttling, curves lowered by %ld.%03ld C\n",
+		config->zones.curve_shift / 1000,
+		config->zones.curve_shift % 1000);
+}
+
+// With cooperative cooling the zones never run the fans past the acoustic
+// limit, and go straight to it once a thermal zone reaches its passive
+// trip point. That is where the kernel would have started throttling.
+static void govern_fans(struct control_state *state, struct config *config)
+{
+	struct zone_table *zones = &config->zones;
+
+	zones->ceiling = MAX_FAN_SPEED;
+	if (!state->govern) {
+		return;
+	}
+	if (governor_read(&state->governor)) {
+		log_fail("governor_read", __FILE__, __LINE__);
+	}
+	zones->ceiling = config->acoustic_limit;
+	if (state->governor.hot && zones->floor < config->acoustic_limit) {
+		zones->floor = config->acoustic_limit;
+	}
+}
+
+// Caps cpufreq only while the fans at the acoustic limit aren't enough.
+static void govern_frequency(struct control_state *state,
+			     const struct config *config)
+{
+	if (!state->govern) {
+		return;
+	}
+	const struct zone_table *zones = &config->zones;
+	bool fans_at_limit = true;
+	for (int i = 0; i < zones->fan_count; i++) {
+		fans_at_limit &= zones->fans[i].target >= config->acoustic_limit;
+	}
+	if (governor_update(&state->governor, fans_at_limit,
+			    state->input.dt_ms)) {
+		log_fail("governor_update", __FILE__, __LINE__);
+	}
+	state->telemetry.frequency_cap_permille =
+		governor_cap_permille(&state->governor);
+}
+
+static int control_tick(struct control_state *state, struct config *config,
+			long *out_interval_ms)
+{
+	struct zone_table *zones = &config->zones;
+	struct controller_input *input = &state->input;
+	// Ticks that did not follow a wakeup, such as the first one, are
+	// timed from here.
+	struct tick_stamps stamps = {
+		.wake_ns = state->wake_ns ? state->wake_ns : telemetry_now_ns(),
+	};
+	state->wake_ns = 0;
+
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+		perror("clock_gettime() failed");
+		return -1;
+	}
+	if (zone_table_read(zones)) {
+		log_fail("zone_table_read", __FILE__, __LINE__);
+		return -1;
+	}
+	if (state->measure_load &&
+	    cpu_load_read(&state->cpu_load, &input->load)) {
+		log_fail("cpu_load_read", __FILE__, __LINE__);
+		return -1;
+	}
+	if (state->measure_freq &&
+	    cpufreq_read(&state->cpufreq, &input->freq)) {
+		log_fail("cpufreq_read", __FILE__, __LINE__);
+		return -1;
+	}
+	stamps.read_ns = telemetry_now_ns();
+	TRACE_TICK_READ(since_wake_us(&stamps, stamps.read_ns));
+	input->dt_ms = state->last_time.tv_sec
+			       ? milliseconds_between(&state->last_time, &now)
+			       : 0;
+	state->last_time = now;
+	uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	zones->floor = requested_floor(state, now_ns, input->dt_ms);
+	watch_throttle(state, config);
+	govern_fans(state, config);
+	*out_interval_ms = zone_table_update(zones, input);
+	// The next sample drops whichever request expires first.
+	long expiry_ms = shared_expiry_ms(state->shared, now_ns);
+	long api_ms = api_expiry_ms(state->api, now_ns);
+	if (api_ms >= 0 && (expiry_ms < 0 || api_ms < expiry_ms)) {
+		expiry_ms = api_ms;
+	}
+	if (expiry_ms >= 0 && expiry_ms < *out_interval_ms) {
+		*out_interval_ms = expiry_ms;
+	}
+	if (emergency_engaged(&state->emergency)) {
+		if (!state->emergency_seen) {
+			fprintf(stderr, "trip point crossed, fans at full speed\n");
+			state->telemetry.emergencies++;
+		}
+		zone_table_force_max(zones);
+	}
+	state->emergency_seen = emergency_engaged(&state->emergency);
+	govern_frequency(state, config);
+	stamps.eval_ns = telemetry_now_ns();
+	TRACE_TICK_EVAL(since_wake_us(&stamps, stamps.eval_ns));
+	if (zone_table_verify(zones, input->dt_ms)) {
+		log_fail("zone_table_verify", __FILE__, __LINE__);
+		return -1;
+	}
+	if (zone_table_write(zones)) {
+		log_fail("zone_table_write", __FILE__, __LINE__);
+		return -1;
+	}
+	stamps.write_ns = telemetry_now_ns();
+	record_tick(state, zones, &now, &stamps, *out_interval_ms);
+	shared_publish(state->shared, zones,
+		       __atomic_load_n(&state->telemetry.head,
+				       __ATOMIC_RELAXED),
+		       now_ns, zones->floor, state->emergency_seen);
+
+	return 0;
+}
+
+// How often flush_telemetry() has to run, 0 if it has nothing to do.
+static long telemetry_interval_ms(const struct config *config)
+{
+#ifdef NO_TELEMETRY
+	(void)config;
+	return 0;
+#else
+	return *config->telemetry_path || *config->trace_path ||
+			       *config->record_path
+		       ? config->telemetry_interval_ms
+		       : 0;
+#endif
+}
+
+static void flush_telemetry(struct control_state *state,
+			    const struct config *config)
+{
+	if (!telemetry_interval_ms(config)) {
+		return;
+	}
+#ifndef NO_TELEMETRY
+	// stdio allocates, and this is off the tick path anyway.
+	alloc_guard_disarm();
+	if (*config->telemetry_path &&
+	    telemetry_write_textfile(&state->telemetry, &config->zones,
+				     config->telemetry_path)) {
+		log_fail("telemetry_write_textfile", __FILE__, __LINE__);
+	}
+	if (*config->trace_path &&
+	    telemetry_append_trace(&state->telemetry, config->trace_path)) {
+		log_fail("telemetry_append_trace", __FILE__, __LINE__);
+	}
+	record_append(&state->record, &state->telemetry,
+		      config->zones.fan_count);
+	alloc_guard_arm();
+#else
+	(void)state;
+#endif
+}
+
+static uint64_t cpu_time_ns(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		perror("getrusage() failed");
+		return 0;
+	}
+	return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+		       1000000000 +
+	       ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) *
+		       1000;
+}
+
+// Counts a successful tick for --startup-bench. Returns true once the
+// last one ran and the results are printed. The cpu cost leaves out the
+// first tick, which pays for startup.
+static bool startup_bench_tick(struct control_state *state,
+			       const struct config *config)
+{
+	if (!config->startup_bench_ticks) {
+		return false;
+	}
+	if (!state->ticks++) {
+		state->first_write_ns = telemetry_now_ns();
+		state->first_cpu_ns = cpu_time_ns();
+	}
+	if (state->ticks < config->startup_bench_ticks) {
+		return false;
+	}
+
+	alloc_guard_disarm();
+	uint64_t startup_us = (state->first_write_ns - started_ns) / 1000;
+	printf("first pwm write %llu.%03llu ms after start\n",
+	       (unsigned long long)(startup_us / 1000),
+	       (unsigned long long)(startup_us % 1000));
+	if (state->ticks > 1) {
+		printf("%llu ns cpu per tick over %ld ticks\n",
+		       (unsigned long long)((cpu_time_ns() -
+					     state->first_cpu_ns) /
+					    (uint64_t)(state->ticks - 1)),
+		       state->ticks - 1);
+	}
+	alloc_guard_arm();
+	return true;
+}
+
+// Accepts new api clients and answers whatever the others sent. Returns 1
+// if an override changed and the fans need updating.
+static int handle_api(struct event_loop *loop, struct control_state *state,
+		      const struct config *config)
+{
+	uint32_t pending = loop->api_pending;
+	loop->api_pending = 0;
+
+	if (pending & 1u << API_CLIENTS) {
+		for (int client = api_accept(&loop->api); client >= 0;
+		     client = api_accept(&loop->api)) {
+			if (epoll_add(loop->epoll_fd, loop->api.clients[client],
+				      EPOLLIN,
+				      EVENT_SOURCE_API_CLIENT + client)) {
+				log_fail("epoll_add", __FILE__, __LINE__);
+			}
+		}
+	}
+
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+		perror("clock_gettime() failed");
+		return 0;
+	}
+	const struct api_view view = {
+		.zones = &config->zones,
+		.ticks = __atomic_load_n(&state->telemetry.head,
+					 __ATOMIC_RELAXED),
+		.floor = config->zones.floor,
+		.emergency = state->emergency_seen,
+		.throttled = state->throttle.throttled,
+		.throttle_events = state->telemetry.throttle_events,
+		.throttled_ms = state->telemetry.throttled_ms,
+	};
+	int changed = 0;
+	for (int i = 0; i < API_CLIENTS; i++) {
+		bool more = false;
+		if (pending & 1u << i && loop->api.clients[i] >= 0) {
+			changed |= api_handle(
+				&loop->api, i, &view,
+				(uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+				&more);
+		}
+		// Served again once the next tick had its turn.
+		if (more) {
+			loop->api_pending |= 1u << i;
+		}
+	}
+
+	return changed;
+}
+
+// Waits for the next sample and flushes telemetry whenever its timer
+// fires in between. An api client setting an override counts as a sample.
+static int wait_for_sample(struct event_loop *loop,
+			   struct control_state *state,
+			   const struct config *config)
+{
+	for (;;) {
+		int status = event_loop_wait(loop);
+		if (status < 0) {
+			return -1;
+		}
+		if (loop->telemetry_due) {
+			loop->telemetry_due = false;
+			flush_telemetry(state, config);
+		}
+		if (loop->api_pending && handle_api(loop, state, config)) {
+			state->wake_ns = telemetry_now_ns();
+			state->jitter_us = -1;
+			return 0;
+		}
+		if (status) {
+			state->wake_ns = loop->wake_ns;
+			state->jitter_us = loop->jitter_us;
+			return 0;
+		}
+		if (got_sigterm || got_sighup) {
+			return 0;
+		}
+	}
+}
+
+// The watcher runs just above the control loop, so it preempts it.
+static int emergency_priority(const struct config *config)
+{
+	int priority = config->realtime.priority;
+	if (priority && priority < sched_get_priority_max(SCHED_FIFO)) {
+		priority++;
+	}
+	return priority;
+}
+
+// Starts the watcher over on the fds zones has now. Called with the
+// allocation guard disarmed, a thread needs a stack.
+static void restart_emergency(struct control_state *state,
+			      const struct config *config)
+{
+	emergency_stop(&state->emergency);
+	if (emergency_start(&state->emergency, &config->zones,
+			    config->emergency_temp,
+			    emergency_priority(config))) {
+		// The control loop still runs the fans.
+		log_fail("emergency_start", __FILE__, __LINE__);
+	}
+}
+
+// Reopens whatever went away and remembers where it was found. Returns -1
+// while some device is still missing.
+static int refresh_devices(struct event_loop *loop, struct config *config,
+			   struct control_state *state)
+{
+	// Rescanning sysfs and rewriting the cache is allowed to allocate.
+	alloc_guard_disarm();
+	int status = zone_table_refresh(&config->zones);
+	restart_emergency(state, config);
+	// Trip points are borrowed again from whatever is open now.
+	idle_leave(&state->idle);
+
+	event_loop_add_sensors(loop, &config->zones);
+	if (*config->device_cache_path && device_cache_dirty() &&
+	    device_cache_save(config->device_cache_path)) {
+		log_fail("device_cache_save", __FILE__, __LINE__);
+	}
+	alloc_guard_arm();
 
 	return status;
 }
 
-static int find_hwmon_path(char *name, size_t name_length, char *out_path)
+static void measurements_close(struct control_state *state)
 {
-	int status = 0;
+	if (state->measure_freq) {
+		cpufreq_close(&state->cpufreq);
+	}
+	if (state->measure_load) {
+		cpu_load_close(&state->cpu_load);
+	}
+	state->measure_freq = false;
+	state->measure_load = false;
+}
 
-	DIR *dir = opendir(HWMON_DIR_PATH);
-	if (!dir) {
-		perror("opendir(" HWMON_DIR_PATH ") failed");
+static int measurements_open(struct control_state *state,
+			     const struct config *config)
+{
+	// /proc/stat and cpufreq are only worth reading when something
+	// consumes them.
+	bool measure_freq = config->controller.load_boost > 0.0;
+	bool measure_load = measure_freq ||
+			    config->controller.type == CONTROLLER_MPC ||
+			    (config->controller.type == CONTROLLER_PID &&
+			     config->controller.pid_ff != 0.0);
+	if (measure_load && cpu_load_open(&state->cpu_load)) {
+		log_fail("cpu_load_open", __FILE__, __LINE__);
 		return -1;
 	}
+	if (measure_freq && cpufreq_open(&state->cpufreq)) {
+		log_fail("cpufreq_open", __FILE__, __LINE__);
+		cpu_load_close(&state->cpu_load);
+		return -1;
+	}
+	state->measure_freq = measure_freq;
+	state->measure_load = measure_load;
+	state->input.load = 0.0;
+	state->input.freq = 0.0;
+
+	return 0;
+}
+
+static int parse_args(int argc, char **argv, struct config *config);
+
+// Parses argv and the config file again and swaps the result in between
+// two ticks. Fds and controller state carry over, and nothing is written
+// to the fans. A config that fails to parse or open leaves the running
+// one in place.
+static int reload_config(struct event_loop *loop, struct config *config,
+			 struct control_state *state)
+{
+	struct config next;
+	int status = -1;
+	// What auto-tune learned is only bounded by the new limit.
+	long curve_shift = config->zones.curve_shift;
+
+	// Parsing the file and rescanning sysfs are allowed to allocate.
+	alloc_guard_disarm();
+	fprintf(stderr, "reloading configuration\n");
+	if (parse_args(config->argc, config->argv, &next)) {
+		log_fail("parse_args", __FILE__, __LINE__);
+		goto out;
+	}
+	if (zone_table_reload(&config->zones, &next.zones)) {
+		log_fail("zone_table_reload", __FILE__, __LINE__);
+		goto out;
+	}
+	config->controller = next.controller;
+	config->min_interval_ms = next.min_interval_ms;
+	config->max_interval_ms = next.max_interval_ms;
+	config->slew = next.slew;
+	config->tach = next.tach;
+	config->filter = next.filter;
+	config->auto_tune_limit = next.auto_tune_limit;
+	if (curve_shift > config->auto_tune_limit) {
+		curve_shift = config->auto_tune_limit;
+	}
+	if (curve_shift) {
+		zone_table_lower_curves(&config->zones, curve_shift);
+	}
+	config->emergency_temp = next.emergency_temp;
+	config->idle = next.idle;
+	memcpy(config->device_cache_path, next.device_cache_path,
+	       sizeof(config->device_cache_path));
+	memcpy(config->telemetry_path, next.telemetry_path,
+	       sizeof(config->telemetry_path));
+	memcpy(config->trace_path, next.trace_path, sizeof(config->trace_path));
+	config->telemetry_interval_ms = next.telemetry_interval_ms;
+	state->telemetry.reloads++;
+	status = 0;
+
+	if (event_loop_arm_telemetry(loop, telemetry_interval_ms(config))) {
+		log_fail("event_loop_arm_telemetry", __FILE__, __LINE__);
+	}
+
+	event_loop_add_sensors(loop, &config->zones);
+	restart_emergency(state, config);
+	idle_leave(&state->idle);
+	if (*config->device_cache_path && device_cache_dirty() &&
+	    device_cache_save(config->device_cache_path)) {
+		log_fail("device_cache_save", __FILE__, __LINE__);
+	}
+	measurements_close(state);
+	if (measurements_open(state, config)) {
+		// Only load prediction is lost, the curves keep running.
+		log_fail("measurements_open", __FILE__, __LINE__);
+	}
+
+out:
+	alloc_guard_arm();
+
+	return status;
+}
+
+static long retry_interval_ms(const struct config *config, int failures)
+{
+	long interval_ms = TICK_RETRY_BASE_MS;
+	while (failures-- > 0 && interval_ms < config->max_interval_ms) {
+		interval_ms *= 2;
+	}
+	return interval_ms < config->max_interval_ms ? interval_ms
+						     : config->max_interval_ms;
+}
+
+static int set_fan_speed_from_temp(struct event_loop *loop,
+				   struct config *config,
+				   struct shared *shared)
+{
+	int status = 0;
+	struct zone_table *zones = &config->zones;
+	struct control_state state = {
+		.shared = shared,
+		.api = &loop->api,
+		.record = {
+			.fd = -1,
+		},
+	};
 
-	char *name_path = calloc(PATH_MAX, sizeof(char));
-	if (!name_path) {
-		log_fail("calloc", __FILE__, __LINE__);
+	if (measurements_open(&state, config)) {
+		log_fail("measurements_open", __FILE__, __LINE__);
+		return -1;
+	}
+	state.watch_throttle = !throttle_open(&state.throttle);
+	if (!state.watch_throttle) {
+		log_fail("throttle_open", __FILE__, __LINE__);
+	}
+	// Nothing is taken from the kernel unless all of it worked.
+	state.govern = config->acoustic_limit &&
+		       !governor_open(&state.governor);
+	if (config->acoustic_limit && !state.govern) {
+		log_fail("governor_open", __FILE__, __LINE__);
+	}
+	if (state.govern && state.governor.event_fd >= 0) {
+		if (epoll_add(loop->epoll_fd, state.governor.event_fd,
+			      EPOLLIN, EVENT_SOURCE_GOVERNOR)) {
+			log_fail("epoll_add", __FILE__, __LINE__);
+		} else {
+			loop->governor = &state.governor;
+		}
+	}
+#ifndef NO_TELEMETRY
+	// Without the record the samples only go where else they are sent.
+	if (*config->record_path &&
+	    record_open(&state.record, config->record_path)) {
+		log_fail("record_open", __FILE__, __LINE__);
+	}
+#endif
+	telemetry_init(&state.telemetry);
+	state.jitter_us = -1;
+	if (event_loop_arm_telemetry(loop, telemetry_interval_ms(config))) {
+		log_fail("event_loop_arm_telemetry", __FILE__, __LINE__);
 		status = -1;
-		goto cleanup_dir;
+		goto cleanup;
 	}
-	char *name_value = calloc(128, sizeof(char));
-	if (!name_value) {
-		log_fail("calloc", __FILE__, __LINE__);
+	if (realtime_apply(&config->realtime)) {
+		log_fail("realtime_apply", __FILE__, __LINE__);
 		status = -1;
-		goto cleanup_name_path;
+		goto cleanup;
 	}
-
-	errno = 0;
-	for (struct dirent *dir_entry = readdir(dir); dir_entry;
-	     dir_entry = readdir(dir)) {
-		if (dir_entry->d_name[0] == '.') {
-			continue;
+	emergency_init(&state.emergency);
+	state.emergency.wake_fd = loop->wake_fd;
+	idle_init(&state.idle);
+	restart_emergency(&state, config);
+	if (notify_open(&state.notify)) {
+		// Without it systemd restarts the daemon as soon as its
+		// start timeout passes, which beats not controlling the fans.
+		log_fail("notify_open", __FILE__, __LINE__);
+	}
+	if (state.notify.watchdog_usec &&
+	    state.notify.watchdog_usec / 2000 < (uint64_t)config->max_interval_ms) {
+		fprintf(stderr, "WatchdogSec is shorter than twice "
+				"max_interval, expect restarts\n");
+	}
+	notify_send(&state.notify, "READY=1");
+	// From here on every buffer the loop needs already exists.
+	alloc_guard_arm();
+	bool devices_ready = true;
+	int failures = 0;
+	while (!got_sigterm) {
+		long interval_ms = config->max_interval_ms;
+		if (got_sighup) {
+			got_sighup = 0;
+			if (reload_config(loop, config, &state)) {
+				fprintf(stderr,
+					"keeping the running configuration\n");
+			}
 		}
-		if (snprintf(out_path, PATH_MAX, HWMON_DIR_PATH "%s",
-			     dir_entry->d_name) < 0) {
-			log_fail("snprintf", __FILE__, __LINE__);
-			status = -1;
-			goto cleanup_name_value;
+		if (loop->devices_changed || !devices_ready) {
+			loop->devices_changed = false;
+			devices_ready = !refresh_devices(loop, config, &state);
 		}
-		if (snprintf(name_path, PATH_MAX, "%s/name", out_path) < 0) {
-			log_fail("snprintf", __FILE__, __LINE__);
-			status = -1;
-			goto cleanup_name_value;
+		if (devices_ready &&
+		    control_tick(&state, config, &interval_ms)) {
+			// A driver reload shows up as a failing read or write
+			// before its uevent arrives. Anything else, like an
+			// EAGAIN from a busy driver, is retried with backoff.
+			state.telemetry.tick_errors++;
+			if (zone_table_stale(zones)) {
+				state.telemetry.device_losses++;
+				devices_ready = false;
+			} else {
+				log_fail("control_tick", __FILE__, __LINE__);
+				interval_ms = retry_interval_ms(config,
+								failures++);
+				if (failures >= TICK_FAILURES_BEFORE_MAX) {
+					zone_table_write_max(zones);
+				}
+			}
+		} else {
+			// The watchdog only hears from a loop that is in
+			// control, a persistent failure gets the daemon
+			// restarted.
+			failures = 0;
+			notify_watchdog(&state.notify, telemetry_now_ns());
+			if (devices_ready &&
+			    startup_bench_tick(&state, config)) {
+				break;
+			}
+			if (devices_ready) {
+				interval_ms = idle_next(&state.idle, zones,
+							&config->idle,
+							interval_ms);
+				emergency_set_idle(&state.emergency, zones,
+						   config->idle.margin,
+						   state.idle.active);
+			}
+			if (state.notify.watchdog_usec &&
+			    (uint64_t)interval_ms >
+				    state.notify.watchdog_usec / 2000) {
+				interval_ms = (long)(state.notify.watchdog_usec /
+						     2000);
+			}
 		}
-		if (read_line(name_path, name_value, 128)) {
-			log_fail("read_line", __FILE__, __LINE__);
+		if (!devices_ready) {
+			fprintf(stderr, "device went away, waiting for it\n");
+			// Run whatever fans are left flat out until the
+			// sensors are back.
+			zone_table_write_max(zones);
+			state.last_time.tv_sec = 0;
+		}
+		if (event_loop_arm(loop, interval_ms)) {
+			log_fail("event_loop_arm", __FILE__, __LINE__);
 			status = -1;
-			goto cleanup_name_value;
+			break;
 		}
-		if (!strncmp(name, name_value, name_length)) {
-			goto cleanup_name_value;
+		if (wait_for_sample(loop, &state, config)) {
+			log_fail("wait_for_sample", __FILE__, __LINE__);
+			status = -1;
+			break;
 		}
 	}
+	notify_send(&state.notify, "STOPPING=1");
+	idle_leave(&state.idle);
+	zone_table_write_max(zones);
+	alloc_guard_disarm();
+	emergency_stop(&state.emergency);
+	notify_close(&state.notify);
+	flush_telemetry(&state, config);
+	telemetry_print_latency(&state.telemetry);
+cleanup:
+	record_close(&state.record);
+	if (state.govern) {
+		loop->governor = NULL;
+		governor_close(&state.governor);
+	}
+	if (state.watch_throttle) {
+		throttle_close(&state.throttle);
+	}
+	measurements_close(&state);
+
+	return status;
+}
+
+static void print_usage(char *program_name)
+{
+	fprintf(stderr,
+		"usage: %s [options] [min_temp max_temp min_fan_speed]\n"
+		"  -C, --config=PATH       read settings from PATH, reloaded on "
+		"SIGHUP\n"
+		"      --min-temp=TEMP     same as min_temp\n"
+		"      --max-temp=TEMP     same as max_temp\n"
+		"      --min-fan-speed=N   same as min_fan_speed\n"
+		"  -z, --zone=SPEC         start a zone, "
+		"COMBINE[:MIN_TEMP:MAX_TEMP:MIN_FAN_SPEED]\n"
+		"                          COMBINE is max, weighted or curve\n"
+		"  -s, --sensor=SPEC       add a sensor to the zone, "
+		"[hwmon:|thermal:]NAME[/NODE][~FILTER][@WEIGHT]\n"
+		"                          [:MIN_TEMP:MAX_TEMP]\n"
+		"  -f, --fan=SPEC          add a fan to the zone, NAME[/NODE]\n"
+		"      --device-cache=PATH where resolved devices are kept, "
+		"empty disables\n"
+		"      --state-file=PATH   where changed sysfs values are "
+		"remembered until\n"
+		"                          put back, empty disables\n"
+		"      --telemetry-file=PATH  write Prometheus metrics to PATH\n"
+		"      --telemetry-interval=MS  how often the metrics are written\n"
+		"      --trace-file=PATH   append a replay trace to PATH\n"
+		"      --record-file=PATH  keep a compact binary record of "
+		"every tick in\n"
+		"                          PATH, empty disables\n"
+		"      --dump-record=PATH  print a binary record as CSV\n"
+		"      --replay=TRACE      replay TRACE, or builtin:idle, step, "
+		"burst or ramp,\n"
+		"                          instead of driving the fans\n"
+		"      --bench             replay every built-in trace\n"
+		"      --startup-bench=TICKS  run TICKS ticks, then print the "
+		"time to the\n"
+		"                          first pwm write and cpu per tick\n"
+		"      --replay-model=GAIN:TAU_MS  millidegrees per pwm step "
+		"and lag of the\n"
+		"                          simulated cooling\n"
+		"      --replay-threshold=TEMP  report time spent above TEMP, "
+		"max_temp by\n"
+		"                          default\n"
+		"  -i, --min-interval=MS   shortest delay between samples\n"
+		"  -I, --max-interval=MS   longest delay between samples\n"
+		"  -c, --controller=TYPE   linear (default), pid, curve or mpc\n"
+		"      --curve=POINTS      use the curve controller with "
+		"TEMP:SPEED[,TEMP:SPEED...]\n"
+		"      --pid-target=TEMP   temperature the pid controller holds "
+		"and mpc\n"
+		"                          keeps below\n"
+		"      --mpc-horizon=MS    how far ahead mpc predicts\n"
+		"      --pid-kp=GAIN       proportional gain per millidegree\n"
+		"      --pid-ki=GAIN       integral gain per millidegree second\n"
+		"      --pid-kd=GAIN       derivative gain per millidegree/s\n"
+		"      --pid-ff=GAIN       share of full speed at 100%% cpu load\n"
+		"      --load-boost=SHARE  raise speed ahead of load, 0 is off\n"
+		"      --load-threshold=P  load * freq ratio where boost starts\n"
+		"      --slew-up-band=N    pwm steps demand must rise by\n"
+		"      --slew-down-band=N  pwm steps demand must fall by\n"
+		"      --slew-up-rate=N    pwm steps per second up, 0 is no "
+		"limit\n"
+		"      --slew-down-rate=N  pwm steps per second down, 0 is no "
+		"limit\n"
+		"      --filter=FILTER     smooth every sensor with none, "
+		"ema[,TAU_MS],\n"
+		"                          median[,N] or kalman[,DRIFT,NOISE]\n"
+		"      --auto-tune=TEMP    lower the curves by up to TEMP as "
+		"throttling is\n"
+		"                          seen, 0 is off\n"
+		"      --acoustic-limit=PWM  take the thermal zones over from "
+		"the kernel,\n"
+		"                          run the fans up to PWM before "
+		"capping cpufreq,\n"
+		"                          0 is off\n"
+		"      --fan-max-rpm=RPM   steer fans to a share of RPM through "
+		"their\n"
+		"                          tachometers instead of raw pwm\n"
+		"      --stall-pwm=N       report fans that don't turn at pwm N "
+		"or more,\n"
+		"                          0 is off\n"
+		"      --fan-profile=PATH  per-board start and stop pwm of "
+		"the fans, empty\n"
+		"                          disables\n"
+		"      --calibrate         measure the fans and write the fan "
+		"profile\n"
+		"      --shared-name=NAME  shared memory for other processes to "
+		"post floors\n"
+		"                          to, empty disables\n"
+		"      --request-floor=PWM:MS  ask the running daemon for at "
+		"least PWM for MS\n"
+		"      --api-socket=PATH   where clients reach the daemon, "
+		"empty disables\n"
+		"      --status            print the running daemon's sensors, "
+		"fans and curves\n"
+		"      --override=PWM:MS   have the running daemon run every fan "
+		"at least at\n"
+		"                          PWM for MS\n"
+		"      --clear-override=ID  end an override early, 0 ends all\n"
+		"      --rt-priority=N     run under SCHED_FIFO at priority N, "
+		"0 is off\n"
+		"      --cpu=N             pin the control loop to cpu N\n"
+		"      --mlock             lock all memory once set up\n"
+		"      --emergency-temp=TEMP  force full speed above TEMP as "
+		"well as above\n"
+		"                          hot and critical trip points\n"
+		"      --idle-margin=TEMP  how far below min_temp idle mode "
+		"starts\n"
+		"      --idle-max-interval=MS  longest sleep while idle, 0 "
+		"disables idle mode\n",
+		program_name);
+}
+
+static int parse_interval(char *str, long *out_interval_ms)
+{
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
 	if (errno) {
-		perror("readdir() failed");
+		perror("strtol() failed");
+		return -1;
+	}
+	if (end == str || *end != '\0' || value <= 0) {
+		fprintf(stderr, "invalid interval: %s\n", str);
+		return -1;
 	}
-	status = -1;
+	*out_interval_ms = value;
 
-cleanup_name_value:
-	free(name_value);
-cleanup_name_path:
-	free(name_path);
-cleanup_dir:
-	if (closedir(dir)) {
-		perror("closedir(" HWMON_DIR_PATH ") failed");
-		status = -1;
+	return 0;
+}
+
+static int parse_double(char *str, double *out_value)
+{
+	char *end = NULL;
+	errno = 0;
+	double value = strtod(str, &end);
+	if (errno) {
+		perror("strtod() failed");
+		return -1;
 	}
+	if (end == str || *end != '\0') {
+		fprintf(stderr, "invalid number: %s\n", str);
+		return -1;
+	}
+	*out_value = value;
 
-	return status;
+	return 0;
 }
 
-static int open_hwmon(char *name, size_t name_symbols, char *node, int oflag)
+static int parse_long(char *str, long *out_value)
 {
-	int fd = -1;
+	const char *end = NULL;
+	long long value = 0;
+	if (parse_long_long(str, &end, &value) || *end != '\0' ||
+	    value < LONG_MIN || value > LONG_MAX) {
+		fprintf(stderr, "invalid integer: %s\n", str);
+		return -1;
+	}
+	*out_value = value;
+
+	return 0;
+}
 
-	char *hwmon_dir = calloc(PATH_MAX, sizeof(char));
-	if (!hwmon_dir) {
-		log_fail("calloc", __FILE__, __LINE__);
+// A non-negative number of pwm steps.
+static int parse_steps(char *str, int *out_steps)
+{
+	long value = 0;
+	if (parse_long(str, &value)) {
 		return -1;
 	}
-	if (find_hwmon_path(name, name_symbols, hwmon_dir)) {
-		log_fail("find_hwmon_path", __FILE__, __LINE__);
-		goto cleanup_hwmon_dir;
+	if (value < 0 || value > INT_MAX) {
+		fprintf(stderr, "invalid number of steps: %s\n", str);
+		return -1;
 	}
-	char *hwmon_node = calloc(PATH_MAX, sizeof(char));
-	if (!hwmon_node) {
-		log_fail("calloc", __FILE__, __LINE__);
-		goto cleanup_hwmon_dir;
+	*out_steps = (int)value;
+
+	return 0;
+}
+
+static int parse_controller_type(char *str, enum controller_type *out_type)
+{
+	if (!strcmp(str, "linear")) {
+		*out_type = CONTROLLER_LINEAR;
+	} else if (!strcmp(str, "pid")) {
+		*out_type = CONTROLLER_PID;
+	} else if (!strcmp(str, "curve")) {
+		*out_type = CONTROLLER_CURVE;
+	} else if (!strcmp(str, "mpc")) {
+		*out_type = CONTROLLER_MPC;
+	} else {
+		fprintf(stderr, "unknown controller: %s\n", str);
+		return -1;
 	}
-	if (snprintf(hwmon_node, PATH_MAX, "%s/%s", hwmon_dir, node) < 0) {
-		log_fail("snprintf", __FILE__, __LINE__);
-		goto cleanup_hwmon_node;
+
+	return 0;
+}
+
+#define SHORT_OPTIONS "C:z:s:f:i:I:c:"
+
+enum long_option {
+	OPTION_PID_TARGET = 256,
+	OPTION_PID_KP,
+	OPTION_PID_KI,
+	OPTION_PID_KD,
+	OPTION_PID_FF,
+	OPTION_MPC_HORIZON,
+	OPTION_LOAD_BOOST,
+	OPTION_LOAD_THRESHOLD,
+	OPTION_DEVICE_CACHE,
+	OPTION_STATE_FILE,
+	OPTION_SLEW_UP_BAND,
+	OPTION_SLEW_DOWN_BAND,
+	OPTION_SLEW_UP_RATE,
+	OPTION_SLEW_DOWN_RATE,
+	OPTION_CURVE,
+	OPTION_MIN_TEMP,
+	OPTION_MAX_TEMP,
+	OPTION_MIN_FAN_SPEED,
+	OPTION_TELEMETRY_FILE,
+	OPTION_TELEMETRY_INTERVAL,
+	OPTION_TRACE_FILE,
+	OPTION_RECORD_FILE,
+	OPTION_DUMP_RECORD,
+	OPTION_REPLAY,
+	OPTION_BENCH,
+	OPTION_STARTUP_BENCH,
+	OPTION_REPLAY_MODEL,
+	OPTION_REPLAY_THRESHOLD,
+	OPTION_RT_PRIORITY,
+	OPTION_CPU,
+	OPTION_MLOCK,
+	OPTION_EMERGENCY_TEMP,
+	OPTION_IDLE_MARGIN,
+	OPTION_IDLE_MAX_INTERVAL,
+	OPTION_FILTER,
+	OPTION_AUTO_TUNE,
+	OPTION_ACOUSTIC_LIMIT,
+	OPTION_FAN_MAX_RPM,
+	OPTION_STALL_PWM,
+	OPTION_FAN_PROFILE,
+	OPTION_CALIBRATE,
+	OPTION_SHARED_NAME,
+	OPTION_REQUEST_FLOOR,
+	OPTION_API_SOCKET,
+	OPTION_STATUS,
+	OPTION_OVERRIDE,
+	OPTION_CLEAR_OVERRIDE,
+};
+
+static const struct option long_options[] = {
+	{ "config", required_argument, NULL, 'C' },
+	{ "min-temp", required_argument, NULL, OPTION_MIN_TEMP },
+	{ "max-temp", required_argument, NULL, OPTION_MAX_TEMP },
+	{ "min-fan-speed", required_argument, NULL, OPTION_MIN_FAN_SPEED },
+	{ "zone", required_argument, NULL, 'z' },
+	{ "sensor", required_argument, NULL, 's' },
+	{ "fan", required_argument, NULL, 'f' },
+	{ "min-interval", required_argument, NULL, 'i' },
+	{ "max-interval", required_argument, NULL, 'I' },
+	{ "controller", required_argument, NULL, 'c' },
+	{ "pid-target", required_argument, NULL, OPTION_PID_TARGET },
+	{ "pid-kp", required_argument, NULL, OPTION_PID_KP },
+	{ "pid-ki", required_argument, NULL, OPTION_PID_KI },
+	{ "pid-kd", required_argument, NULL, OPTION_PID_KD },
+	{ "pid-ff", required_argument, NULL, OPTION_PID_FF },
+	{ "mpc-horizon", required_argument, NULL, OPTION_MPC_HORIZON },
+	{ "load-boost", required_argument, NULL, OPTION_LOAD_BOOST },
+	{ "load-threshold", required_argument, NULL, OPTION_LOAD_THRESHOLD },
+	{ "device-cache", required_argument, NULL, OPTION_DEVICE_CACHE },
+	{ "state-file", required_argument, NULL, OPTION_STATE_FILE },
+	{ "slew-up-band", required_argument, NULL, OPTION_SLEW_UP_BAND },
+	{ "slew-down-band", required_argument, NULL, OPTION_SLEW_DOWN_BAND },
+	{ "slew-up-rate", required_argument, NULL, OPTION_SLEW_UP_RATE },
+	{ "slew-down-rate", required_argument, NULL, OPTION_SLEW_DOWN_RATE },
+	{ "curve", required_argument, NULL, OPTION_CURVE },
+	{ "telemetry-file", required_argument, NULL, OPTION_TELEMETRY_FILE },
+	{ "telemetry-interval", required_argument, NULL,
+	  OPTION_TELEMETRY_INTERVAL },
+	{ "trace-file", required_argument, NULL, OPTION_TRACE_FILE },
+	{ "record-file", required_argument, NULL, OPTION_RECORD_FILE },
+	{ "dump-record", required_argument, NULL, OPTION_DUMP_RECORD },
+	{ "replay", required_argument, NULL, OPTION_REPLAY },
+	{ "bench", no_argument, NULL, OPTION_BENCH },
+	{ "startup-bench", required_argument, NULL, OPTION_STARTUP_BENCH },
+	{ "replay-model", required_argument, NULL, OPTION_REPLAY_MODEL },
+	{ "replay-threshold", required_argument, NULL,
+	  OPTION_REPLAY_THRESHOLD },
+	{ "rt-priority", required_argument, NULL, OPTION_RT_PRIORITY },
+	{ "cpu", required_argument, NULL, OPTION_CPU },
+	{ "mlock", no_argument, NULL, OPTION_MLOCK },
+	{ "emergency-temp", required_argument, NULL, OPTION_EMERGENCY_TEMP },
+	{ "idle-margin", required_argument, NULL, OPTION_IDLE_MARGIN },
+	{ "idle-max-interval", required_argument, NULL,
+	  OPTION_IDLE_MAX_INTERVAL },
+	{ "filter", required_argument, NULL, OPTION_FILTER },
+	{ "auto-tune", required_argument, NULL, OPTION_AUTO_TUNE },
+	{ "acoustic-limit", required_argument, NULL, OPTION_ACOUSTIC_LIMIT },
+	{ "fan-max-rpm", required_argument, NULL, OPTION_FAN_MAX_RPM },
+	{ "stall-pwm", required_argument, NULL, OPTION_STALL_PWM },
+	{ "fan-profile", required_argument, NULL, OPTION_FAN_PROFILE },
+	{ "calibrate", no_argument, NULL, OPTION_CALIBRATE },
+	{ "shared-name", required_argument, NULL, OPTION_SHARED_NAME },
+	{ "request-floor", required_argument, NULL, OPTION_REQUEST_FLOOR },
+	{ "api-socket", required_argument, NULL, OPTION_API_SOCKET },
+	{ "status", no_argument, NULL, OPTION_STATUS },
+	{ "override", required_argument, NULL, OPTION_OVERRIDE },
+	{ "clear-override", required_argument, NULL, OPTION_CLEAR_OVERRIDE },
+	{ NULL, 0, NULL, 0 },
+};
+
+static int parse_fan_speed(char *str, int *out_speed)
+{
+	long value = 0;
+	if (parse_long(str, &value)) {
+		return -1;
 	}
-	fd = open(hwmon_node, oflag);
-	if (fd < 0) {
-		perror("open() failed");
+	if (value < 0 || value > MAX_FAN_SPEED) {
+		fprintf(stderr, "fan speed must be in [0, %d]\n",
+			MAX_FAN_SPEED);
+		return -1;
 	}
+	*out_speed = (int)value;
 
-cleanup_hwmon_node:
-	free(hwmon_node);
-cleanup_hwmon_dir:
-	free(hwmon_dir);
+	return 0;
+}
 
-	return fd;
+// For the telemetry, trace, record and replay paths, which share a size.
+static int copy_path(char *out_path, const char *path)
+{
+	if (strlen(path) >= TELEMETRY_PATH_SIZE) {
+		fprintf(stderr, "path too long: %s\n", path);
+		return -1;
+	}
+	memcpy(out_path, path, strlen(path) + 1);
+
+	return 0;
 }
 
-static int write_fan_speed(int fd, double value)
+// An integer in [min, max], what names it in errors.
+static int parse_int_range(char *str, int min, int max, const char *what,
+			   int *out_value)
 {
-	if (value < 0.0) {
-		fprintf(stderr,
-			"can't set fan speed lower than 0, setting 0\n");
-		value = 0.0;
+	long value = 0;
+	if (parse_long(str, &value)) {
+		return -1;
 	}
-	if (value > MAX_FAN_SPEED) {
-		fprintf(stderr,
-			"can't set fan speed higher than %f, setting %f\n",
-			MAX_FAN_SPEED, MAX_FAN_SPEED);
-		value = MAX_FAN_SPEED;
+	if (value < min || value > max) {
+		fprintf(stderr, "%s must be in [%d, %d]\n", what, min, max);
+		return -1;
 	}
+	*out_value = (int)value;
 
-	char value_str[5] = "";
-	snprintf(value_str, 5, "%.0f\n", value);
-	// TODO: handle partial writes.
-	// TODO: handle EINTR.
-	if (write(fd, value_str, 5) < 0) {
-		perror("fwrite() failed");
+	return 0;
+}
+
+static int parse_rpm(char *str, long *out_rpm)
+{
+	if (parse_long(str, out_rpm)) {
+		return -1;
+	}
+	if (*out_rpm <= 0) {
+		fprintf(stderr, "rpm must be > 0\n");
 		return -1;
 	}
 
 	return 0;
 }
 
-static int read_double(int fd, char *double_str, size_t double_str_length,
-		       double *out_value)
+static int parse_filter(char *str, struct filter_config *out_config)
 {
-	// TODO: handle partial reads.
-	// TODO: handle EINTR.
-	ssize_t r = pread(fd, double_str, double_str_length, 0);
-	if (r < 0) {
-		perror("read() failed");
+	const char *end = NULL;
+	if (filter_parse(out_config, str, &end)) {
 		return -1;
 	}
-	*out_value = strtod(double_str, NULL);
-	if (errno) {
-		perror("strtod() failed");
+	if (*end != '\0') {
+		fprintf(stderr, "trailing characters: %s\n", end);
 		return -1;
 	}
 
 	return 0;
 }
 
-static int set_fan_speed_from_temp(int fan_fd, int cpu_fd, double min_temp,
-				   double max_temp, double min_fan_speed)
+static int parse_replay_model(char *str, struct replay_model *out_model)
 {
-	int status = 0;
+	char *tau = strchr(str, ':');
+	if (!tau) {
+		fprintf(stderr, "invalid replay model: %s\n", str);
+		return -1;
+	}
+	*tau++ = '\0';
+	if (parse_long(str, &out_model->gain) ||
+	    parse_interval(tau, &out_model->tau_ms)) {
+		return -1;
+	}
+	if (out_model->gain < 0) {
+		fprintf(stderr, "replay gain must be >= 0\n");
+		return -1;
+	}
 
-	char *hwmon_value_str = calloc(16, sizeof(char));
-	if (!hwmon_value_str) {
-		log_fail("calloc", __FILE__, __LINE__);
+	return 0;
+}
+
+// PWM:MS, a floor or override for client_run() to post.
+static int parse_request(char *str, enum client_action action,
+			 struct client_request *out_request)
+{
+	char *ms = strchr(str, ':');
+	if (!ms) {
+		fprintf(stderr, "invalid request: %s\n", str);
 		return -1;
 	}
-	double speed_old = MAX_FAN_SPEED;
-	if (read_double(fan_fd, hwmon_value_str, 16, &speed_old)) {
-		log_fail("read_double", __FILE__, __LINE__);
-		status = -1;
-		goto cleanup_hwmon_value_str;
+	*ms++ = '\0';
+	out_request->action = action;
+
+	return parse_fan_speed(str, &out_request->pwm) ||
+	       parse_interval(ms, &out_request->duration_ms);
+}
+
+static int parse_option(int opt, char *arg, struct config *config);
+
+static int apply_setting(const char *name, char *value, void *ctx)
+{
+	for (const struct option *option = long_options; option->name;
+	     option++) {
+		if (strcmp(option->name, name)) {
+			continue;
+		}
+		if (option->val == 'C') {
+			fprintf(stderr, "config files can't include others\n");
+			return -1;
+		}
+		return parse_option(option->val, value, ctx);
 	}
-	double temp = 0.0;
-	double speed_new = 0.0;
-	double multiplier =
-		(MAX_FAN_SPEED - min_fan_speed) / (max_temp - min_temp);
-	double speed_diff = 0.0;
-	while (!got_sigterm) {
-		if (read_double(cpu_fd, hwmon_value_str, 16, &temp)) {
-			log_fail("read_double", __FILE__, __LINE__);
-			status = -1;
-			break;
+	fprintf(stderr, "unknown setting: %s\n", name);
+
+	return -1;
+}
+
+static int parse_option(int opt, char *arg, struct config *config)
+{
+	struct controller_config *controller = &config->controller;
+
+	switch (opt) {
+	case 'C':
+		return config_file_read(arg, apply_setting, config);
+	case OPTION_MIN_TEMP:
+		return parse_long(arg, &controller->min_temp);
+	case OPTION_MAX_TEMP:
+		return parse_long(arg, &controller->max_temp);
+	case OPTION_MIN_FAN_SPEED:
+		return parse_fan_speed(arg, &controller->min_fan_speed);
+	case 'z':
+		return zone_table_add_zone(&config->zones, arg);
+	case 's':
+		return zone_table_add_sensor(&config->zones, arg);
+	case 'f':
+		return zone_table_add_fan(&config->zones, arg);
+	case 'i':
+		return parse_interval(arg, &config->min_interval_ms);
+	case 'I':
+		return parse_interval(arg, &config->max_interval_ms);
+	case 'c':
+		return parse_controller_type(arg, &controller->type);
+	case OPTION_PID_TARGET:
+		return parse_long(arg, &controller->pid_target);
+	case OPTION_PID_KP:
+		return parse_double(arg, &controller->pid_kp);
+	case OPTION_PID_KI:
+		return parse_double(arg, &controller->pid_ki);
+	case OPTION_PID_KD:
+		return parse_double(arg, &controller->pid_kd);
+	case OPTION_PID_FF:
+		return parse_double(arg, &controller->pid_ff);
+	case OPTION_MPC_HORIZON:
+		return parse_interval(arg, &controller->mpc_horizon_ms);
+	case OPTION_LOAD_BOOST:
+		return parse_double(arg, &controller->load_boost);
+	case OPTION_LOAD_THRESHOLD:
+		return parse_double(arg, &controller->load_threshold);
+	case OPTION_STATE_FILE:
+		if (strlen(arg) >= SYSFS_STATE_PATH_SIZE) {
+			fprintf(stderr, "state file path too long\n");
+			return -1;
 		}
-		if (temp <= min_temp) {
-			speed_new = 0.0;
-		} else if (temp >= max_temp) {
-			speed_new = MAX_FAN_SPEED;
-		} else {
-			speed_new =
-				min_fan_speed + multiplier * (temp - min_temp);
-		}
-		speed_diff = speed_old - speed_new;
-		if (speed_diff <= -1 || speed_diff >= 1) {
-			if (write_fan_speed(fan_fd, speed_new)) {
-				log_fail("write_fan_speed", __FILE__, __LINE__);
-				status = -1;
-				break;
+		memcpy(config->state_path, arg, strlen(arg) + 1);
+		return 0;
+	case OPTION_DEVICE_CACHE:
+		if (strlen(arg) >= DEVICE_CACHE_PATH_SIZE) {
+			fprintf(stderr, "device cache path too long\n");
+			return -1;
+		}
+		memcpy(config->device_cache_path, arg, strlen(arg) + 1);
+		return 0;
+	case OPTION_SLEW_UP_BAND:
+		return parse_steps(arg, &config->slew.up_band);
+	case OPTION_SLEW_DOWN_BAND:
+		return parse_steps(arg, &config->slew.down_band);
+	case OPTION_SLEW_UP_RATE:
+		return parse_steps(arg, &config->slew.up_rate);
+	case OPTION_SLEW_DOWN_RATE:
+		return parse_steps(arg, &config->slew.down_rate);
+#ifdef NO_TELEMETRY
+	case OPTION_TELEMETRY_FILE:
+	case OPTION_TRACE_FILE:
+	case OPTION_RECORD_FILE:
+		// Empty still disables them, so the same command line works.
+		if (*arg) {
+			fprintf(stderr, "built without telemetry\n");
+			return -1;
+		}
+		return 0;
+#else
+	case OPTION_TELEMETRY_FILE:
+		return copy_path(config->telemetry_path, arg);
+	case OPTION_TRACE_FILE:
+		return copy_path(config->trace_path, arg);
+	case OPTION_RECORD_FILE:
+		return copy_path(config->record_path, arg);
+#endif
+	case OPTION_DUMP_RECORD:
+		return copy_path(config->record_dump_path, arg);
+	case OPTION_REPLAY:
+		return copy_path(config->replay_path, arg);
+	case OPTION_BENCH:
+		config->bench = true;
+		return 0;
+	case OPTION_STARTUP_BENCH:
+		if (parse_long(arg, &config->startup_bench_ticks)) {
+			return -1;
+		}
+		if (config->startup_bench_ticks < 1) {
+			fprintf(stderr, "startup bench needs a tick or more\n");
+			return -1;
+		}
+		return 0;
+	case OPTION_REPLAY_MODEL:
+		return parse_replay_model(arg, &config->replay_model);
+	case OPTION_REPLAY_THRESHOLD:
+		return parse_long(arg, &config->replay_threshold);
+	case OPTION_RT_PRIORITY:
+		return parse_int_range(arg, 0, sched_get_priority_max(SCHED_FIFO),
+				       "rt priority", &config->realtime.priority);
+	case OPTION_CPU:
+		return parse_int_range(arg, 0, REALTIME_MAX_CPUS - 1, "cpu",
+				       &config->realtime.cpu);
+	case OPTION_MLOCK:
+		config->realtime.lock_memory = true;
+		return 0;
+	case OPTION_EMERGENCY_TEMP:
+		return parse_long(arg, &config->emergency_temp);
+	case OPTION_FILTER:
+		return parse_filter(arg, &config->filter);
+	case OPTION_AUTO_TUNE:
+		if (parse_long(arg, &config->auto_tune_limit)) {
+			return -1;
+		}
+		if (config->auto_tune_limit < 0) {
+			fprintf(stderr, "auto-tune limit must be >= 0\n");
+			return -1;
+		}
+		return 0;
+	case OPTION_ACOUSTIC_LIMIT:
+		return parse_fan_speed(arg, &config->acoustic_limit);
+	case OPTION_FAN_MAX_RPM:
+		return parse_rpm(arg, &config->tach.max_rpm);
+	case OPTION_STALL_PWM:
+		return parse_fan_speed(arg, &config->tach.stall_pwm);
+	case OPTION_FAN_PROFILE:
+		if (strlen(arg) >= PROFILE_PATH_SIZE) {
+			fprintf(stderr, "fan profile path too long\n");
+			return -1;
+		}
+		memcpy(config->profile_path, arg, strlen(arg) + 1);
+		return 0;
+	case OPTION_CALIBRATE:
+		config->calibrate = true;
+		return 0;
+	case OPTION_SHARED_NAME:
+		if (strlen(arg) >= SHARED_NAME_SIZE ||
+		    (*arg && (*arg != '/' || strchr(arg + 1, '/')))) {
+			fprintf(stderr, "invalid shared memory name: %s\n",
+				arg);
+			return -1;
+		}
+		memcpy(config->shared_name, arg, strlen(arg) + 1);
+		return 0;
+	case OPTION_REQUEST_FLOOR:
+		return parse_request(arg, CLIENT_REQUEST_FLOOR,
+				     &config->client);
+	case OPTION_API_SOCKET:
+		if (strlen(arg) >= API_SOCKET_PATH_SIZE) {
+			fprintf(stderr, "api socket path too long\n");
+			return -1;
+		}
+		memcpy(config->api_socket_path, arg, strlen(arg) + 1);
+		return 0;
+	case OPTION_STATUS:
+		config->client.action = CLIENT_STATUS;
+		return 0;
+	case OPTION_OVERRIDE:
+		if (parse_request(arg, CLIENT_OVERRIDE, &config->client)) {
+			return -1;
+		}
+		if (config->client.duration_ms > API_MAX_OVERRIDE_MS) {
+			fprintf(stderr, "overrides last at most %d ms\n",
+				API_MAX_OVERRIDE_MS);
+			return -1;
+		}
+		return 0;
+	case OPTION_CLEAR_OVERRIDE:
+		config->client.action = CLIENT_CLEAR_OVERRIDE;
+		if (parse_long(arg, &config->client.id)) {
+			return -1;
+		}
+		if (config->client.id < 0 || config->client.id > UINT32_MAX) {
+			fprintf(stderr, "invalid override id: %s\n", arg);
+			return -1;
+		}
+		return 0;
+	case OPTION_IDLE_MARGIN:
+		return parse_long(arg, &config->idle.margin);
+	case OPTION_IDLE_MAX_INTERVAL:
+		if (!strcmp(arg, "0")) {
+			config->idle.max_interval_ms = 0;
+			return 0;
+		}
+		return parse_interval(arg, &config->idle.max_interval_ms);
+	case OPTION_TELEMETRY_INTERVAL:
+		return parse_interval(arg, &config->telemetry_interval_ms);
+	case OPTION_CURVE:
+		controller->type = CONTROLLER_CURVE;
+		return curve_parse(&controller->curve, arg);
+	default:
+		return -1;
+	}
+}
+
+static int parse_args(int argc, char **argv, struct config *config)
+{
+	*config = (struct config){
+		.controller = {
+			.type = CONTROLLER_LINEAR,
+			// Required, from the config file or argv.
+			.min_temp = TEMP_UNSET,
+			.max_temp = TEMP_UNSET,
+			.min_fan_speed = -1,
+			.pid_kp = DEFAULT_PID_KP,
+			.pid_ki = DEFAULT_PID_KI,
+			.pid_kd = DEFAULT_PID_KD,
+			// Derived from each zone's curve unless given.
+			.pid_target = PID_TARGET_UNSET,
+			.mpc_horizon_ms = DEFAULT_MPC_HORIZON_MS,
+			.load_threshold = DEFAULT_LOAD_THRESHOLD,
+		},
+		.min_interval_ms = DEFAULT_MIN_INTERVAL_MS,
+		.max_interval_ms = DEFAULT_MAX_INTERVAL_MS,
+		.slew = {
+			.up_band = DEFAULT_SLEW_UP_BAND,
+			.down_band = DEFAULT_SLEW_DOWN_BAND,
+			.up_rate = DEFAULT_SLEW_UP_RATE,
+			.down_rate = DEFAULT_SLEW_DOWN_RATE,
+		},
+		.tach = {
+			.stall_pwm = DEFAULT_TACH_STALL_PWM,
+		},
+		.realtime = {
+			.cpu = REALTIME_CPU_UNSET,
+		},
+		.idle = {
+			.margin = DEFAULT_IDLE_MARGIN,
+			.max_interval_ms = DEFAULT_IDLE_MAX_INTERVAL_MS,
+		},
+		.device_cache_path = DEFAULT_DEVICE_CACHE_PATH,
+		.state_path = DEFAULT_SYSFS_STATE_PATH,
+		.profile_path = DEFAULT_PROFILE_PATH,
+		.shared_name = DEFAULT_SHARED_NAME,
+		.api_socket_path = DEFAULT_API_SOCKET_PATH,
+		.record_path = DEFAULT_RECORD_PATH,
+		.telemetry_interval_ms = DEFAULT_TELEMETRY_INTERVAL_MS,
+		.replay_model = {
+			.gain = DEFAULT_REPLAY_GAIN,
+			.tau_ms = DEFAULT_REPLAY_TAU_MS,
+		},
+		.replay_threshold = TEMP_UNSET,
+		.argc = argc,
+		.argv = argv,
+	};
+	// Appliance builds run the baked curve unless told otherwise.
+	if (!curve_baked(&config->controller.curve)) {
+		config->controller.type = CONTROLLER_CURVE;
+	}
+	zone_table_init(&config->zones);
+
+	// Start over, argv is parsed again on every reload.
+	optind = 0;
+	for (int opt = getopt_long(argc, argv, SHORT_OPTIONS, long_options,
+				   NULL);
+	     opt != -1; opt = getopt_long(argc, argv, SHORT_OPTIONS,
+					  long_options, NULL)) {
+		if (parse_option(opt, optarg, config)) {
+			print_usage(argv[0]);
+			return -1;
+		}
+	}
+	struct controller_config *controller = &config->controller;
+	if (argc - optind == 3) {
+		if (parse_long(argv[optind], &controller->min_temp) ||
+		    parse_long(argv[optind + 1], &controller->max_temp) ||
+		    parse_fan_speed(argv[optind + 2],
+				    &controller->min_fan_speed)) {
+			log_fail("parse_long", __FILE__, __LINE__);
+			return -1;
+		}
+	} else if (argc != optind) {
+		print_usage(argv[0]);
+		return -1;
+	}
+	// Talking to a running daemon or reading a record needs none of the
+	// rest.
+	if (config->client.action != CLIENT_NONE ||
+	    *config->record_dump_path) {
+		return 0;
+	}
+	if (controller->min_temp == TEMP_UNSET ||
+	    controller->max_temp == TEMP_UNSET ||
+	    controller->min_fan_speed < 0) {
+		fprintf(stderr,
+			"min_temp, max_temp and min_fan_speed are required\n");
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	if (config->min_interval_ms > config->max_interval_ms) {
+		fprintf(stderr, "min_interval_ms is > max_interval_ms\n");
+		return -1;
+	}
+	if (config->idle.max_interval_ms &&
+	    config->idle.max_interval_ms < config->max_interval_ms) {
+		fprintf(stderr, "idle max interval is < max_interval_ms\n");
+		return -1;
+	}
+	if (config->idle.margin < 0) {
+		fprintf(stderr, "idle margin must be >= 0\n");
+		return -1;
+	}
+	if (controller->min_temp >= controller->max_temp) {
+		fprintf(stderr, "min_temp is >= max_temp\n");
+		return -1;
+	}
+	if (controller->load_threshold < 0.0 ||
+	    controller->load_threshold >= 1.0) {
+		fprintf(stderr, "load_threshold must be in [0, 1)\n");
+		return -1;
+	}
+	if (zone_table_finish(&config->zones, controller, &config->slew,
+			      &config->tach, &config->filter,
+			      config->min_interval_ms,
+			      config->max_interval_ms)) {
+		log_fail("zone_table_finish", __FILE__, __LINE__);
+		return -1;
+	}
+	if (config->calibrate &&
+	    (!*config->profile_path || !tach_enabled(&config->tach))) {
+		fprintf(stderr, "calibrating needs a fan profile path and "
+				"stall detection\n");
+		return -1;
+	}
+	// An unreadable profile only leaves the fans uncalibrated.
+	if (!config->calibrate && *config->profile_path &&
+	    calibrate_load(&config->zones, config->profile_path)) {
+		log_fail("calibrate_load", __FILE__, __LINE__);
+	}
+	// Curves may have moved max_temp, so take the hottest channel's.
+	if (config->replay_threshold == TEMP_UNSET) {
+		for (int i = 0; i < config->zones.zone_count; i++) {
+			const struct zone *zone = &config->zones.zones[i];
+			for (int j = 0; j < zone->channel_count; j++) {
+				long max_temp =
+					zone->channels[j].config.max_temp;
+				if (max_temp > config->replay_threshold) {
+					config->replay_threshold = max_temp;
+				}
 			}
-			speed_old = speed_new;
 		}
-		sleep(10);
 	}
-	write_fan_speed(fan_fd, MAX_FAN_SPEED);
 
-cleanup_hwmon_value_str:
-	free(hwmon_value_str);
+	return 0;
+}
 
-	return status;
+// Runs the configured zones against recorded or built-in traces instead
+// of the hardware.
+static int replay(const struct config *config)
+{
+	if (config->bench) {
+		return replay_bench(&config->zones, &config->replay_model,
+				    config->replay_threshold);
+	}
+
+	struct replay_trace trace;
+	struct replay_report report;
+	if (replay_load(&trace, config->replay_path)) {
+		log_fail("replay_load", __FILE__, __LINE__);
+		return -1;
+	}
+	int status = replay_run(&trace, &config->zones, &config->replay_model,
+				config->replay_threshold, &report);
+	replay_free(&trace);
+	if (status) {
+		log_fail("replay_run", __FILE__, __LINE__);
+		return -1;
+	}
+	replay_print_header();
+	replay_print(config->replay_path, &report);
+
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
+	started_ns = telemetry_now_ns();
 	int status = EXIT_SUCCESS;
 
 	sigset_t sigterm_set;
@@ -272,61 +2164,118 @@ int main(int argc, char **argv)
 		perror("sigaction() failed");
 		return EXIT_FAILURE;
 	}
-
-	if (argc != 4) {
-		if (argc < 1) {
-			fprintf(stderr, "argc is < 1\n");
-			return EXIT_FAILURE;
-		}
-		fprintf(stderr, "usage: %s min_temp max_temp min_fan_speed\n",
-			argv[0]);
+	struct sigaction sighup_handler = {
+		.sa_handler = handle_sighup,
+		.sa_mask = sigterm_set,
+		.sa_flags = 0,
+	};
+	if (sigaction(SIGHUP, &sighup_handler, NULL)) {
+		perror("sigaction() failed");
 		return EXIT_FAILURE;
 	}
-	double min_temp = strtod(argv[1], NULL);
-	if (errno) {
-		perror("strtod() failed\n");
+	struct sigaction sigusr1_handler = {
+		.sa_handler = handle_sigusr1,
+		.sa_mask = sigterm_set,
+		.sa_flags = 0,
+	};
+	if (sigaction(SIGUSR1, &sigusr1_handler, NULL)) {
+		perror("sigaction() failed");
 		return EXIT_FAILURE;
 	}
-	double max_temp = strtod(argv[2], NULL);
-	if (errno) {
-		perror("strtod() failed\n");
+	sigset_t sigusr1_set;
+	if (sigemptyset(&sigusr1_set) || sigaddset(&sigusr1_set, SIGUSR1)) {
+		perror("sigaddset() failed");
 		return EXIT_FAILURE;
 	}
-	double min_fan_speed = strtod(argv[3], NULL);
-	if (errno) {
-		perror("strtod() failed\n");
+	// The threads started later inherit the mask.
+	if (sigprocmask(SIG_BLOCK, &sigusr1_set, &wait_mask)) {
+		perror("sigprocmask() failed");
+		return EXIT_FAILURE;
+	}
+	if (sigdelset(&wait_mask, SIGUSR1)) {
+		perror("sigdelset() failed");
 		return EXIT_FAILURE;
 	}
 
-	int cpu_fd = open_hwmon(HWMON_NAME_CPU, sizeof(HWMON_NAME_CPU) - 1,
-				"temp1_input", O_RDONLY);
-	if (!cpu_fd) {
-		log_fail("open_hwmon", __FILE__, __LINE__);
+	if (argc < 1) {
+		fprintf(stderr, "argc is < 1\n");
 		return EXIT_FAILURE;
 	}
-	int fan_fd = open_hwmon(HWMON_NAME_FAN, sizeof(HWMON_NAME_FAN) - 1,
-				"pwm1", O_RDWR);
-	if (!fan_fd) {
-		log_fail("open_hwmon", __FILE__, __LINE__);
-		status = EXIT_FAILURE;
-		goto cleanup_cpu_fd;
+	struct config config;
+	if (parse_args(argc, argv, &config)) {
+		log_fail("parse_args", __FILE__, __LINE__);
+		return EXIT_FAILURE;
+	}
+	if (config.client.action != CLIENT_NONE) {
+		return client_run(&config.client, config.shared_name,
+				  config.api_socket_path)
+			       ? EXIT_FAILURE
+			       : EXIT_SUCCESS;
+	}
+	if (*config.record_dump_path) {
+		return record_dump(config.record_dump_path, stdout)
+			       ? EXIT_FAILURE
+			       : EXIT_SUCCESS;
+	}
+	if (*config.replay_path || config.bench) {
+		return replay(&config) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	// Taken before touching any fan, so a second instance leaves them
+	// alone.
+	struct shared shared = {
+		.fd = -1,
+	};
+	if (*config.shared_name &&
+	    shared_create(&shared, config.shared_name)) {
+		log_fail("shared_create", __FILE__, __LINE__);
+		return EXIT_FAILURE;
+	}
+	// Puts back whatever a crashed run left borrowed, before anything
+	// reads it as the kernel's own setting.
+	if (sysfs_state_open(config.state_path)) {
+		log_fail("sysfs_state_open", __FILE__, __LINE__);
 	}
 
-	if (set_fan_speed_from_temp(fan_fd, cpu_fd, min_temp, max_temp,
-				    min_fan_speed)) {
-		log_fail("set_fan_speed_from_temp", __FILE__, __LINE__);
+	// A stale or unreadable cache only means a full scan.
+	if (*config.device_cache_path &&
+	    device_cache_load(config.device_cache_path)) {
+		log_fail("device_cache_load", __FILE__, __LINE__);
+	}
+	if (zone_table_open(&config.zones)) {
+		log_fail("zone_table_open", __FILE__, __LINE__);
 		status = EXIT_FAILURE;
+		goto cleanup_shared;
+	}
+	if (*config.device_cache_path && device_cache_dirty() &&
+	    device_cache_save(config.device_cache_path)) {
+		log_fail("device_cache_save", __FILE__, __LINE__);
 	}
 
-	if (close(fan_fd) < 0) {
-		perror("close() failed");
+	if (config.calibrate) {
+		if (calibrate_run(&config.zones, config.profile_path)) {
+			log_fail("calibrate_run", __FILE__, __LINE__);
+			status = EXIT_FAILURE;
+		}
+		goto cleanup_zones;
+	}
+
+	struct event_loop loop;
+	if (event_loop_init(&loop, &config.zones, config.api_socket_path)) {
+		log_fail("event_loop_init", __FILE__, __LINE__);
 		status = EXIT_FAILURE;
+		goto cleanup_zones;
 	}
-cleanup_cpu_fd:
-	if (close(cpu_fd) < 0) {
-		perror("close() failed");
+
+	if (set_fan_speed_from_temp(&loop, &config, &shared)) {
+		log_fail("set_fan_speed_from_temp", __FILE__, __LINE__);
 		status = EXIT_FAILURE;
 	}
 
+	event_loop_cleanup(&loop);
+cleanup_zones:
+	zone_table_close(&config.zones);
+cleanup_shared:
+	shared_destroy(&shared);
+
 	return status;
 }
@@ -0,0 +1,130 @@
+#include "mpc.h"
+
+#include <string.h>
+
+#include "hwmon.h"
+
+// Old samples fade with a time constant of about 1 / (1 - forgetting)
+// updates, so the fit follows a change of heatsink or ambient.
+#define MPC_FORGETTING 0.995
+#define MPC_INITIAL_COVARIANCE 100.0
+// While pwm and load hold still, nothing is learned about their
+// coefficients and forgetting alone would blow their covariance up, which
+// makes the next change swing the fit wildly.
+#define MPC_MAX_COVARIANCE 1000.0
+
+void mpc_reset(struct mpc *mpc)
+{
+	memset(mpc, 0, sizeof(*mpc));
+	for (int i = 0; i < MPC_PARAMS; i++) {
+		mpc->covariance[i][i] = MPC_INITIAL_COVARIANCE;
+	}
+}
+
+static double model_temp(long temp)
+{
+	return (temp - MPC_REFERENCE_TEMP) / 1000.0;
+}
+
+// One recursive least squares step with exponential forgetting.
+static void fit(struct mpc *mpc, const double *regressors, double rate)
+{
+	double (*p)[MPC_PARAMS] = mpc->covariance;
+	double pr[MPC_PARAMS];
+	double denominator = MPC_FORGETTING;
+	double error = rate;
+
+	for (int i = 0; i < MPC_PARAMS; i++) {
+		pr[i] = 0.0;
+		for (int j = 0; j < MPC_PARAMS; j++) {
+			pr[i] += p[i][j] * regressors[j];
+		}
+		denominator += regressors[i] * pr[i];
+		error -= mpc->theta[i] * regressors[i];
+	}
+	double largest = 0.0;
+	for (int i = 0; i < MPC_PARAMS; i++) {
+		mpc->theta[i] += pr[i] / denominator * error;
+		for (int j = 0; j < MPC_PARAMS; j++) {
+			p[i][j] = (p[i][j] - pr[i] * pr[j] / denominator) /
+				  MPC_FORGETTING;
+		}
+		if (p[i][i] > largest) {
+			largest = p[i][i];
+		}
+	}
+	if (largest > MPC_MAX_COVARIANCE) {
+		double scale = MPC_MAX_COVARIANCE / largest;
+		for (int i = 0; i < MPC_PARAMS; i++) {
+			for (int j = 0; j < MPC_PARAMS; j++) {
+				p[i][j] *= scale;
+			}
+		}
+	}
+}
+
+void mpc_observe(struct mpc *mpc, long temp, double load, int pwm,
+		 long dt_ms, long horizon_ms)
+{
+	if (mpc->has_last && dt_ms > 0) {
+		const double regressors[MPC_PARAMS] = {
+			1.0,
+			load,
+			(double)pwm / MAX_FAN_SPEED,
+			mpc->last_temp,
+		};
+		double rate = (model_temp(temp) - mpc->last_temp) /
+			      (dt_ms / 1000.0);
+		fit(mpc, regressors, rate);
+		mpc->samples++;
+	}
+	if (load >= mpc->peak_load) {
+		mpc->peak_load = load;
+	} else {
+		mpc->peak_load -= (mpc->peak_load - load) * dt_ms /
+				  (double)(horizon_ms + dt_ms);
+	}
+	mpc->has_last = true;
+	mpc->last_temp = model_temp(temp);
+}
+
+bool mpc_ready(const struct mpc *mpc)
+{
+	return mpc->samples >= MPC_MIN_SAMPLES && mpc->theta[2] < 0.0 &&
+	       mpc->theta[3] <= 0.0;
+}
+
+// With the inputs held, x[k + 1] = r * x[k] + h * (b + theta[2] * u), so
+// after n steps x[n] = r^n * x[0] + h * (b + theta[2] * u) * sum(r^k) for
+// k < n. That is linear in u, which is solved for x[n] = limit directly.
+// A first-order plant under constant input moves monotonically, so
+// ending below the limit means staying below it once there.
+int mpc_plan(const struct mpc *mpc, long temp, long limit, long horizon_ms)
+{
+	const double h = MPC_STEP_MS / 1000.0;
+	long steps = horizon_ms / MPC_STEP_MS;
+	double r = 1.0 + h * mpc->theta[3];
+	r = r < 0.0 ? 0.0 : r;
+
+	double power = 1.0;
+	double sum = 0.0;
+	for (long k = 0; k < (steps > 0 ? steps : 1); k++) {
+		sum += power;
+		power *= r;
+	}
+	double drift = mpc->theta[0] + mpc->theta[1] * mpc->peak_load;
+	double cooling = h * mpc->theta[2] * sum;
+	double share = (model_temp(limit) - power * model_temp(temp) -
+			h * drift * sum) /
+		       cooling;
+
+	if (share <= 0.0) {
+		return 0;
+	}
+	if (share >= 1.0) {
+		return MAX_FAN_SPEED;
+	}
+	// Round up, the plan is the least that still holds the limit.
+	int pwm = (int)(share * MAX_FAN_SPEED);
+	return pwm < share * MAX_FAN_SPEED ? pwm + 1 : pwm;
+}
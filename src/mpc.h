@@ -0,0 +1,51 @@
+#ifndef MPC_H
+#define MPC_H
+
+#include <stdbool.h>
+
+#define MPC_PARAMS 4
+#define DEFAULT_MPC_HORIZON_MS 30000
+// The prediction steps through the horizon this far at a time.
+#define MPC_STEP_MS 1000
+// Updates before the model is trusted over the fallback ramp.
+#define MPC_MIN_SAMPLES 30
+// Millidegrees the model's temperature is taken relative to, which keeps
+// its regressors of similar size.
+#define MPC_REFERENCE_TEMP 50000
+
+// A first-order thermal model fitted online by recursive least squares:
+//
+//   dT/dt = theta[0] + theta[1] * load + theta[2] * pwm + theta[3] * T
+//
+// in degrees per second, with load and pwm as shares of full and T in
+// degrees relative to MPC_REFERENCE_TEMP. theta[2] is the cooling the fan
+// buys and theta[3] the heat lost to the surroundings, both negative for
+// a plausible plant. Everything is fixed-size, an update and a plan are a
+// few hundred floating point operations.
+struct mpc {
+	double theta[MPC_PARAMS];
+	double covariance[MPC_PARAMS][MPC_PARAMS];
+	int samples;
+	bool has_last;
+	// Where the temperature started out at the previous update.
+	double last_temp;
+	// Recent load peak, decaying over the horizon, so a burst that just
+	// paused is still planned for.
+	double peak_load;
+};
+
+void mpc_reset(struct mpc *mpc);
+// Fits the model to temp, read dt_ms after the previous update. load and
+// pwm are what ran over those dt_ms: the load measured since the previous
+// update and the pwm last written. dt_ms is 0 on the first update.
+void mpc_observe(struct mpc *mpc, long temp, double load, int pwm,
+		 long dt_ms, long horizon_ms);
+// Whether the fit has seen enough samples and describes a fan that cools.
+bool mpc_ready(const struct mpc *mpc);
+// Lowest constant pwm that keeps the temperature predicted from temp
+// below limit at the end of horizon_ms. Re-planned on every update, so
+// only the first step of the plan is ever applied. The model must be
+// ready.
+int mpc_plan(const struct mpc *mpc, long temp, long limit, long horizon_ms);
+
+#endif
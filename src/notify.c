@@ -0,0 +1,91 @@
+#include "notify.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "number.h"
+
+int notify_open(struct notify *notify)
+{
+	memset(notify, 0, sizeof(*notify));
+	notify->fd = -1;
+
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (!path || !*path) {
+		return 0;
+	}
+	size_t length = strlen(path);
+	if ((*path != '/' && *path != '@') ||
+	    length >= sizeof(notify->addr.sun_path)) {
+		fprintf(stderr, "unsupported NOTIFY_SOCKET: %s\n", path);
+		return -1;
+	}
+	notify->addr.sun_family = AF_UNIX;
+	memcpy(notify->addr.sun_path, path, length);
+	// '@' stands for the abstract namespace.
+	if (*path == '@') {
+		notify->addr.sun_path[0] = '\0';
+	}
+	notify->addr_length =
+		(socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+
+	// Only the service's main process is watched, which may be a
+	// wrapper that started this one.
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid = getenv("WATCHDOG_PID");
+	long long value = 0;
+	if (usec && !parse_long_long(usec, NULL, &value) && value > 0) {
+		long long watchdog_pid = 0;
+		if (!pid || (!parse_long_long(pid, NULL, &watchdog_pid) &&
+			     watchdog_pid == getpid())) {
+			notify->watchdog_usec = (uint64_t)value;
+		}
+	}
+
+	notify->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (notify->fd < 0) {
+		perror("socket() failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+void notify_close(struct notify *notify)
+{
+	if (notify->fd >= 0 && close(notify->fd) < 0) {
+		perror("close() failed");
+	}
+	notify->fd = -1;
+}
+
+int notify_send(const struct notify *notify, const char *state)
+{
+	if (notify->fd < 0) {
+		return 0;
+	}
+	if (sendto(notify->fd, state, strlen(state), MSG_NOSIGNAL,
+		   (const struct sockaddr *)&notify->addr,
+		   notify->addr_length) < 0) {
+		perror("sendto() failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+void notify_watchdog(struct notify *notify, uint64_t now_ns)
+{
+	if (!notify->watchdog_usec ||
+	    (notify->last_ping_ns &&
+	     now_ns - notify->last_ping_ns < notify->watchdog_usec * 500)) {
+		return;
+	}
+	if (!notify_send(notify, "WATCHDOG=1")) {
+		notify->last_ping_ns = now_ns;
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// The sd_notify() protocol without libsystemd: datagrams of VAR=value
+// lines to the socket systemd names in $NOTIFY_SOCKET. Everything is
+// resolved by notify_open(), so sending never allocates.
+struct notify {
+	int fd;
+	struct sockaddr_un addr;
+	socklen_t addr_length;
+	// From $WATCHDOG_USEC, 0 when the service has no watchdog.
+	uint64_t watchdog_usec;
+	uint64_t last_ping_ns;
+};
+
+// Leaves fd at -1 when not started by systemd, which is not an error.
+int notify_open(struct notify *notify);
+void notify_close(struct notify *notify);
+int notify_send(const struct notify *notify, const char *state);
+// Sends WATCHDOG=1 if half the watchdog period passed since the last one.
+// now_ns is CLOCK_MONOTONIC_RAW.
+void notify_watchdog(struct notify *notify, uint64_t now_ns);
+
+#endif
@@ -0,0 +1,62 @@
+#include "number.h"
+
+#include <limits.h>
+#include <stdbool.h>
+
+int parse_long_long(const char *str, const char **out_end,
+		    long long *out_value)
+{
+	while (*str == ' ' || *str == '\t') {
+		str++;
+	}
+	bool negative = *str == '-';
+	if (negative) {
+		str++;
+	}
+
+	const char *digits = str;
+	unsigned long long value = 0;
+	const unsigned long long limit =
+		negative ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+	for (; *str >= '0' && *str <= '9'; str++) {
+		unsigned digit = *str - '0';
+		if (value > (limit - digit) / 10) {
+			return -1;
+		}
+		value = value * 10 + digit;
+	}
+	if (str == digits) {
+		return -1;
+	}
+
+	if (out_end) {
+		*out_end = str;
+	}
+	*out_value = negative ? (long long)(0 - value) : (long long)value;
+
+	return 0;
+}
+
+size_t format_long_long(long long value, char *out)
+{
+	char digits[NUMBER_STR_SIZE];
+	size_t digit_count = 0;
+	unsigned long long magnitude = value < 0 ? 0 - (unsigned long long)value
+						 : (unsigned long long)value;
+
+	do {
+		digits[digit_count++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude);
+
+	size_t length = 0;
+	if (value < 0) {
+		out[length++] = '-';
+	}
+	while (digit_count) {
+		out[length++] = digits[--digit_count];
+	}
+	out[length++] = '\n';
+
+	return length;
+}
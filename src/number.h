@@ -0,0 +1,22 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include <stddef.h>
+
+// Enough for any 64-bit value, a sign and a newline.
+#define NUMBER_STR_SIZE 24
+
+// Minimal decimal integer helpers for sysfs and procfs values. Unlike
+// strtol() and snprintf() they never touch locale state or the heap, so
+// they are safe to call from the control loop.
+
+// Parses an optionally negative decimal integer after skipping leading
+// spaces. Returns -1 if there are no digits or the value overflows. out_end
+// may be NULL.
+int parse_long_long(const char *str, const char **out_end,
+		    long long *out_value);
+// Writes value followed by a newline. Returns the number of bytes written,
+// out must hold NUMBER_STR_SIZE bytes.
+size_t format_long_long(long long value, char *out);
+
+#endif
@@ -0,0 +1,35 @@
+#include "profile.h"
+
+#include "hwmon.h"
+#include "tach.h"
+
+static bool standing_still(int speed, long rpm)
+{
+	return speed <= 0 || (rpm != TACH_RPM_UNKNOWN && rpm < TACH_STALL_RPM);
+}
+
+int profile_next(struct fan_profile *profile, int demand, int speed,
+		 long rpm, long dt_ms)
+{
+	if (!profile_calibrated(profile) || !demand) {
+		profile->kick_ms = 0;
+		return demand;
+	}
+	if (profile_kicking(profile)) {
+		profile->kick_ms -= dt_ms;
+		if (profile_kicking(profile)) {
+			return MAX_FAN_SPEED;
+		}
+	} else if (demand < profile->start_pwm &&
+		   standing_still(speed, rpm)) {
+		profile->kick_ms = PROFILE_KICK_MS;
+		return MAX_FAN_SPEED;
+	}
+
+	int floor = profile->stop_pwm + PROFILE_MARGIN;
+	if (floor > MAX_FAN_SPEED) {
+		floor = MAX_FAN_SPEED;
+	}
+
+	return demand < floor ? floor : demand;
+}
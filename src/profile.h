@@ -0,0 +1,46 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+
+// A fan kicked from standstill runs at full speed this long before it
+// drops to its demand.
+#define PROFILE_KICK_MS 500
+// Demands are kept this many pwm steps above the measured stop
+// threshold, which shifts a little with temperature and wear.
+#define PROFILE_MARGIN 8
+
+// Where a fan starts and stops turning, measured by calibrate_run(). Below
+// stop_pwm a running fan only hums, and from standstill it needs start_pwm,
+// often well above stop_pwm, to break away.
+struct fan_profile {
+	// Lowest pwm that starts the fan from standstill, 0 when the fan
+	// was never calibrated.
+	int start_pwm;
+	// Lowest pwm a turning fan keeps turning at.
+	int stop_pwm;
+	long max_rpm;
+	// Left of the kick-start pulse.
+	long kick_ms;
+};
+
+static inline bool profile_calibrated(const struct fan_profile *profile)
+{
+	return profile->start_pwm > 0;
+}
+
+static inline bool profile_kicking(const struct fan_profile *profile)
+{
+	return profile->kick_ms > 0;
+}
+
+// Returns the pwm to write for demand. A demand that isn't 0 is raised to
+// just above stop_pwm, so ramps don't spend time at speeds that don't
+// move air. A fan at pwm 0, or one whose tachometer reads rpm below the
+// stall threshold, that has to run below start_pwm gets a
+// PROFILE_KICK_MS pulse at full speed first. speed is the pwm the fan
+// runs at, rpm TACH_RPM_UNKNOWN without a tachometer.
+int profile_next(struct fan_profile *profile, int demand, int speed,
+		 long rpm, long dt_ms);
+
+#endif
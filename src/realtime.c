@@ -0,0 +1,54 @@
+// For CPU_SET() and SCHED_RESET_ON_FORK.
+#define _GNU_SOURCE
+
+#include "realtime.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static void prefault_stack(void)
+{
+	volatile char stack[REALTIME_STACK_PREFAULT_SIZE];
+	for (size_t i = 0; i < sizeof(stack); i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+int realtime_apply(const struct realtime_config *config)
+{
+	_Static_assert(REALTIME_MAX_CPUS <= CPU_SETSIZE,
+		       "cpu_set_t can't hold every cpu");
+	if (config->cpu != REALTIME_CPU_UNSET) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(config->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			fprintf(stderr, "pinning to cpu %d failed: %s\n",
+				config->cpu, strerror(errno));
+			return -1;
+		}
+	}
+	if (config->priority) {
+		struct sched_param param = {
+			.sched_priority = config->priority,
+		};
+		// Nothing started from here should inherit the policy.
+		if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK,
+				       &param)) {
+			perror("sched_setscheduler() failed");
+			return -1;
+		}
+	}
+	if (config->lock_memory) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+			perror("mlockall() failed");
+			return -1;
+		}
+		prefault_stack();
+	}
+
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+
+#define REALTIME_CPU_UNSET -1
+#define REALTIME_MAX_CPUS 1024
+// Stack touched up front so that deep calls in the loop never fault in a
+// fresh page.
+#define REALTIME_STACK_PREFAULT_SIZE (64 * 1024)
+
+struct realtime_config {
+	// SCHED_FIFO priority, 0 keeps the normal scheduler.
+	int priority;
+	// Core the control thread is pinned to, REALTIME_CPU_UNSET for any.
+	int cpu;
+	// mlockall() the process once everything is set up.
+	bool lock_memory;
+};
+
+// Applied once, after every buffer and fd the loop needs exists. On the
+// RK3399 cores 0-3 are the A53s, which are never the ones a heavy load
+// saturates first.
+int realtime_apply(const struct realtime_config *config);
+
+#endif
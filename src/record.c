@@ -0,0 +1,403 @@
+#include "record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define RECORD_FILE_SIZE ((RECORD_BLOCKS + 1) * (size_t)RECORD_BLOCK_SIZE)
+// A varint takes at most 10 bytes, a sample has 3 fields besides its
+// temperatures and fan speeds.
+#define RECORD_SAMPLE_MAX ((3 + MAX_SENSORS + MAX_FANS) * 10)
+
+_Static_assert(sizeof(struct record_block) == RECORD_BLOCK_SIZE,
+	       "record blocks must fill RECORD_BLOCK_SIZE exactly");
+_Static_assert(sizeof(struct record_header) <= RECORD_BLOCK_SIZE,
+	       "the record header must fit its block");
+
+static struct record_header *header_of(uint8_t *map)
+{
+	return (struct record_header *)map;
+}
+
+static struct record_block *block_at(uint8_t *map, uint64_t sequence)
+{
+	return (struct record_block *)(map +
+				       (1 + sequence % RECORD_BLOCKS) *
+					       (size_t)RECORD_BLOCK_SIZE);
+}
+
+static bool header_matches(const struct record_header *header)
+{
+	return header->magic == RECORD_MAGIC &&
+	       header->version == RECORD_VERSION &&
+	       header->block_size == RECORD_BLOCK_SIZE &&
+	       header->block_count == RECORD_BLOCKS;
+}
+
+int record_open(struct record *record, const char *path)
+{
+	memset(record, 0, sizeof(*record));
+	record->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (record->fd < 0) {
+		fprintf(stderr, "open(%s) failed: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(record->fd, &st)) {
+		perror("fstat() failed");
+		goto cleanup;
+	}
+	if ((size_t)st.st_size != RECORD_FILE_SIZE &&
+	    ftruncate(record->fd, RECORD_FILE_SIZE)) {
+		perror("ftruncate() failed");
+		goto cleanup;
+	}
+	void *map = mmap(NULL, RECORD_FILE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, record->fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap() failed");
+		goto cleanup;
+	}
+	record->map = map;
+
+	struct record_header *header = header_of(record->map);
+	if ((size_t)st.st_size != RECORD_FILE_SIZE ||
+	    !header_matches(header)) {
+		memset(record->map, 0, RECORD_FILE_SIZE);
+		*header = (struct record_header){
+			.magic = RECORD_MAGIC,
+			.version = RECORD_VERSION,
+			.block_size = RECORD_BLOCK_SIZE,
+			.block_count = RECORD_BLOCKS,
+		};
+	}
+	struct timespec realtime;
+	struct timespec monotonic;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+	header->realtime_offset_ms =
+		((int64_t)realtime.tv_sec - monotonic.tv_sec) * 1000 +
+		(realtime.tv_nsec - monotonic.tv_nsec) / 1000000;
+
+	return 0;
+
+cleanup:
+	record_close(record);
+
+	return -1;
+}
+
+void record_close(struct record *record)
+{
+	if (record->map && munmap(record->map, RECORD_FILE_SIZE)) {
+		perror("munmap() failed");
+	}
+	if (record->fd >= 0 && close(record->fd) < 0) {
+		perror("close() failed");
+	}
+	record->map = NULL;
+	record->fd = -1;
+	record->block = NULL;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value)
+{
+	size_t length = 0;
+
+	while (value >= 0x80) {
+		out[length++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[length++] = (uint8_t)value;
+	return length;
+}
+
+static size_t put_delta(uint8_t *out, int64_t value, int64_t last)
+{
+	int64_t delta = value - last;
+	return put_varint(out, ((uint64_t)delta << 1) ^
+				       (uint64_t)(delta >> 63));
+}
+
+static size_t encode(uint8_t *out, const struct record_sample *sample,
+		     const struct record_sample *last)
+{
+	size_t length = put_varint(out, sample->time_ms - last->time_ms);
+	length += put_delta(out + length, sample->load_permille,
+			    last->load_permille);
+	length += put_delta(out + length, sample->freq_permille,
+			    last->freq_permille);
+	for (int i = 0; i < sample->sensor_count; i++) {
+		length += put_delta(out + length, sample->temps[i],
+				    last->temps[i]);
+	}
+	for (int i = 0; i < sample->fan_count; i++) {
+		length += put_delta(out + length, sample->fan_speeds[i],
+				    last->fan_speeds[i]);
+	}
+	return length;
+}
+
+static void start_block(struct record *record,
+			const struct record_sample *sample)
+{
+	struct record_header *header = header_of(record->map);
+	uint64_t sequence = header->head;
+
+	record->block = block_at(record->map, sequence);
+	// Readers still holding the old block see its sequence change.
+	__atomic_store_n(&record->block->used, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&record->block->sequence, (uint32_t)sequence,
+			 __ATOMIC_RELEASE);
+	record->block->time_ms = sample->time_ms;
+	record->block->sensor_count = (uint8_t)sample->sensor_count;
+	record->block->fan_count = (uint8_t)sample->fan_count;
+	__atomic_store_n(&header->head, sequence + 1, __ATOMIC_RELEASE);
+	record->last = (struct record_sample){ .time_ms = sample->time_ms };
+}
+
+static void append_sample(struct record *record,
+			  const struct record_sample *sample)
+{
+	uint8_t encoded[RECORD_SAMPLE_MAX];
+	struct record_block *block = record->block;
+	size_t length = 0;
+
+	if (block && block->sensor_count == sample->sensor_count &&
+	    block->fan_count == sample->fan_count &&
+	    sample->time_ms >= record->last.time_ms) {
+		length = encode(encoded, sample, &record->last);
+	}
+	if (!length || block->used + length > sizeof(block->data)) {
+		start_block(record, sample);
+		block = record->block;
+		length = encode(encoded, sample, &record->last);
+	}
+	memcpy(block->data + block->used, encoded, length);
+	__atomic_store_n(&block->used, (uint16_t)(block->used + length),
+			 __ATOMIC_RELEASE);
+	record->last = *sample;
+}
+
+void record_append(struct record *record, const struct telemetry *telemetry,
+		   int fan_count)
+{
+	if (!record->map) {
+		return;
+	}
+	uint64_t head = __atomic_load_n(&telemetry->head, __ATOMIC_ACQUIRE);
+	uint64_t first = record->next;
+	if (head - first > TELEMETRY_SAMPLES) {
+		fprintf(stderr, "record lost %llu samples\n",
+			(unsigned long long)(head - first - TELEMETRY_SAMPLES));
+		first = head - TELEMETRY_SAMPLES;
+	}
+
+	for (uint64_t i = first; i < head; i++) {
+		const struct telemetry_sample *from =
+			&telemetry->samples[i & (TELEMETRY_SAMPLES - 1)];
+		struct record_sample sample = {
+			.time_ms = from->time_ms,
+			.load_permille = from->load_permille,
+			.freq_permille = from->freq_permille,
+			.sensor_count = from->sensor_count,
+			.fan_count = fan_count,
+		};
+		memcpy(sample.temps, from->temps,
+		       from->sensor_count * sizeof(*sample.temps));
+		for (int j = 0; j < fan_count; j++) {
+			sample.fan_speeds[j] = from->fan_speeds[j];
+		}
+		append_sample(record, &sample);
+	}
+	record->next = head;
+}
+
+static int get_varint(const uint8_t **data, const uint8_t *end,
+		      uint64_t *out_value)
+{
+	uint64_t value = 0;
+
+	for (int shift = 0; *data < end && shift < 64; shift += 7) {
+		uint8_t byte = *(*data)++;
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*out_value = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int get_delta(const uint8_t **data, const uint8_t *end,
+		     int32_t *value)
+{
+	uint64_t zigzag = 0;
+	if (get_varint(data, end, &zigzag)) {
+		return -1;
+	}
+	*value += (int32_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+	return 0;
+}
+
+static int decode(const uint8_t **data, const uint8_t *end,
+		  struct record_sample *sample)
+{
+	uint64_t dt_ms = 0;
+	if (get_varint(data, end, &dt_ms) ||
+	    get_delta(data, end, &sample->load_permille) ||
+	    get_delta(data, end, &sample->freq_permille)) {
+		return -1;
+	}
+	sample->time_ms += dt_ms;
+	for (int i = 0; i < sample->sensor_count; i++) {
+		if (get_delta(data, end, &sample->temps[i])) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < sample->fan_count; i++) {
+		if (get_delta(data, end, &sample->fan_speeds[i])) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// A block the daemon overwrote while it was read no longer carries its
+// sequence, and is skipped. A torn read of the current block ends at the
+// last whole sample.
+static int read_block(const struct record_block *block, uint64_t sequence,
+		      int64_t offset_ms, record_visit visit, void *ctx)
+{
+	if (block->sequence != (uint32_t)sequence ||
+	    block->used > sizeof(block->data) ||
+	    block->sensor_count > MAX_SENSORS || block->fan_count > MAX_FANS) {
+		return 0;
+	}
+	struct record_sample sample = {
+		.time_ms = block->time_ms,
+		.sensor_count = block->sensor_count,
+		.fan_count = block->fan_count,
+	};
+	const uint8_t *data = block->data;
+	const uint8_t *end = block->data + block->used;
+	while (data < end && !decode(&data, end, &sample)) {
+		sample.unix_ms = (int64_t)sample.time_ms + offset_ms;
+		if (visit(&sample, ctx)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int record_read(const char *path, record_visit visit, void *ctx)
+{
+	int status = -1;
+	uint8_t *map = NULL;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s) failed: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	// A copy, so the daemon can go on appending meanwhile.
+	map = malloc(RECORD_FILE_SIZE);
+	if (!map) {
+		perror("malloc() failed");
+		goto cleanup;
+	}
+	ssize_t r = pread(fd, map, RECORD_FILE_SIZE, 0);
+	if (r < 0) {
+		perror("pread() failed");
+		goto cleanup;
+	}
+	const struct record_header *header = header_of(map);
+	if ((size_t)r != RECORD_FILE_SIZE || !header_matches(header)) {
+		fprintf(stderr, "%s is not a record file\n", path);
+		goto cleanup;
+	}
+
+	uint64_t first = header->head > RECORD_BLOCKS
+				 ? header->head - RECORD_BLOCKS
+				 : 0;
+	status = 0;
+	for (uint64_t i = first; !status && i < header->head; i++) {
+		status = read_block(block_at(map, i), i,
+				    header->realtime_offset_ms, visit, ctx);
+	}
+
+cleanup:
+	free(map);
+	if (close(fd) < 0) {
+		perror("close() failed");
+	}
+
+	return status;
+}
+
+struct dump_state {
+	FILE *out;
+	int sensor_count;
+	int fan_count;
+};
+
+static int dump_sample(const struct record_sample *sample, void *ctx)
+{
+	struct dump_state *state = ctx;
+	FILE *out = state->out;
+
+	if (sample->sensor_count != state->sensor_count ||
+	    sample->fan_count != state->fan_count) {
+		state->sensor_count = sample->sensor_count;
+		state->fan_count = sample->fan_count;
+		fputs("unix_ms,time_ms,load,freq", out);
+		for (int i = 0; i < sample->sensor_count; i++) {
+			fprintf(out, ",temp%d", i);
+		}
+		for (int i = 0; i < sample->fan_count; i++) {
+			fprintf(out, ",pwm%d", i);
+		}
+		fputc('\n', out);
+	}
+	fprintf(out, "%lld,%llu,%.3f,%.3f", (long long)sample->unix_ms,
+		(unsigned long long)sample->time_ms,
+		sample->load_permille / 1000.0,
+		sample->freq_permille / 1000.0);
+	for (int i = 0; i < sample->sensor_count; i++) {
+		fprintf(out, ",%d", sample->temps[i]);
+	}
+	for (int i = 0; i < sample->fan_count; i++) {
+		fprintf(out, ",%d", sample->fan_speeds[i]);
+	}
+	return fputc('\n', out) == EOF ? -1 : 0;
+}
+
+int record_dump(const char *path, FILE *out)
+{
+	struct dump_state state = {
+		.out = out,
+		.sensor_count = -1,
+	};
+
+	if (record_read(path, dump_sample, &state)) {
+		log_fail("record_read", __FILE__, __LINE__);
+		return -1;
+	}
+	if (fflush(out) == EOF) {
+		perror("fflush() failed");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "telemetry.h"
+#include "zone.h"
+
+#define DEFAULT_RECORD_PATH "/run/rockpro64fanadjust.rec"
+#define RECORD_PATH_SIZE TELEMETRY_PATH_SIZE
+#define RECORD_MAGIC 0x52504652
+#define RECORD_VERSION 1
+#define RECORD_BLOCK_SIZE 1024
+// Data blocks after the header block, 1 MiB of history. At one sample a
+// second and a sensor and fan each that is about two days.
+#define RECORD_BLOCKS 1024
+#define RECORD_BLOCK_HEADER_SIZE 16
+
+// The file starts with this in a block of its own.
+struct record_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t block_count;
+	// Blocks ever started, block i lives at slot i % block_count. Only
+	// moves forward, with a release store once the block is set up.
+	uint64_t head;
+	// CLOCK_REALTIME minus CLOCK_MONOTONIC when the daemon last opened
+	// the file, to put wall clock times on the samples.
+	int64_t realtime_offset_ms;
+};
+
+// Every block starts over from absolute values, so a reader can decode any
+// block that survived the ring wrapping around. Each sample after the
+// header is a run of LEB128 varints: the milliseconds since the previous
+// sample, then load, freq, every temperature and every fan speed as
+// zigzag deltas from the previous sample, or from 0 for the first one.
+// Steady samples take a byte per field.
+struct record_block {
+	// CLOCK_MONOTONIC of the first sample.
+	uint64_t time_ms;
+	// Which block this is, the header's head when it was started.
+	uint32_t sequence;
+	// Bytes of data, stored with release once the samples are complete.
+	uint16_t used;
+	uint8_t sensor_count;
+	uint8_t fan_count;
+	uint8_t data[RECORD_BLOCK_SIZE - RECORD_BLOCK_HEADER_SIZE];
+};
+
+struct record_sample {
+	uint64_t time_ms;
+	// time_ms on the wall clock.
+	int64_t unix_ms;
+	int32_t load_permille;
+	int32_t freq_permille;
+	int sensor_count;
+	int32_t temps[MAX_SENSORS];
+	int fan_count;
+	int32_t fan_speeds[MAX_FANS];
+};
+
+// The daemon's end: a rolling file mapped once at startup, which samples
+// are appended to with stores only.
+struct record {
+	int fd;
+	uint8_t *map;
+	struct record_block *block;
+	struct record_sample last;
+	// Next telemetry sample to append.
+	uint64_t next;
+};
+
+// Keeps whatever an earlier run left in path if it has the same layout.
+int record_open(struct record *record, const char *path);
+void record_close(struct record *record);
+// Appends the telemetry samples recorded since the last call. Samples that
+// fell out of the telemetry ring in between are lost.
+void record_append(struct record *record, const struct telemetry *telemetry,
+		   int fan_count);
+
+typedef int (*record_visit)(const struct record_sample *sample, void *ctx);
+// Calls visit for every sample still in the file at path, oldest first,
+// and stops at the first one it rejects.
+int record_read(const char *path, record_visit visit, void *ctx);
+// Prints every sample as CSV, with a header line whenever the sensor or
+// fan count changes.
+int record_dump(const char *path, FILE *out);
+
+#endif
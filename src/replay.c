@@ -0,0 +1,458 @@
+#include "replay.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc_guard.h"
+#include "hwmon.h"
+#include "log.h"
+#include "number.h"
+#include "record.h"
+
+// Built-in traces are sampled once a second and record what the sensors
+// would read with the fan stopped: a first-order response to CPU load on
+// top of the ambient temperature.
+#define BUILTIN_DURATION_MS 600000
+#define BUILTIN_STEP_MS 1000
+#define BUILTIN_AMBIENT 35000
+#define BUILTIN_FULL_LOAD_RISE 50000
+#define BUILTIN_HEAT_TAU_MS 60000
+
+enum builtin_trace {
+	BUILTIN_IDLE,
+	BUILTIN_STEP,
+	BUILTIN_BURST,
+	BUILTIN_RAMP,
+	BUILTIN_COUNT,
+};
+
+static const char *const builtin_names[] = {
+	[BUILTIN_IDLE] = "idle",
+	[BUILTIN_STEP] = "step",
+	[BUILTIN_BURST] = "burst",
+	[BUILTIN_RAMP] = "ramp",
+};
+
+static double builtin_load(enum builtin_trace trace, long time_ms)
+{
+	switch (trace) {
+	case BUILTIN_STEP:
+		return time_ms >= 120000 && time_ms < 420000 ? 1.0 : 0.05;
+	case BUILTIN_BURST:
+		// 20 s of full load every minute.
+		return time_ms % 60000 < 20000 ? 1.0 : 0.05;
+	case BUILTIN_RAMP:
+		return (double)time_ms / BUILTIN_DURATION_MS;
+	default:
+		return 0.05;
+	}
+}
+
+static int add_point(struct replay_trace *trace, int *capacity,
+		     const struct replay_point *point)
+{
+	if (trace->count == *capacity) {
+		int next_capacity = *capacity ? *capacity * 2 : 256;
+		struct replay_point *points = realloc(
+			trace->points, next_capacity * sizeof(*points));
+		if (!points) {
+			perror("realloc() failed");
+			return -1;
+		}
+		trace->points = points;
+		*capacity = next_capacity;
+	}
+	trace->points[trace->count++] = *point;
+
+	return 0;
+}
+
+static int load_builtin(struct replay_trace *trace, enum builtin_trace which)
+{
+	int capacity = 0;
+	double temp = BUILTIN_AMBIENT;
+
+	for (long time_ms = 0; time_ms <= BUILTIN_DURATION_MS;
+	     time_ms += BUILTIN_STEP_MS) {
+		double load = builtin_load(which, time_ms);
+		double target = BUILTIN_AMBIENT + load * BUILTIN_FULL_LOAD_RISE;
+		temp += (target - temp) * BUILTIN_STEP_MS /
+			(BUILTIN_HEAT_TAU_MS + BUILTIN_STEP_MS);
+		struct replay_point point = {
+			.time_ms = time_ms,
+			.load = load,
+			// Anything busy runs at the top frequency.
+			.freq = load > 0.1 ? 1.0 : 0.4,
+			.pwm = 0,
+			.sensor_count = 1,
+			.temps = { (long)temp },
+		};
+		if (add_point(trace, &capacity, &point)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_field(const char **str, long long min, long long max,
+		       long long *out_value)
+{
+	const char *end = NULL;
+	if (parse_long_long(*str, &end, out_value) || *out_value < min ||
+	    *out_value > max) {
+		return -1;
+	}
+	*str = end;
+
+	return 0;
+}
+
+// TIME_MS LOAD FREQ PWM TEMP...
+static int parse_point(const char *line, struct replay_point *out_point)
+{
+	long long time_ms = 0;
+	long long load = 0;
+	long long freq = 0;
+	long long pwm = 0;
+	if (parse_field(&line, 0, LLONG_MAX, &time_ms) ||
+	    parse_field(&line, 0, 1000, &load) ||
+	    parse_field(&line, 0, 1000, &freq) ||
+	    parse_field(&line, 0, MAX_FAN_SPEED, &pwm)) {
+		return -1;
+	}
+	*out_point = (struct replay_point){
+		.time_ms = (uint64_t)time_ms,
+		.load = load / 1000.0,
+		.freq = freq / 1000.0,
+		.pwm = (int)pwm,
+	};
+	line += strspn(line, " \t");
+	while (*line && *line != '\n') {
+		long long temp = 0;
+		if (out_point->sensor_count == MAX_SENSORS ||
+		    parse_field(&line, LONG_MIN, LONG_MAX, &temp)) {
+			return -1;
+		}
+		out_point->temps[out_point->sensor_count++] = (long)temp;
+		line += strspn(line, " \t");
+	}
+
+	return out_point->sensor_count ? 0 : -1;
+}
+
+struct record_points {
+	struct replay_trace *trace;
+	int capacity;
+};
+
+static int add_record_sample(const struct record_sample *sample, void *ctx)
+{
+	struct record_points *points = ctx;
+	struct replay_point point = {
+		.time_ms = sample->time_ms,
+		.load = sample->load_permille / 1000.0,
+		.freq = sample->freq_permille / 1000.0,
+		.sensor_count = sample->sensor_count,
+	};
+	for (int i = 0; i < sample->fan_count; i++) {
+		if (sample->fan_speeds[i] > point.pwm) {
+			point.pwm = sample->fan_speeds[i];
+		}
+	}
+	for (int i = 0; i < sample->sensor_count; i++) {
+		point.temps[i] = sample->temps[i];
+	}
+	// A restart or a reload can leave samples without sensors or out of
+	// order, a replay can't use those.
+	if (!point.sensor_count ||
+	    (points->trace->count &&
+	     point.time_ms <
+		     points->trace->points[points->trace->count - 1].time_ms)) {
+		return 0;
+	}
+	return add_point(points->trace, &points->capacity, &point);
+}
+
+static int load_file(struct replay_trace *trace, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	// The daemon's binary record replays just like a text trace.
+	uint32_t magic = 0;
+	if (fread(&magic, sizeof(magic), 1, f) == 1 && magic == RECORD_MAGIC) {
+		fclose(f);
+		struct record_points points = { .trace = trace };
+		return record_read(path, add_record_sample, &points);
+	}
+	rewind(f);
+
+	int status = 0;
+	int capacity = 0;
+	char *line = NULL;
+	size_t line_length = 0;
+	for (int number = 1; getline(&line, &line_length, f) > 0; number++) {
+		const char *start = line + strspn(line, " \t");
+		if (*start == '#' || *start == '\n' || !*start) {
+			continue;
+		}
+		struct replay_point point;
+		if (parse_point(start, &point) ||
+		    (trace->count &&
+		     point.time_ms < trace->points[trace->count - 1].time_ms)) {
+			fprintf(stderr, "%s:%d: invalid sample\n", path, number);
+			status = -1;
+			break;
+		}
+		if (add_point(trace, &capacity, &point)) {
+			status = -1;
+			break;
+		}
+	}
+	free(line);
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		status = -1;
+	}
+
+	return status;
+}
+
+int replay_load(struct replay_trace *trace, const char *spec)
+{
+	int status = -1;
+
+	*trace = (struct replay_trace){ 0 };
+	if (strncmp(spec, REPLAY_BUILTIN_PREFIX,
+		    strlen(REPLAY_BUILTIN_PREFIX))) {
+		status = load_file(trace, spec);
+	} else {
+		const char *name = spec + strlen(REPLAY_BUILTIN_PREFIX);
+		int which = 0;
+		while (which < BUILTIN_COUNT &&
+		       strcmp(name, builtin_names[which])) {
+			which++;
+		}
+		if (which == BUILTIN_COUNT) {
+			fprintf(stderr, "unknown built-in trace: %s\n", name);
+		} else {
+			status = load_builtin(trace, which);
+		}
+	}
+	if (!status && (trace->count < 2 ||
+			trace->points[trace->count - 1].time_ms ==
+				trace->points[0].time_ms)) {
+		fprintf(stderr, "%s is shorter than two samples\n", spec);
+		status = -1;
+	}
+	if (status) {
+		replay_free(trace);
+	}
+
+	return status;
+}
+
+void replay_free(struct replay_trace *trace)
+{
+	free(trace->points);
+	*trace = (struct replay_trace){ 0 };
+}
+
+static int fastest_fan(const struct zone_table *zones)
+{
+	int speed = 0;
+	for (int i = 0; i < zones->fan_count; i++) {
+		if (zones->fans[i].speed > speed) {
+			speed = zones->fans[i].speed;
+		}
+	}
+	return speed;
+}
+
+// One pass over the trace. Sensor temperatures are set where
+// zone_table_read() would have put them, everything from there on is the
+// path the control loop takes.
+static int replay_once(const struct replay_trace *trace,
+		       struct zone_table *zones,
+		       const struct replay_model *model, long threshold,
+		       struct replay_report *out_report)
+{
+	const struct replay_point *points = trace->points;
+	uint64_t start_ms = points[0].time_ms;
+	uint64_t end_ms = points[trace->count - 1].time_ms;
+	struct controller_input input = { 0 };
+	double offset = 0.0;
+	double pwm_ms = 0.0;
+	long dt_ms = 0;
+	int index = 0;
+
+	*out_report = (struct replay_report){
+		.duration_ms = (long)(end_ms - start_ms),
+	};
+	// The ticks run the control loop's code, so they are held to its
+	// promise of no heap allocations.
+	alloc_guard_arm();
+	for (uint64_t now_ms = start_ms;;) {
+		while (index < trace->count - 2 &&
+		       points[index + 1].time_ms <= now_ms) {
+			index++;
+		}
+		const struct replay_point *a = &points[index];
+		const struct replay_point *b = &points[index + 1];
+		double t = b->time_ms > a->time_ms
+				   ? (double)(now_ms - a->time_ms) /
+					     (b->time_ms - a->time_ms)
+				   : 0.0;
+		t = t > 1.0 ? 1.0 : t;
+
+		double target =
+			(double)model->gain * (a->pwm - fastest_fan(zones));
+		offset += (target - offset) * dt_ms /
+			  (double)(model->tau_ms + dt_ms);
+		long hottest = LONG_MIN;
+		for (int i = 0; i < zones->sensor_count; i++) {
+			// Extra sensors read the trace's last column.
+			int a_column = i < a->sensor_count ? i
+							   : a->sensor_count - 1;
+			int b_column = i < b->sensor_count ? i
+							   : b->sensor_count - 1;
+			double temp = a->temps[a_column] +
+				      (b->temps[b_column] -
+				       a->temps[a_column]) * t +
+				      offset;
+			zones->sensors[i].temp = (long)temp;
+			if (zones->sensors[i].temp > hottest) {
+				hottest = zones->sensors[i].temp;
+			}
+		}
+		input.load = a->load + (b->load - a->load) * t;
+		input.freq = a->freq + (b->freq - a->freq) * t;
+		input.dt_ms = dt_ms;
+
+		long interval_ms = zone_table_update(zones, &input);
+		if (zone_table_write(zones)) {
+			alloc_guard_disarm();
+			log_fail("zone_table_write", __FILE__, __LINE__);
+			return -1;
+		}
+		out_report->samples++;
+
+		long step_ms = end_ms - now_ms < (uint64_t)interval_ms
+				       ? (long)(end_ms - now_ms)
+				       : interval_ms;
+		if (hottest > threshold) {
+			out_report->above_ms += step_ms;
+			if (hottest - threshold > out_report->overshoot) {
+				out_report->overshoot = hottest - threshold;
+			}
+		}
+		pwm_ms += (double)fastest_fan(zones) * step_ms;
+		if (now_ms == end_ms) {
+			break;
+		}
+		now_ms += step_ms;
+		dt_ms = step_ms;
+	}
+	alloc_guard_disarm();
+	out_report->writes = zones->stats.writes;
+	out_report->mean_pwm = pwm_ms / out_report->duration_ms;
+
+	return 0;
+}
+
+static uint64_t cpu_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int replay_run(const struct replay_trace *trace,
+	       const struct zone_table *zones,
+	       const struct replay_model *model, long threshold,
+	       struct replay_report *out_report)
+{
+	int status = 0;
+	uint64_t cpu_ns = 0;
+
+	// Too large for the stack.
+	struct zone_table *sim = malloc(sizeof(*sim));
+	if (!sim) {
+		perror("malloc() failed");
+		return -1;
+	}
+	// Every round starts from the same freshly finished table, so all
+	// of them do the same work and the first one is reported.
+	for (int round = 0; !status && round < REPLAY_ROUNDS; round++) {
+		struct replay_report report;
+		*sim = *zones;
+		if (zone_table_simulate(sim)) {
+			log_fail("zone_table_simulate", __FILE__, __LINE__);
+			status = -1;
+			break;
+		}
+		uint64_t start_ns = cpu_time_ns();
+		status = replay_once(trace, sim, model, threshold, &report);
+		cpu_ns += cpu_time_ns() - start_ns;
+		zone_table_close(sim);
+		if (!round) {
+			*out_report = report;
+		}
+	}
+	free(sim);
+	if (!status) {
+		out_report->cpu_ns = (double)cpu_ns /
+				     ((double)out_report->samples * REPLAY_ROUNDS);
+	}
+
+	return status;
+}
+
+void replay_print_header(void)
+{
+	printf("%-16s %8s %8s %9s %12s %9s %10s\n", "trace", "samples",
+	       "writes", "above_s", "overshoot_c", "mean_pwm", "ns/sample");
+}
+
+void replay_print(const char *name, const struct replay_report *report)
+{
+	printf("%-16s %8ld %8llu %9.1f %12.1f %9.1f %10.0f\n", name,
+	       report->samples, report->writes, report->above_ms / 1000.0,
+	       report->overshoot / 1000.0, report->mean_pwm, report->cpu_ns);
+}
+
+int replay_bench(const struct zone_table *zones,
+		 const struct replay_model *model, long threshold)
+{
+	char spec[32];
+
+	replay_print_header();
+	for (int i = 0; i < BUILTIN_COUNT; i++) {
+		struct replay_trace trace;
+		struct replay_report report;
+		snprintf(spec, sizeof(spec), REPLAY_BUILTIN_PREFIX "%s",
+			 builtin_names[i]);
+		if (replay_load(&trace, spec)) {
+			log_fail("replay_load", __FILE__, __LINE__);
+			return -1;
+		}
+		int status = replay_run(&trace, zones, model, threshold,
+					&report);
+		replay_free(&trace);
+		if (status) {
+			log_fail("replay_run", __FILE__, __LINE__);
+			return -1;
+		}
+		replay_print(builtin_names[i], &report);
+	}
+
+	return 0;
+}
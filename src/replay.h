@@ -0,0 +1,71 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+#include "zone.h"
+
+#define REPLAY_BUILTIN_PREFIX "builtin:"
+#define DEFAULT_REPLAY_GAIN 40
+#define DEFAULT_REPLAY_TAU_MS 30000
+// Every replay is run this many times so the CPU cost per sample is
+// measured over more than a few hundred ticks.
+#define REPLAY_ROUNDS 20
+
+struct replay_point {
+	uint64_t time_ms;
+	double load;
+	double freq;
+	// Fastest fan when the trace was recorded.
+	int pwm;
+	int sensor_count;
+	long temps[MAX_SENSORS];
+};
+
+struct replay_trace {
+	int count;
+	struct replay_point *points;
+};
+
+// The fans in a replay don't cool the same as the ones that were running
+// when the trace was recorded, so every sensor is offset from its recorded
+// temperature. The offset settles at gain millidegrees per PWM step the
+// replayed fans run faster than the recorded ones, with a first-order lag
+// of tau_ms.
+struct replay_model {
+	long gain;
+	long tau_ms;
+};
+
+struct replay_report {
+	long samples;
+	unsigned long long writes;
+	long duration_ms;
+	// How long the hottest sensor spent above the threshold, and by how
+	// many millidegrees it went over at most.
+	long above_ms;
+	long overshoot;
+	// Time-weighted speed of the fastest fan.
+	double mean_pwm;
+	// CPU time of the control path per sample.
+	double cpu_ns;
+};
+
+// Reads a trace in the format telemetry_append_trace() writes. spec may
+// also name one of the built-in traces as builtin:NAME.
+int replay_load(struct replay_trace *trace, const char *spec);
+void replay_free(struct replay_trace *trace);
+// Feeds trace through a simulated copy of zones, ticking whenever the
+// scheduler asks to, as fast as the CPU allows.
+int replay_run(const struct replay_trace *trace,
+	       const struct zone_table *zones,
+	       const struct replay_model *model, long threshold,
+	       struct replay_report *out_report);
+// Prints a header followed by one row per report.
+void replay_print_header(void);
+void replay_print(const char *name, const struct replay_report *report);
+// Replays every built-in trace and prints a row for each.
+int replay_bench(const struct zone_table *zones,
+		 const struct replay_model *model, long threshold);
+
+#endif
@@ -0,0 +1,71 @@
+#include "scheduler.h"
+
+#include <stdint.h>
+
+// Sample often enough to see at least this many readings before the
+// temperature is predicted to reach max_temp.
+#define SAMPLES_PER_RAMP 4
+
+static long clamp_interval(const struct scheduler *scheduler,
+			   int64_t interval_ms)
+{
+	if (interval_ms < scheduler->min_interval_ms) {
+		return scheduler->min_interval_ms;
+	}
+	if (interval_ms > scheduler->max_interval_ms) {
+		return scheduler->max_interval_ms;
+	}
+	return (long)interval_ms;
+}
+
+void scheduler_init(struct scheduler *scheduler, long min_interval_ms,
+		    long max_interval_ms)
+{
+	scheduler->min_interval_ms = min_interval_ms;
+	scheduler->max_interval_ms = max_interval_ms;
+	scheduler->interval_ms = min_interval_ms;
+	scheduler->last_temp = 0;
+}
+
+void scheduler_adopt(struct scheduler *scheduler,
+		     const struct scheduler *old)
+{
+	scheduler->interval_ms = clamp_interval(scheduler, old->interval_ms);
+	scheduler->last_temp = old->last_temp;
+}
+
+long scheduler_next(struct scheduler *scheduler,
+		    const struct controller_config *curve, long temp,
+		    long dt_ms)
+{
+	int64_t target_ms = scheduler->max_interval_ms;
+	if (temp > curve->min_temp) {
+		long headroom = curve->max_temp - temp;
+		if (headroom < 0) {
+			headroom = 0;
+		}
+		target_ms = scheduler->min_interval_ms +
+			    (int64_t)(scheduler->max_interval_ms -
+				      scheduler->min_interval_ms) *
+				    headroom /
+				    (curve->max_temp - curve->min_temp);
+	}
+	long rise = temp - scheduler->last_temp;
+	if (dt_ms > 0 && rise > 0 && temp < curve->max_temp) {
+		int64_t eta_ms = (int64_t)(curve->max_temp - temp) * dt_ms / rise;
+		if (eta_ms / SAMPLES_PER_RAMP < target_ms) {
+			target_ms = eta_ms / SAMPLES_PER_RAMP;
+		}
+	}
+
+	if (dt_ms <= 0 || target_ms < scheduler->interval_ms) {
+		scheduler->interval_ms = clamp_interval(scheduler, target_ms);
+	} else {
+		int64_t grown = (int64_t)scheduler->interval_ms * 2;
+		scheduler->interval_ms = clamp_interval(
+			scheduler, grown < target_ms ? grown : target_ms);
+	}
+	scheduler->last_temp = temp;
+
+	return scheduler->interval_ms;
+}
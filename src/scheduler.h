@@ -0,0 +1,25 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "controller.h"
+
+struct scheduler {
+	long min_interval_ms;
+	long max_interval_ms;
+	long interval_ms;
+	long last_temp;
+};
+
+void scheduler_init(struct scheduler *scheduler, long min_interval_ms,
+		    long max_interval_ms);
+// Carries the current interval and the last reading over from old.
+void scheduler_adopt(struct scheduler *scheduler,
+		     const struct scheduler *old);
+// Picks the delay until the next sample. The interval shrinks right away
+// when the temperature climbs towards max_temp and only grows back by
+// doubling while the reading stays flat. dt_ms is 0 on the first sample.
+long scheduler_next(struct scheduler *scheduler,
+		    const struct controller_config *curve, long temp,
+		    long dt_ms);
+
+#endif
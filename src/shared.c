@@ -0,0 +1,441 @@
+#include "shared.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hwmon.h"
+#include "log.h"
+
+// A reader gives up on a record its writer keeps changing, or that was
+// left half written by a writer that died.
+#define SHARED_READ_RETRIES 64
+#define LOCK_OWNER_SHIFT 32
+#define LOCK_SEQ_MASK 0xffffffffull
+
+static uint64_t make_lock(uint64_t owner, uint64_t seq)
+{
+	return owner << LOCK_OWNER_SHIFT | (seq & LOCK_SEQ_MASK);
+}
+
+static uint64_t lock_owner(uint64_t lock)
+{
+	return lock >> LOCK_OWNER_SHIFT;
+}
+
+static int map(struct shared *shared, int prot)
+{
+	shared->segment = mmap(NULL, sizeof(*shared->segment), prot,
+			       MAP_SHARED, shared->fd, 0);
+	if (shared->segment == MAP_FAILED) {
+		perror("mmap() failed");
+		shared->segment = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int shared_create(struct shared *shared, const char *name)
+{
+	*shared = (struct shared){ 0 };
+	shared->fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (shared->fd < 0) {
+		fprintf(stderr, "shm_open(%s) failed: %s\n", name,
+			strerror(errno));
+		return -1;
+	}
+	// Released by the kernel however the daemon exits.
+	if (flock(shared->fd, LOCK_EX | LOCK_NB)) {
+		if (errno == EWOULDBLOCK) {
+			fprintf(stderr, "another instance already runs on "
+					"%s\n",
+				name);
+		} else {
+			perror("flock() failed");
+		}
+		goto cleanup;
+	}
+	if (ftruncate(shared->fd, sizeof(*shared->segment))) {
+		perror("ftruncate() failed");
+		goto cleanup;
+	}
+	if (map(shared, PROT_READ | PROT_WRITE)) {
+		log_fail("map", __FILE__, __LINE__);
+		goto cleanup;
+	}
+
+	struct shared_segment *segment = shared->segment;
+	// Requests survive a restart of the daemon, anything else starts
+	// over.
+	if (segment->magic != SHARED_MAGIC ||
+	    segment->version != SHARED_VERSION) {
+		memset(segment, 0, sizeof(*segment));
+	}
+	memset(&segment->status, 0, sizeof(segment->status));
+	segment->status.pid = getpid();
+	segment->version = SHARED_VERSION;
+	__atomic_store_n(&segment->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+
+cleanup:
+	shared_destroy(shared);
+
+	return -1;
+}
+
+void shared_destroy(struct shared *shared)
+{
+	if (shared->segment) {
+		// No one to wake any more.
+		__atomic_store_n(&shared->segment->status.pid, 0,
+				 __ATOMIC_RELAXED);
+		munmap(shared->segment, sizeof(*shared->segment));
+		shared->segment = NULL;
+	}
+	if (shared->fd >= 0 && close(shared->fd)) {
+		perror("close() failed");
+	}
+	shared->fd = -1;
+}
+
+// Copies out a live request. Returns -1 for a free slot or one that is
+// being written.
+static int read_request(const struct shared_request *request,
+			uint64_t *out_lock, struct shared_request *out_copy)
+{
+	for (int i = 0; i < SHARED_READ_RETRIES; i++) {
+		uint64_t lock =
+			__atomic_load_n(&request->lock, __ATOMIC_ACQUIRE);
+		if (!lock_owner(lock)) {
+			return -1;
+		}
+		if (lock & 1) {
+			continue;
+		}
+		out_copy->floor =
+			__atomic_load_n(&request->floor, __ATOMIC_RELAXED);
+		out_copy->expires_ns =
+			__atomic_load_n(&request->expires_ns, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&request->lock, __ATOMIC_RELAXED) == lock) {
+			*out_lock = lock;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+// Fails harmlessly if the owner renewed or released the request since
+// lock was read.
+static void free_request(struct shared_request *request, uint64_t lock)
+{
+	__atomic_compare_exchange_n(&request->lock, &lock,
+				    make_lock(0, lock + 2), false,
+				    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+int shared_floor(struct shared *shared, uint64_t now_ns, long elapsed_ms)
+{
+	if (!shared->segment) {
+		return 0;
+	}
+	bool reap = false;
+	shared->reap_elapsed_ms += elapsed_ms;
+	if (shared->reap_elapsed_ms >= SHARED_REAP_INTERVAL_MS) {
+		shared->reap_elapsed_ms = 0;
+		reap = true;
+	}
+
+	int floor = 0;
+	shared->expires_ns = 0;
+	for (int i = 0; i < SHARED_REQUESTS; i++) {
+		struct shared_request *request = &shared->segment->requests[i];
+		struct shared_request copy;
+		uint64_t lock = 0;
+		if (read_request(request, &lock, &copy)) {
+			continue;
+		}
+		bool expired = copy.expires_ns && now_ns >= copy.expires_ns;
+		// Held requests last as long as their owner.
+		bool orphaned = !copy.expires_ns && reap &&
+				kill((pid_t)lock_owner(lock), 0) &&
+				errno == ESRCH;
+		if (expired || orphaned) {
+			free_request(request, lock);
+			continue;
+		}
+		if (copy.floor > floor) {
+			floor = copy.floor;
+		}
+		if (copy.expires_ns && (!shared->expires_ns ||
+					copy.expires_ns < shared->expires_ns)) {
+			shared->expires_ns = copy.expires_ns;
+		}
+	}
+
+	return floor > MAX_FAN_SPEED ? MAX_FAN_SPEED : floor;
+}
+
+long shared_expiry_ms(const struct shared *shared, uint64_t now_ns)
+{
+	if (!shared->segment || !shared->expires_ns) {
+		return -1;
+	}
+	// Expired requests were dropped by the last shared_floor(), but a
+	// zero interval would disarm the timer.
+	if (shared->expires_ns <= now_ns) {
+		return 1;
+	}
+
+	// Rounded up, waking a little early would leave it live.
+	return (long)((shared->expires_ns - now_ns + 999999) / 1000000);
+}
+
+void shared_publish(struct shared *shared, const struct zone_table *table,
+		    uint64_t ticks, uint64_t now_ns, int floor,
+		    bool emergency)
+{
+	if (!shared->segment) {
+		return;
+	}
+	struct shared_status *status = &shared->segment->status;
+	uint32_t seq = status->seq;
+	long temp = 0;
+	for (int i = 0; i < table->sensor_count; i++) {
+		if (!i || table->sensors[i].temp > temp) {
+			temp = table->sensors[i].temp;
+		}
+	}
+
+	__atomic_store_n(&status->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&status->ticks, ticks, __ATOMIC_RELAXED);
+	__atomic_store_n(&status->time_ns, now_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&status->temp, temp, __ATOMIC_RELAXED);
+	__atomic_store_n(&status->floor, floor, __ATOMIC_RELAXED);
+	__atomic_store_n(&status->emergency, emergency, __ATOMIC_RELAXED);
+	__atomic_store_n(&status->fan_count, table->fan_count,
+			 __ATOMIC_RELAXED);
+	for (int i = 0; i < table->fan_count; i++) {
+		__atomic_store_n(&status->speeds[i], table->fans[i].speed,
+				 __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&status->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int shared_attach(struct shared *shared, const char *name)
+{
+	*shared = (struct shared){ 0 };
+	shared->fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (shared->fd < 0) {
+		fprintf(stderr, "shm_open(%s) failed: %s\n", name,
+			strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(shared->fd, &st)) {
+		perror("fstat() failed");
+		goto cleanup;
+	}
+	if ((size_t)st.st_size < sizeof(*shared->segment)) {
+		fprintf(stderr, "%s is not set up yet\n", name);
+		goto cleanup;
+	}
+	if (map(shared, PROT_READ | PROT_WRITE)) {
+		log_fail("map", __FILE__, __LINE__);
+		goto cleanup;
+	}
+	if (__atomic_load_n(&shared->segment->magic, __ATOMIC_ACQUIRE) !=
+		    SHARED_MAGIC ||
+	    shared->segment->version != SHARED_VERSION) {
+		fprintf(stderr, "%s has an unknown layout\n", name);
+		goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	shared_detach(shared);
+
+	return -1;
+}
+
+void shared_detach(struct shared *shared)
+{
+	if (shared->segment) {
+		munmap(shared->segment, sizeof(*shared->segment));
+		shared->segment = NULL;
+	}
+	if (shared->fd >= 0 && close(shared->fd)) {
+		perror("close() failed");
+	}
+	shared->fd = -1;
+}
+
+// Takes the first free slot for pid, leaving it odd for the caller to
+// fill in. Returns the slot's odd lock in out_lock.
+static int claim(struct shared_segment *segment, uint64_t pid,
+		 uint64_t *out_lock)
+{
+	for (int i = 0; i < SHARED_REQUESTS; i++) {
+		struct shared_request *request = &segment->requests[i];
+		uint64_t lock =
+			__atomic_load_n(&request->lock, __ATOMIC_RELAXED);
+		uint64_t next = make_lock(pid, lock + 1);
+		if (!lock_owner(lock) &&
+		    __atomic_compare_exchange_n(&request->lock, &lock, next,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+			*out_lock = next;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Starts an update of a slot pid still owns. Fails if the daemon freed it.
+static int renew(struct shared_request *request, uint64_t pid,
+		 uint64_t *out_lock)
+{
+	uint64_t lock = __atomic_load_n(&request->lock, __ATOMIC_RELAXED);
+	uint64_t next = make_lock(pid, lock + 1);
+	if (lock_owner(lock) != pid || lock & 1 ||
+	    !__atomic_compare_exchange_n(&request->lock, &lock, next, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return -1;
+	}
+	*out_lock = next;
+
+	return 0;
+}
+
+int shared_request(struct shared *shared, int *slot, int floor,
+		   long duration_ms)
+{
+	if (floor < 0 || floor > MAX_FAN_SPEED || duration_ms < 0) {
+		fprintf(stderr, "invalid request: floor %d for %ld ms\n",
+			floor, duration_ms);
+		return -1;
+	}
+	uint64_t expires_ns = 0;
+	if (duration_ms) {
+		struct timespec now;
+		if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+			perror("clock_gettime() failed");
+			return -1;
+		}
+		expires_ns = (uint64_t)now.tv_sec * 1000000000 +
+			     (uint64_t)now.tv_nsec +
+			     (uint64_t)duration_ms * 1000000;
+	}
+
+	uint64_t pid = (uint64_t)getpid();
+	uint64_t lock = 0;
+	if (*slot < 0 || *slot >= SHARED_REQUESTS ||
+	    renew(&shared->segment->requests[*slot], pid, &lock)) {
+		*slot = claim(shared->segment, pid, &lock);
+		if (*slot < 0) {
+			fprintf(stderr, "every request slot is taken\n");
+			return -1;
+		}
+	}
+	struct shared_request *request = &shared->segment->requests[*slot];
+	__atomic_store_n(&request->floor, floor, __ATOMIC_RELAXED);
+	__atomic_store_n(&request->expires_ns, expires_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&request->lock, make_lock(pid, lock + 1),
+			 __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void shared_release(struct shared *shared, int slot)
+{
+	if (slot < 0 || slot >= SHARED_REQUESTS) {
+		return;
+	}
+	struct shared_request *request = &shared->segment->requests[slot];
+	uint64_t lock = __atomic_load_n(&request->lock, __ATOMIC_RELAXED);
+	if (lock_owner(lock) == (uint64_t)getpid() && !(lock & 1)) {
+		free_request(request, lock);
+	}
+}
+
+int shared_read_status(const struct shared *shared,
+		       struct shared_status *out_status)
+{
+	const struct shared_status *status = &shared->segment->status;
+
+	for (int i = 0; i < SHARED_READ_RETRIES; i++) {
+		uint32_t seq = __atomic_load_n(&status->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		out_status->seq = seq;
+		out_status->pid =
+			__atomic_load_n(&status->pid, __ATOMIC_RELAXED);
+		out_status->ticks =
+			__atomic_load_n(&status->ticks, __ATOMIC_RELAXED);
+		out_status->time_ns =
+			__atomic_load_n(&status->time_ns, __ATOMIC_RELAXED);
+		out_status->temp =
+			__atomic_load_n(&status->temp, __ATOMIC_RELAXED);
+		out_status->floor =
+			__atomic_load_n(&status->floor, __ATOMIC_RELAXED);
+		out_status->emergency =
+			__atomic_load_n(&status->emergency, __ATOMIC_RELAXED);
+		int32_t fan_count =
+			__atomic_load_n(&status->fan_count, __ATOMIC_RELAXED);
+		out_status->fan_count =
+			fan_count < 0 || fan_count > MAX_FANS ? 0 : fan_count;
+		for (int j = 0; j < out_status->fan_count; j++) {
+			out_status->speeds[j] = __atomic_load_n(
+				&status->speeds[j], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&status->seq, __ATOMIC_RELAXED) == seq) {
+			return 0;
+		}
+	}
+	fprintf(stderr, "status kept changing while being read\n");
+
+	return -1;
+}
+
+int shared_wake(const struct shared *shared)
+{
+	pid_t pid = __atomic_load_n(&shared->segment->status.pid,
+				    __ATOMIC_RELAXED);
+	// A daemon that crashed left its pid behind, and whatever runs under
+	// that pid now would die of SIGUSR1. Only a live daemon still holds
+	// the lock.
+	if (pid && !flock(shared->fd, LOCK_SH | LOCK_NB)) {
+		if (flock(shared->fd, LOCK_UN)) {
+			perror("flock() failed");
+		}
+		pid = 0;
+	} else if (pid && errno != EWOULDBLOCK) {
+		perror("flock() failed");
+		return -1;
+	}
+	if (!pid) {
+		fprintf(stderr, "the daemon isn't running\n");
+		return -1;
+	}
+	if (kill(pid, SIGUSR1)) {
+		perror("kill() failed");
+		return -1;
+	}
+
+	return 0;
+}
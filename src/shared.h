@@ -0,0 +1,97 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stdint.h>
+
+#include "zone.h"
+
+#define DEFAULT_SHARED_NAME "/rockpro64fanadjust"
+#define SHARED_NAME_SIZE 64
+#define SHARED_MAGIC 0x52503634
+#define SHARED_VERSION 1
+#define SHARED_REQUESTS 16
+// How often held requests are checked for an owner that went away.
+#define SHARED_REAP_INTERVAL_MS 5000
+
+// What the daemon last wrote, republished after every tick. Readers copy
+// it out with shared_read_status().
+struct shared_status {
+	// Odd while the daemon updates the record.
+	uint32_t seq;
+	int32_t pid;
+	uint64_t ticks;
+	// CLOCK_MONOTONIC time of the tick.
+	uint64_t time_ns;
+	int64_t temp;
+	// Highest floor merged into that tick, 0 without requests.
+	int32_t floor;
+	int32_t emergency;
+	int32_t fan_count;
+	int32_t speeds[MAX_FANS];
+};
+
+// A pwm floor posted by another process. Every fan runs at least this
+// fast while the request is live, whatever the curves ask for.
+struct shared_request {
+	// Owner pid in the upper half, 0 for a free slot, and the sequence
+	// in the lower half, odd while the owner writes. Claiming, updating
+	// and freeing a slot are compare-and-swaps of the whole word, so the
+	// daemon never frees a slot its owner just renewed.
+	uint64_t lock;
+	int32_t floor;
+	// CLOCK_MONOTONIC, 0 to hold the floor until it's released or its
+	// owner exits.
+	uint64_t expires_ns;
+} __attribute__((aligned(64)));
+
+struct shared_segment {
+	uint32_t magic;
+	uint32_t version;
+	struct shared_status status __attribute__((aligned(64)));
+	struct shared_request requests[SHARED_REQUESTS];
+};
+
+// A POSIX shared memory segment that lets other processes, a job
+// scheduler pre-cooling a node before a heavy job for example, ask for a
+// minimum fan speed without any syscall and without writing pwm behind
+// the daemon's back. The daemon holds an exclusive lock on the segment
+// for as long as it runs, so a second instance refuses to start instead
+// of fighting the first over the fans.
+struct shared {
+	int fd;
+	struct shared_segment *segment;
+	long reap_elapsed_ms;
+	// Earliest expiry among the requests last merged, 0 if none expires.
+	uint64_t expires_ns;
+};
+
+// Daemon side. Fails if another daemon has name open.
+int shared_create(struct shared *shared, const char *name);
+void shared_destroy(struct shared *shared);
+// Merges the live requests at now_ns and returns the highest floor, 0
+// without any. Frees expired requests, and every SHARED_REAP_INTERVAL_MS
+// held ones whose owner exited.
+int shared_floor(struct shared *shared, uint64_t now_ns, long elapsed_ms);
+// Milliseconds from now_ns until a merged request expires, -1 if none
+// does, so the floor is dropped on time.
+long shared_expiry_ms(const struct shared *shared, uint64_t now_ns);
+void shared_publish(struct shared *shared, const struct zone_table *table,
+		    uint64_t ticks, uint64_t now_ns, int floor,
+		    bool emergency);
+
+// Client side.
+int shared_attach(struct shared *shared, const char *name);
+void shared_detach(struct shared *shared);
+// Posts floor for duration_ms, 0 to hold it until released. *slot is -1
+// for a new request, and is kept by the caller to update or release it.
+int shared_request(struct shared *shared, int *slot, int floor,
+		   long duration_ms);
+void shared_release(struct shared *shared, int slot);
+int shared_read_status(const struct shared *shared,
+		       struct shared_status *out_status);
+// Requests are merged on the daemon's next sample, which may be a long
+// sleep away while idle. This has it sample right away instead, and
+// signals no one once the daemon that left its pid behind is gone.
+int shared_wake(const struct shared *shared);
+
+#endif
@@ -0,0 +1,48 @@
+#include "slew.h"
+
+#include "hwmon.h"
+
+void slew_reset(struct slew *slew, int speed)
+{
+	slew->speed = speed;
+	slew->direction = 0;
+	slew->carry = 0;
+}
+
+// How many steps rate allows after dt_ms, keeping the remainder.
+static long allowed_steps(struct slew *slew, int rate, long dt_ms)
+{
+	if (!rate) {
+		return MAX_FAN_SPEED;
+	}
+	slew->carry += (long)rate * dt_ms;
+	long steps = slew->carry / 1000;
+	slew->carry %= 1000;
+	return steps;
+}
+
+// Once the fan started moving it goes all the way to the demand, the
+// bands only decide when a move starts.
+int slew_next(struct slew *slew, const struct slew_config *config,
+	      int demand, long dt_ms)
+{
+	int diff = demand - slew->speed;
+
+	if (diff > config->up_band || (diff > 0 && demand == MAX_FAN_SPEED) ||
+	    (diff > 0 && slew->direction > 0)) {
+		long steps = allowed_steps(slew, config->up_rate, dt_ms);
+		slew->direction = 1;
+		slew->speed += steps < diff ? (int)steps : diff;
+	} else if (-diff > config->down_band ||
+		   (diff < 0 && slew->direction < 0)) {
+		long steps = allowed_steps(slew, config->down_rate, dt_ms);
+		slew->direction = -1;
+		slew->speed -= steps < -diff ? (int)steps : -diff;
+	}
+	if (slew->speed == demand || !diff) {
+		slew->direction = 0;
+		slew->carry = 0;
+	}
+
+	return slew->speed;
+}
@@ -0,0 +1,35 @@
+#ifndef SLEW_H
+#define SLEW_H
+
+// Sits between the curves and the fans. Small changes in demand are held
+// off by a hysteresis band on either side of the current speed, and the
+// speed moves towards the demand by at most the configured rate, so the
+// fan neither hunts around a step nor jumps audibly.
+struct slew_config {
+	// How far demand has to rise above or fall below the current speed,
+	// in PWM steps, before the fan follows it. Full speed is never held
+	// off.
+	int up_band;
+	int down_band;
+	// Largest change in PWM steps per second, 0 for no limit. A fast
+	// attack and a slow release keep spin-up quick and slow-down quiet.
+	int up_rate;
+	int down_rate;
+};
+
+struct slew {
+	int speed;
+	// 1 while rising towards the demand, -1 while falling, 0 when held.
+	int direction;
+	// Rate budget left over from earlier updates, in PWM step
+	// milliseconds, so slow rates still move with short intervals.
+	long carry;
+};
+
+void slew_reset(struct slew *slew, int speed);
+// Moves towards demand and returns the speed to write. dt_ms is 0 on the
+// first update, rate limits then hold the current speed.
+int slew_next(struct slew *slew, const struct slew_config *config,
+	      int demand, long dt_ms);
+
+#endif
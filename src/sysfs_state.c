@@ -0,0 +1,208 @@
+#include "sysfs_state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+struct sysfs_state_entry {
+	char attr_path[SYSFS_STATE_ATTR_SIZE];
+	char value[SYSFS_STATE_VALUE_SIZE];
+};
+
+static char state_path[SYSFS_STATE_PATH_SIZE];
+static struct sysfs_state_entry entries[SYSFS_STATE_ENTRIES];
+static int entry_count = 0;
+static char file_buffer[SYSFS_STATE_ENTRIES *
+			(SYSFS_STATE_ATTR_SIZE + SYSFS_STATE_VALUE_SIZE + 2)];
+
+static struct sysfs_state_entry *find_entry(const char *attr_path)
+{
+	for (int i = 0; i < entry_count; i++) {
+		if (!strcmp(entries[i].attr_path, attr_path)) {
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+static int write_attr(const char *attr_path, const char *value)
+{
+	int fd = open(attr_path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s) failed: %s\n", attr_path,
+			strerror(errno));
+		return -1;
+	}
+	int status = 0;
+	if (write(fd, value, strlen(value)) != (ssize_t)strlen(value)) {
+		fprintf(stderr, "write(%s) failed: %s\n", attr_path,
+			strerror(errno));
+		status = -1;
+	}
+	if (close(fd) < 0) {
+		perror("close() failed");
+	}
+
+	return status;
+}
+
+// Write then rename so a crash never leaves a torn file behind.
+static int save(void)
+{
+	if (!*state_path) {
+		return 0;
+	}
+	char tmp_path[SYSFS_STATE_PATH_SIZE + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_path);
+
+	size_t length = 0;
+	for (int i = 0; i < entry_count; i++) {
+		length += (size_t)snprintf(file_buffer + length,
+					   sizeof(file_buffer) - length,
+					   "%s\t%s\n", entries[i].attr_path,
+					   entries[i].value);
+	}
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      0644);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s) failed: %s\n", tmp_path,
+			strerror(errno));
+		return -1;
+	}
+	int status = 0;
+	if (write(fd, file_buffer, length) != (ssize_t)length) {
+		perror("write() failed");
+		status = -1;
+	}
+	if (close(fd) < 0) {
+		perror("close() failed");
+		status = -1;
+	}
+	if (!status && rename(tmp_path, state_path)) {
+		perror("rename() failed");
+		status = -1;
+	}
+	if (status) {
+		unlink(tmp_path);
+	}
+
+	return status;
+}
+
+static int copy_field(char *out, size_t out_length, const char *str)
+{
+	if (strlen(str) >= out_length) {
+		fprintf(stderr, "sysfs state field too long: %s\n", str);
+		return -1;
+	}
+	memcpy(out, str, strlen(str) + 1);
+
+	return 0;
+}
+
+static int parse_entry(char *line, struct sysfs_state_entry *out_entry)
+{
+	char *save_ptr = NULL;
+	char *attr_path = strtok_r(line, "\t", &save_ptr);
+	char *value = strtok_r(NULL, "\n", &save_ptr);
+	if (!attr_path || !value ||
+	    copy_field(out_entry->attr_path, sizeof(out_entry->attr_path),
+		       attr_path) ||
+	    copy_field(out_entry->value, sizeof(out_entry->value), value)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int sysfs_state_open(const char *path)
+{
+	if (copy_field(state_path, sizeof(state_path), path)) {
+		state_path[0] = '\0';
+		return -1;
+	}
+	entry_count = 0;
+	if (!*state_path) {
+		return 0;
+	}
+
+	FILE *f = fopen(state_path, "r");
+	if (!f) {
+		// Nothing was left changed.
+		if (errno == ENOENT) {
+			return 0;
+		}
+		fprintf(stderr, "fopen(%s) failed: %s\n", state_path,
+			strerror(errno));
+		return -1;
+	}
+	char *line = NULL;
+	size_t line_length = 0;
+	while (getline(&line, &line_length, f) > 0) {
+		struct sysfs_state_entry entry;
+		if (parse_entry(line, &entry)) {
+			continue;
+		}
+		// A device that went away took the changed value with it.
+		if (write_attr(entry.attr_path, entry.value)) {
+			log_fail("write_attr", __FILE__, __LINE__);
+			continue;
+		}
+		fprintf(stderr, "put %s back to %s\n", entry.attr_path,
+			entry.value);
+	}
+	free(line);
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+	}
+
+	return save();
+}
+
+int sysfs_state_remember(const char *attr_path, const char *value)
+{
+	if (find_entry(attr_path)) {
+		return 0;
+	}
+	if (entry_count == SYSFS_STATE_ENTRIES) {
+		fprintf(stderr, "too many sysfs values to remember\n");
+		return -1;
+	}
+	struct sysfs_state_entry *entry = &entries[entry_count];
+	if (copy_field(entry->attr_path, sizeof(entry->attr_path),
+		       attr_path) ||
+	    copy_field(entry->value, sizeof(entry->value), value)) {
+		return -1;
+	}
+	entry_count++;
+	if (save()) {
+		log_fail("save", __FILE__, __LINE__);
+		entry_count--;
+		return -1;
+	}
+
+	return 0;
+}
+
+void sysfs_state_forget(const char *attr_path)
+{
+	struct sysfs_state_entry *entry = find_entry(attr_path);
+	if (!entry) {
+		return;
+	}
+	*entry = entries[--entry_count];
+	if (save()) {
+		log_fail("save", __FILE__, __LINE__);
+	}
+}
+
+const char *sysfs_state_value(const char *attr_path)
+{
+	struct sysfs_state_entry *entry = find_entry(attr_path);
+	return entry ? entry->value : NULL;
+}
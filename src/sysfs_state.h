@@ -0,0 +1,28 @@
+#ifndef SYSFS_STATE_H
+#define SYSFS_STATE_H
+
+#define DEFAULT_SYSFS_STATE_PATH "/run/rockpro64fanadjust.state"
+#define SYSFS_STATE_PATH_SIZE 128
+#define SYSFS_STATE_ENTRIES 32
+#define SYSFS_STATE_ATTR_SIZE 256
+#define SYSFS_STATE_VALUE_SIZE 32
+
+// Sysfs attributes the daemon changes for a while, such as borrowed trip
+// points, together with what they held before. The file is rewritten
+// before every change and after every value put back, so whatever a
+// crashed run left changed is put back when the daemon starts again. The
+// file is written with plain syscalls from static buffers, which keeps
+// the calls safe inside the control loop.
+
+// Writes back every value a previous run left in state_path, then keeps
+// state_path for the calls below. Empty keeps the values in memory only.
+int sysfs_state_open(const char *state_path);
+// Records value as what attr_path goes back to, unless it already has
+// one. Call before changing attr_path.
+int sysfs_state_remember(const char *attr_path, const char *value);
+// Call once attr_path holds its remembered value again.
+void sysfs_state_forget(const char *attr_path);
+// The remembered value of attr_path, NULL if there is none.
+const char *sysfs_state_value(const char *attr_path);
+
+#endif
@@ -0,0 +1,62 @@
+#include "tach.h"
+
+#include "hwmon.h"
+
+void tach_reset(struct tach *tach)
+{
+	tach->rpm = TACH_RPM_UNKNOWN;
+	tach->correction = 0;
+	tach->stall_ms = 0;
+	tach->stalled = false;
+}
+
+static void detect_stall(struct tach *tach, const struct tach_config *config,
+			 int written, long dt_ms)
+{
+	if (tach->rpm >= TACH_STALL_RPM) {
+		tach->stall_ms = 0;
+		tach->stalled = false;
+		return;
+	}
+	if (!config->stall_pwm || written < config->stall_pwm) {
+		return;
+	}
+	tach->stall_ms += dt_ms;
+	if (tach->stall_ms >= TACH_STALL_MS) {
+		tach->stalled = true;
+	}
+}
+
+int tach_next(struct tach *tach, const struct tach_config *config,
+	      int demand, int written, int max_speed, long dt_ms)
+{
+	if (tach->rpm == TACH_RPM_UNKNOWN) {
+		return demand;
+	}
+	detect_stall(tach, config, written, dt_ms);
+	if (!config->max_rpm || !demand) {
+		tach->correction = 0;
+		return demand;
+	}
+	// Nothing to steer, and the correction would only wind up.
+	if (tach->stalled) {
+		return demand;
+	}
+
+	long target_rpm = (long)demand * config->max_rpm / MAX_FAN_SPEED;
+	long error_rpm = target_rpm - tach->rpm;
+	// Tachometers jitter by a few pulses, which is no reason to touch
+	// pwm on every tick.
+	if (error_rpm > TACH_DEADBAND_RPM || error_rpm < -TACH_DEADBAND_RPM) {
+		tach->correction +=
+			error_rpm * dt_ms * TACH_GAIN_STEPS / TACH_GAIN_RPM;
+	}
+	long speed = demand + tach->correction / 1000;
+	// Keep the correction to what the pwm range can still carry out.
+	if (speed > max_speed || speed < 1) {
+		speed = speed > max_speed ? max_speed : 1;
+		tach->correction = (speed - demand) * 1000;
+	}
+
+	return (int)speed;
+}
@@ -0,0 +1,52 @@
+#ifndef TACH_H
+#define TACH_H
+
+#include <stdbool.h>
+
+#define TACH_RPM_UNKNOWN -1
+#define TACH_PATH_SIZE 256
+// The closed loop moves pwm by TACH_GAIN_STEPS per second for every
+// TACH_GAIN_RPM the fan is off its target.
+#define TACH_GAIN_STEPS 10
+#define TACH_GAIN_RPM 1000
+#define TACH_DEADBAND_RPM 50
+// Below this a fan counts as standing still. It has TACH_STALL_MS to spin
+// up before that is a stall.
+#define TACH_STALL_RPM 100
+#define TACH_STALL_MS 5000
+#define DEFAULT_TACH_STALL_PWM 128
+
+// Feedback from the fanN_input next to a fan's pwmN.
+struct tach_config {
+	// RPM at full speed. When set, the speeds the curves pick are a
+	// share of it the fan is steered to instead of raw pwm, so an aging
+	// fan still moves the same air. 0 for open loop.
+	long max_rpm;
+	// A fan driven at this pwm or more that doesn't turn has stalled, 0
+	// disables stall detection.
+	int stall_pwm;
+};
+
+struct tach {
+	// Last reading, TACH_RPM_UNKNOWN without one.
+	long rpm;
+	// Added to the demand by the closed loop, in thousandths of a pwm
+	// step.
+	long correction;
+	long stall_ms;
+	bool stalled;
+};
+
+static inline bool tach_enabled(const struct tach_config *config)
+{
+	return config->max_rpm || config->stall_pwm;
+}
+
+void tach_reset(struct tach *tach);
+// Updates stall detection from the reading of this tick, taken while the
+// fan ran at written, and returns the pwm to write for demand, no more
+// than max_speed. dt_ms is 0 on the first update.
+int tach_next(struct tach *tach, const struct tach_config *config,
+	      int demand, int written, int max_speed, long dt_ms);
+
+#endif
@@ -0,0 +1,452 @@
+#include "telemetry.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+#define METRIC_PREFIX "rockpro64fanadjust_"
+
+void telemetry_init(struct telemetry *telemetry)
+{
+	memset(telemetry, 0, sizeof(*telemetry));
+}
+
+static int latency_bucket(uint32_t latency_us)
+{
+	int bucket = 0;
+	while (bucket < TELEMETRY_LATENCY_BUCKETS - 1 &&
+	       latency_us > (1u << bucket)) {
+		bucket++;
+	}
+	return bucket;
+}
+
+void telemetry_record(struct telemetry *telemetry,
+		      const struct telemetry_sample *sample)
+{
+	uint64_t head = telemetry->head;
+
+	telemetry->samples[head & (TELEMETRY_SAMPLES - 1)] = *sample;
+	telemetry->latency_buckets[latency_bucket(sample->write_us)]++;
+	telemetry->latency_sum_us += sample->write_us;
+	if (sample->write_us > telemetry->latency_max_us) {
+		telemetry->latency_max_us = sample->write_us;
+	}
+	if (sample->jitter_us > (int32_t)telemetry->jitter_max_us) {
+		telemetry->jitter_max_us = (uint32_t)sample->jitter_us;
+	}
+	__atomic_store_n(&telemetry->head, head + 1, __ATOMIC_RELEASE);
+}
+
+const struct telemetry_sample *
+telemetry_latest(const struct telemetry *telemetry)
+{
+	uint64_t head = __atomic_load_n(&telemetry->head, __ATOMIC_ACQUIRE);
+	if (!head) {
+		return NULL;
+	}
+	return &telemetry->samples[(head - 1) & (TELEMETRY_SAMPLES - 1)];
+}
+
+// Returns -1 when the sample has no value for stage.
+static int64_t stage_value(const struct telemetry_sample *sample,
+			   enum telemetry_stage stage)
+{
+	switch (stage) {
+	case TELEMETRY_STAGE_READ:
+		return sample->read_us;
+	case TELEMETRY_STAGE_EVAL:
+		return sample->eval_us;
+	case TELEMETRY_STAGE_WRITE:
+		return sample->write_us;
+	case TELEMETRY_STAGE_JITTER:
+		return sample->jitter_us;
+	default:
+		return -1;
+	}
+}
+
+void telemetry_quantiles(const struct telemetry *telemetry,
+			 enum telemetry_stage stage,
+			 struct telemetry_quantiles *out_quantiles)
+{
+	uint32_t values[TELEMETRY_SAMPLES];
+	uint64_t head = __atomic_load_n(&telemetry->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TELEMETRY_SAMPLES ? head - TELEMETRY_SAMPLES : 0;
+	int count = 0;
+
+	for (uint64_t i = first; i < head; i++) {
+		int64_t value = stage_value(
+			&telemetry->samples[i & (TELEMETRY_SAMPLES - 1)], stage);
+		if (value < 0) {
+			continue;
+		}
+		// Insertion sort, the ring is small and this runs on the
+		// slow timer.
+		int j = count++;
+		for (; j > 0 && values[j - 1] > value; j--) {
+			values[j] = values[j - 1];
+		}
+		values[j] = (uint32_t)value;
+	}
+
+	*out_quantiles = (struct telemetry_quantiles){ .count = count };
+	if (count) {
+		out_quantiles->p50 = values[(count - 1) / 2];
+		out_quantiles->p99 = values[(count - 1) * 99 / 100];
+		out_quantiles->max = values[count - 1];
+	}
+}
+
+void telemetry_print_latency(const struct telemetry *telemetry)
+{
+	struct telemetry_quantiles latency;
+	struct telemetry_quantiles jitter;
+
+	telemetry_quantiles(telemetry, TELEMETRY_STAGE_WRITE, &latency);
+	telemetry_quantiles(telemetry, TELEMETRY_STAGE_JITTER, &jitter);
+	fprintf(stderr,
+		"wake to write p50 %u us p99 %u us max %u us, "
+		"timer jitter p50 %u us p99 %u us max %u us\n",
+		latency.p50, latency.p99, telemetry->latency_max_us, jitter.p50,
+		jitter.p99, telemetry->jitter_max_us);
+}
+
+static int write_counter(FILE *f, const char *name, const char *help,
+			 uint64_t value)
+{
+	return fprintf(f,
+		       "# HELP " METRIC_PREFIX "%s %s\n"
+		       "# TYPE " METRIC_PREFIX "%s counter\n" METRIC_PREFIX
+		       "%s %llu\n",
+		       name, help, name, name, (unsigned long long)value);
+}
+
+static int write_quantiles(FILE *f, const struct telemetry *telemetry)
+{
+	static const char *const stage_names[] = {
+		[TELEMETRY_STAGE_READ] = "read",
+		[TELEMETRY_STAGE_EVAL] = "eval",
+		[TELEMETRY_STAGE_WRITE] = "write",
+		[TELEMETRY_STAGE_JITTER] = "jitter",
+	};
+
+	if (fprintf(f, "# HELP " METRIC_PREFIX "tick_latency_seconds "
+		       "Recent time from the wakeup to the end of each stage, "
+		       "jitter is how late the timer fired.\n"
+		       "# TYPE " METRIC_PREFIX "tick_latency_seconds gauge\n") <
+	    0) {
+		return -1;
+	}
+	for (int stage = 0; stage < TELEMETRY_STAGE_COUNT; stage++) {
+		struct telemetry_quantiles quantiles;
+		telemetry_quantiles(telemetry, stage, &quantiles);
+		if (!quantiles.count) {
+			continue;
+		}
+		const struct {
+			const char *name;
+			uint32_t value_us;
+		} values[] = {
+			{ "0.5", quantiles.p50 },
+			{ "0.99", quantiles.p99 },
+			{ "1", quantiles.max },
+		};
+		for (size_t i = 0; i < sizeof(values) / sizeof(values[0]);
+		     i++) {
+			if (fprintf(f,
+				    METRIC_PREFIX "tick_latency_seconds"
+						  "{stage=\"%s\",quantile=\"%s\"} "
+						  "%.6f\n",
+				    stage_names[stage], values[i].name,
+				    values[i].value_us / 1e6) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Only fans with a tachometer reading have these.
+static int write_tachs(FILE *f, const struct zone_table *zones,
+		       const char *name, const char *help, bool stalled)
+{
+	if (fprintf(f,
+		    "# HELP " METRIC_PREFIX "%s %s\n"
+		    "# TYPE " METRIC_PREFIX "%s gauge\n",
+		    name, help, name) < 0) {
+		return -1;
+	}
+	for (int i = 0; i < zones->fan_count; i++) {
+		const struct fan *fan = &zones->fans[i];
+		if (fan->tach.rpm == TACH_RPM_UNKNOWN) {
+			continue;
+		}
+		if (fprintf(f, METRIC_PREFIX "%s{fan=\"%s/%s\"} %ld\n", name,
+			    fan->name, fan->node,
+			    stalled ? (long)fan->tach.stalled
+				    : fan->tach.rpm) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int write_temps(FILE *f, const struct zone_table *zones,
+		       const char *name, const char *help, bool filtered)
+{
+	if (fprintf(f,
+		    "# HELP " METRIC_PREFIX "%s %s\n"
+		    "# TYPE " METRIC_PREFIX "%s gauge\n",
+		    name, help, name) < 0) {
+		return -1;
+	}
+	for (int i = 0; i < zones->sensor_count; i++) {
+		const struct sensor *sensor = &zones->sensors[i];
+		long value = filtered ? sensor->filtered : sensor->temp;
+		long temp = value < 0 ? -value : value;
+		if (fprintf(f,
+			    METRIC_PREFIX "%s{sensor=\"%s/%s\"} %s%ld.%03ld\n",
+			    name, sensor->name, sensor->node,
+			    value < 0 ? "-" : "", temp / 1000,
+			    temp % 1000) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int write_metrics(FILE *f, const struct telemetry *telemetry,
+			 const struct zone_table *zones)
+{
+	uint64_t ticks = __atomic_load_n(&telemetry->head, __ATOMIC_ACQUIRE);
+
+	if (write_counter(f, "ticks_total", "Control ticks run.", ticks) < 0 ||
+	    write_counter(f, "tick_errors_total",
+			  "Control ticks that failed.",
+			  telemetry->tick_errors) < 0 ||
+	    write_counter(f, "device_losses_total",
+			  "Times a sensor or fan went away.",
+			  telemetry->device_losses) < 0 ||
+	    write_counter(f, "reloads_total", "Configuration reloads.",
+			  telemetry->reloads) < 0 ||
+	    write_counter(f, "emergencies_total",
+			  "Times a trip point forced full speed.",
+			  telemetry->emergencies) < 0 ||
+	    write_counter(f, "throttle_events_total",
+			  "Times the cpus started being throttled.",
+			  telemetry->throttle_events) < 0 ||
+	    write_counter(f, "pwm_writes_total", "Writes to pwm attributes.",
+			  zones->stats.writes) < 0 ||
+	    write_counter(f, "pwm_writes_skipped_total",
+			  "Fan updates that left pwm unchanged.",
+			  zones->stats.skipped_writes) < 0 ||
+	    write_counter(f, "pwm_overrides_total",
+			  "Times another writer changed a pwm attribute.",
+			  zones->stats.overrides) < 0 ||
+	    write_counter(f, "fan_stalls_total",
+			  "Times a driven fan stopped turning.",
+			  zones->stats.stalls) < 0 ||
+	    write_counter(f, "fan_kicks_total",
+			  "Kick-start pulses given to stopped fans.",
+			  zones->stats.kicks) < 0) {
+		return -1;
+	}
+	long shift = zones->curve_shift;
+	if (fprintf(f,
+		    "# HELP " METRIC_PREFIX "throttled_seconds_total "
+		    "Time the cpus spent throttled.\n"
+		    "# TYPE " METRIC_PREFIX "throttled_seconds_total counter\n"
+		    METRIC_PREFIX "throttled_seconds_total %llu.%03llu\n"
+		    "# HELP " METRIC_PREFIX "throttled "
+		    "1 while the cpus are throttled.\n"
+		    "# TYPE " METRIC_PREFIX "throttled gauge\n"
+		    METRIC_PREFIX "throttled %d\n"
+		    "# HELP " METRIC_PREFIX "curve_shift_celsius "
+		    "How far auto-tune lowered the curves.\n"
+		    "# TYPE " METRIC_PREFIX "curve_shift_celsius gauge\n"
+		    METRIC_PREFIX "curve_shift_celsius %ld.%03ld\n"
+		    "# HELP " METRIC_PREFIX "frequency_cap_ratio "
+		    "Share of the cpufreq range capped off for cooling.\n"
+		    "# TYPE " METRIC_PREFIX "frequency_cap_ratio gauge\n"
+		    METRIC_PREFIX "frequency_cap_ratio %d.%03d\n",
+		    (unsigned long long)telemetry->throttled_ms / 1000,
+		    (unsigned long long)telemetry->throttled_ms % 1000,
+		    telemetry->throttled, shift / 1000, shift % 1000,
+		    (int)(telemetry->frequency_cap_permille / 1000),
+		    (int)(telemetry->frequency_cap_permille % 1000)) < 0) {
+		return -1;
+	}
+
+	if (write_temps(f, zones, "temperature_celsius",
+			"Last sensor reading.", false) ||
+	    write_temps(f, zones, "filtered_temperature_celsius",
+			"Last sensor reading after its filter.", true)) {
+		return -1;
+	}
+	if (fprintf(f, "# HELP " METRIC_PREFIX "fan_pwm "
+		       "Last value written to pwm.\n"
+		       "# TYPE " METRIC_PREFIX "fan_pwm gauge\n") < 0) {
+		return -1;
+	}
+	for (int i = 0; i < zones->fan_count; i++) {
+		const struct fan *fan = &zones->fans[i];
+		if (fprintf(f, METRIC_PREFIX "fan_pwm{fan=\"%s/%s\"} %d\n",
+			    fan->name, fan->node, fan->speed) < 0) {
+			return -1;
+		}
+	}
+	if (write_tachs(f, zones, "fan_rpm", "Last tachometer reading.",
+			false) ||
+	    write_tachs(f, zones, "fan_stalled",
+			"1 while a driven fan doesn't turn.", true)) {
+		return -1;
+	}
+	const struct telemetry_sample *latest = telemetry_latest(telemetry);
+	if (latest &&
+	    fprintf(f,
+		    "# HELP " METRIC_PREFIX "sample_interval_seconds "
+		    "Delay the scheduler picked after the last tick.\n"
+		    "# TYPE " METRIC_PREFIX "sample_interval_seconds gauge\n"
+		    METRIC_PREFIX "sample_interval_seconds %d.%03d\n",
+		    latest->interval_ms / 1000, latest->interval_ms % 1000) <
+		    0) {
+		return -1;
+	}
+
+	if (write_quantiles(f, telemetry)) {
+		return -1;
+	}
+
+	if (fprintf(f, "# HELP " METRIC_PREFIX "wake_to_write_seconds "
+		       "Time from the wakeup to the last fan write.\n"
+		       "# TYPE " METRIC_PREFIX "wake_to_write_seconds "
+		       "histogram\n") < 0) {
+		return -1;
+	}
+	uint64_t cumulative = 0;
+	for (int i = 0; i < TELEMETRY_LATENCY_BUCKETS - 1; i++) {
+		cumulative += telemetry->latency_buckets[i];
+		if (fprintf(f,
+			    METRIC_PREFIX
+			    "wake_to_write_seconds_bucket{le=\"%.6f\"} %llu\n",
+			    (1u << i) / 1e6, (unsigned long long)cumulative) <
+		    0) {
+			return -1;
+		}
+	}
+	if (fprintf(f,
+		    METRIC_PREFIX
+		    "wake_to_write_seconds_bucket{le=\"+Inf\"} %llu\n" METRIC_PREFIX
+		    "wake_to_write_seconds_sum %.6f\n" METRIC_PREFIX
+		    "wake_to_write_seconds_count %llu\n",
+		    (unsigned long long)ticks, telemetry->latency_sum_us / 1e6,
+		    (unsigned long long)ticks) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int telemetry_write_textfile(const struct telemetry *telemetry,
+			     const struct zone_table *zones, const char *path)
+{
+	char tmp_path[TELEMETRY_PATH_SIZE + 4];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+	    (int)sizeof(tmp_path)) {
+		fprintf(stderr, "telemetry path too long\n");
+		return -1;
+	}
+
+	FILE *f = fopen(tmp_path, "w");
+	if (!f) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", tmp_path,
+			strerror(errno));
+		return -1;
+	}
+	int status = 0;
+	if (write_metrics(f, telemetry, zones)) {
+		log_fail("write_metrics", __FILE__, __LINE__);
+		status = -1;
+	}
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		status = -1;
+	}
+	// node_exporter must never read a half-written file.
+	if (!status && rename(tmp_path, path)) {
+		perror("rename() failed");
+		status = -1;
+	}
+	if (status) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_trace_line(FILE *f, const struct telemetry_sample *sample)
+{
+	int pwm = 0;
+	for (int i = 0; i < MAX_FANS; i++) {
+		if (sample->fan_speeds[i] > pwm) {
+			pwm = sample->fan_speeds[i];
+		}
+	}
+	if (fprintf(f, "%llu %u %u %d", (unsigned long long)sample->time_ms,
+		    sample->load_permille, sample->freq_permille, pwm) < 0) {
+		return -1;
+	}
+	for (int i = 0; i < sample->sensor_count; i++) {
+		if (fprintf(f, " %d", sample->temps[i]) < 0) {
+			return -1;
+		}
+	}
+
+	return fputc('\n', f) == EOF ? -1 : 0;
+}
+
+int telemetry_append_trace(struct telemetry *telemetry, const char *path)
+{
+	uint64_t head = __atomic_load_n(&telemetry->head, __ATOMIC_ACQUIRE);
+	uint64_t first = telemetry->trace_head;
+	if (head - first > TELEMETRY_SAMPLES) {
+		fprintf(stderr, "trace lost %llu samples\n",
+			(unsigned long long)(head - first - TELEMETRY_SAMPLES));
+		first = head - TELEMETRY_SAMPLES;
+	}
+
+	FILE *f = fopen(path, "a");
+	if (!f) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	int status = 0;
+	if (ftell(f) == 0 &&
+	    fputs("# time_ms load freq pwm temp...\n", f) == EOF) {
+		status = -1;
+	}
+	for (uint64_t i = first; !status && i < head; i++) {
+		status = write_trace_line(
+			f, &telemetry->samples[i & (TELEMETRY_SAMPLES - 1)]);
+	}
+	if (status) {
+		perror("writing the trace failed");
+	}
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		status = -1;
+	}
+	if (!status) {
+		telemetry->trace_head = head;
+	}
+
+	return status;
+}
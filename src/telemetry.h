@@ -0,0 +1,114 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "zone.h"
+
+#define TELEMETRY_PATH_SIZE 128
+// A power of two, so the head wraps with a mask.
+#define TELEMETRY_SAMPLES 256
+// Tick durations up to 2^(TELEMETRY_LATENCY_BUCKETS - 1) microseconds, the
+// last bucket takes everything slower.
+#define TELEMETRY_LATENCY_BUCKETS 16
+
+// One control tick: what was read and what was decided.
+struct telemetry_sample {
+	// CLOCK_MONOTONIC at the start of the tick.
+	uint64_t time_ms;
+	// Hottest sensor, millidegrees Celsius.
+	int32_t temp;
+	// CLOCK_MONOTONIC_RAW microseconds from the wakeup to the end of the
+	// sensor reads, the curve evaluation and the fan writes.
+	uint32_t read_us;
+	uint32_t eval_us;
+	uint32_t write_us;
+	// How late the timer woke the loop, -1 when a sensor or uevent did.
+	int32_t jitter_us;
+	int32_t interval_ms;
+	// Load inputs in thousandths, 0 when not measured.
+	uint16_t load_permille;
+	uint16_t freq_permille;
+	uint8_t fan_speeds[MAX_FANS];
+	uint8_t sensor_count;
+	int32_t temps[MAX_SENSORS];
+};
+
+enum telemetry_stage {
+	TELEMETRY_STAGE_READ,
+	TELEMETRY_STAGE_EVAL,
+	TELEMETRY_STAGE_WRITE,
+	TELEMETRY_STAGE_JITTER,
+	TELEMETRY_STAGE_COUNT,
+};
+
+// Over the samples still in the ring, in microseconds.
+struct telemetry_quantiles {
+	int count;
+	uint32_t p50;
+	uint32_t p99;
+	uint32_t max;
+};
+
+// Filled in place by the control loop, which only stores to memory, and
+// read out on the slow telemetry timer. head counts every sample ever
+// recorded and is published with a release store after its slot is
+// complete, so a reader elsewhere sees whole samples.
+struct telemetry {
+	uint64_t head;
+	struct telemetry_sample samples[TELEMETRY_SAMPLES];
+	uint64_t tick_errors;
+	uint64_t device_losses;
+	uint64_t reloads;
+	// Times the emergency watcher took the fans over.
+	uint64_t emergencies;
+	// Times the kernel started throttling the cpus, and for how long
+	// they were throttled in total.
+	uint64_t throttle_events;
+	uint64_t throttled_ms;
+	bool throttled;
+	// Share of the cpufreq range the cooperative governor holds back.
+	int32_t frequency_cap_permille;
+	// Wake-to-write latency since startup.
+	uint64_t latency_buckets[TELEMETRY_LATENCY_BUCKETS];
+	uint64_t latency_sum_us;
+	uint32_t latency_max_us;
+	uint32_t jitter_max_us;
+	// First sample not yet appended to the trace file.
+	uint64_t trace_head;
+};
+
+// Stage timestamps come from the raw clock so that NTP slewing does not
+// show up as latency.
+static inline uint64_t telemetry_now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void telemetry_init(struct telemetry *telemetry);
+void telemetry_record(struct telemetry *telemetry,
+		      const struct telemetry_sample *sample);
+// Returns the most recent sample, or NULL before the first one.
+const struct telemetry_sample *
+telemetry_latest(const struct telemetry *telemetry);
+void telemetry_quantiles(const struct telemetry *telemetry,
+			 enum telemetry_stage stage,
+			 struct telemetry_quantiles *out_quantiles);
+// Prints p50, p99 and max wake-to-write latency and timer jitter.
+void telemetry_print_latency(const struct telemetry *telemetry);
+// Writes counters, the latest readings and the tick duration histogram in
+// the Prometheus text format, for node_exporter's textfile collector.
+// Replaces path atomically.
+int telemetry_write_textfile(const struct telemetry *telemetry,
+			     const struct zone_table *zones, const char *path);
+// Appends the samples recorded since the last call to path, in the format
+// --replay reads: one line per tick of TIME_MS LOAD FREQ PWM TEMP...,
+// load and freq in thousandths, PWM the fastest fan and one temperature
+// per sensor. Samples that fell out of the ring in between are lost.
+int telemetry_append_trace(struct telemetry *telemetry, const char *path);
+
+#endif
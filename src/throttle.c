@@ -0,0 +1,201 @@
+#include "throttle.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "governor.h"
+#include "log.h"
+
+#define COOLING_TYPE_SIZE 64
+
+static int open_at(int dir_fd, const char *entry, const char *node)
+{
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", entry, node) >=
+	    (int)sizeof(path)) {
+		fprintf(stderr, "path too long: %s/%s\n", entry, node);
+		return -1;
+	}
+	int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "openat(%s) failed: %s\n", path,
+			strerror(errno));
+	}
+	return fd;
+}
+
+static void open_policies(struct throttle *throttle)
+{
+	DIR *dir = opendir(CPUFREQ_DIR_PATH);
+	if (!dir) {
+		perror("opendir(" CPUFREQ_DIR_PATH ") failed");
+		return;
+	}
+	errno = 0;
+	for (struct dirent *dir_entry = readdir(dir); dir_entry;
+	     dir_entry = readdir(dir)) {
+		if (strncmp(dir_entry->d_name, "policy", 6)) {
+			continue;
+		}
+		if (throttle->policy_count == CPUFREQ_MAX_POLICIES) {
+			fprintf(stderr, "too many cpufreq policies\n");
+			break;
+		}
+		struct throttle_policy *policy =
+			&throttle->policies[throttle->policy_count];
+		policy->id = 0;
+		sscanf(dir_entry->d_name, "policy%d", &policy->id);
+		policy->max_freq_fd =
+			open_at(dirfd(dir), dir_entry->d_name,
+				"scaling_max_freq");
+		if (policy->max_freq_fd < 0) {
+			log_fail("open_at", __FILE__, __LINE__);
+			errno = 0;
+			continue;
+		}
+		if (read_value(policy->max_freq_fd, throttle->value_str,
+			       sizeof(throttle->value_str),
+			       &policy->baseline)) {
+			log_fail("read_value", __FILE__, __LINE__);
+			close(policy->max_freq_fd);
+			errno = 0;
+			continue;
+		}
+		throttle->policy_count++;
+	}
+	if (errno) {
+		perror("readdir() failed");
+	}
+	if (closedir(dir)) {
+		perror("closedir(" CPUFREQ_DIR_PATH ") failed");
+	}
+}
+
+// pwm-fan registers the fan itself as a cooling device, and its state is
+// what this daemon writes, not throttling.
+static bool is_fan(int dir_fd, const char *entry)
+{
+	char type[COOLING_TYPE_SIZE];
+	int fd = open_at(dir_fd, entry, "type");
+	if (fd < 0) {
+		return false;
+	}
+	ssize_t r = read(fd, type, sizeof(type) - 1);
+	if (r < 0) {
+		perror("read() failed");
+	}
+	if (close(fd) < 0) {
+		perror("close() failed");
+	}
+	type[r > 0 ? r : 0] = '\0';
+	return strstr(type, "fan") != NULL;
+}
+
+static void open_cooling_devices(struct throttle *throttle)
+{
+	DIR *dir = opendir(THERMAL_DIR_PATH);
+	if (!dir) {
+		perror("opendir(" THERMAL_DIR_PATH ") failed");
+		return;
+	}
+	errno = 0;
+	for (struct dirent *dir_entry = readdir(dir); dir_entry;
+	     dir_entry = readdir(dir)) {
+		if (strncmp(dir_entry->d_name, "cooling_device", 14) ||
+		    is_fan(dirfd(dir), dir_entry->d_name)) {
+			errno = 0;
+			continue;
+		}
+		if (throttle->device_count == THROTTLE_MAX_DEVICES) {
+			fprintf(stderr, "too many cooling devices\n");
+			break;
+		}
+		int fd = open_at(dirfd(dir), dir_entry->d_name, "cur_state");
+		if (fd < 0) {
+			log_fail("open_at", __FILE__, __LINE__);
+			errno = 0;
+			continue;
+		}
+		throttle->device_fds[throttle->device_count++] = fd;
+	}
+	if (errno) {
+		perror("readdir() failed");
+	}
+	if (closedir(dir)) {
+		perror("closedir(" THERMAL_DIR_PATH ") failed");
+	}
+}
+
+int throttle_open(struct throttle *throttle)
+{
+	memset(throttle, 0, sizeof(*throttle));
+
+	open_policies(throttle);
+	open_cooling_devices(throttle);
+	if (!throttle->policy_count && !throttle->device_count) {
+		fprintf(stderr, "nothing to watch for throttling\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void throttle_close(struct throttle *throttle)
+{
+	for (int i = 0; i < throttle->policy_count; i++) {
+		if (close(throttle->policies[i].max_freq_fd) < 0) {
+			perror("close() failed");
+		}
+	}
+	for (int i = 0; i < throttle->device_count; i++) {
+		if (close(throttle->device_fds[i]) < 0) {
+			perror("close() failed");
+		}
+	}
+	throttle->policy_count = 0;
+	throttle->device_count = 0;
+	throttle->throttled = false;
+}
+
+int throttle_read(struct throttle *throttle,
+		  const struct governor *governor)
+{
+	bool throttled = false;
+
+	for (int i = 0; i < throttle->policy_count; i++) {
+		struct throttle_policy *policy = &throttle->policies[i];
+		long long max_freq = 0;
+		if (read_value(policy->max_freq_fd, throttle->value_str,
+			       sizeof(throttle->value_str), &max_freq)) {
+			log_fail("read_value", __FILE__, __LINE__);
+			return -1;
+		}
+		if (max_freq > policy->baseline) {
+			policy->baseline = max_freq;
+		}
+		long long limit = policy->baseline;
+		long long cap = governor ? governor_policy_cap(governor,
+							      policy->id)
+					 : LLONG_MAX;
+		throttled |= max_freq < (cap < limit ? cap : limit);
+	}
+	for (int i = 0; i < throttle->device_count; i++) {
+		long long state = 0;
+		if (read_value(throttle->device_fds[i], throttle->value_str,
+			       sizeof(throttle->value_str), &state)) {
+			log_fail("read_value", __FILE__, __LINE__);
+			return -1;
+		}
+		throttled |= state > 0;
+	}
+
+	bool started = throttled && !throttle->throttled;
+	throttle->throttled = throttled;
+	return started;
+}
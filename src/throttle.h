@@ -0,0 +1,45 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdbool.h>
+
+#include "cpufreq.h"
+#include "hwmon.h"
+
+#define THROTTLE_MAX_DEVICES 16
+// How far one throttle event lowers the curves with auto-tune on.
+#define THROTTLE_TUNE_STEP 1000
+
+struct governor;
+
+struct throttle_policy {
+	// N of policyN.
+	int id;
+	int max_freq_fd;
+	// Highest scaling_max_freq seen, anything below it is a cap.
+	long long baseline;
+};
+
+// Watches for the kernel slowing the cpus down to cool them: a cpufreq
+// policy whose scaling_max_freq drops below what it was, or a thermal
+// cooling device other than a fan with a non-zero cur_state. Neither
+// shows up in the temperatures until the throughput is already lost.
+struct throttle {
+	int policy_count;
+	struct throttle_policy policies[CPUFREQ_MAX_POLICIES];
+	int device_count;
+	int device_fds[THROTTLE_MAX_DEVICES];
+	char value_str[SYSFS_VALUE_SIZE];
+	bool throttled;
+};
+
+// Fails only if there is nothing at all to watch.
+int throttle_open(struct throttle *throttle);
+void throttle_close(struct throttle *throttle);
+// Returns 1 when throttling starts, 0 while it goes on or stays off, -1
+// on error. The caps governor holds the policies to are the daemon's own
+// and don't count, governor may be NULL.
+int throttle_read(struct throttle *throttle,
+		  const struct governor *governor);
+
+#endif
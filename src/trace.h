@@ -0,0 +1,27 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Build with -DUSDT, which needs systemtap's <sys/sdt.h>, to place USDT
+// probes at every stage of a tick, for example
+//   bpftrace -e 'usdt:./rockpro64fanadjust:tick_write { print(arg0); }'
+// Arguments are microseconds since the wakeup, tick_wake gets the timer
+// jitter. Without USDT the probes compile away.
+#ifdef USDT
+#include <sys/sdt.h>
+
+#define TRACE_TICK_WAKE(jitter_us) \
+	DTRACE_PROBE1(rockpro64fanadjust, tick_wake, jitter_us)
+#define TRACE_TICK_READ(read_us) \
+	DTRACE_PROBE1(rockpro64fanadjust, tick_read, read_us)
+#define TRACE_TICK_EVAL(eval_us) \
+	DTRACE_PROBE1(rockpro64fanadjust, tick_eval, eval_us)
+#define TRACE_TICK_WRITE(write_us) \
+	DTRACE_PROBE1(rockpro64fanadjust, tick_write, write_us)
+#else
+#define TRACE_TICK_WAKE(jitter_us) ((void)(jitter_us))
+#define TRACE_TICK_READ(read_us) ((void)(read_us))
+#define TRACE_TICK_EVAL(eval_us) ((void)(eval_us))
+#define TRACE_TICK_WRITE(write_us) ((void)(write_us))
+#endif
+
+#endif
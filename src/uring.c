@@ -0,0 +1,227 @@
+#include "uring.h"
+
+#ifdef IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg,
+			     unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *ring_field(void *ring, unsigned offset)
+{
+	return (char *)ring + offset;
+}
+
+int uring_open(struct uring *ring)
+{
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = io_uring_setup(URING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		perror("io_uring_setup() failed");
+		return -1;
+	}
+
+	ring->sq_ring_size =
+		params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes +
+			     params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP &&
+	    ring->cq_ring_size > ring->sq_ring_size) {
+		ring->sq_ring_size = ring->cq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		perror("mmap() failed");
+		ring->sq_ring = NULL;
+		goto cleanup;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			perror("mmap() failed");
+			ring->cq_ring = NULL;
+			goto cleanup;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		perror("mmap() failed");
+		ring->sqes = NULL;
+		goto cleanup;
+	}
+
+	ring->sq_head = ring_field(ring->sq_ring, params.sq_off.head);
+	ring->sq_tail = ring_field(ring->sq_ring, params.sq_off.tail);
+	ring->sq_mask = ring_field(ring->sq_ring, params.sq_off.ring_mask);
+	ring->sq_array = ring_field(ring->sq_ring, params.sq_off.array);
+	ring->cq_head = ring_field(ring->cq_ring, params.cq_off.head);
+	ring->cq_tail = ring_field(ring->cq_ring, params.cq_off.tail);
+	ring->cq_mask = ring_field(ring->cq_ring, params.cq_off.ring_mask);
+	ring->cqes = ring_field(ring->cq_ring, params.cq_off.cqes);
+
+	return 0;
+
+cleanup:
+	uring_close(ring);
+
+	return -1;
+}
+
+void uring_close(struct uring *ring)
+{
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->fd >= 0 && close(ring->fd) < 0) {
+		perror("close() failed");
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+int uring_register(struct uring *ring, const int *fds, unsigned fd_count,
+		   const struct iovec *buffers, unsigned buffer_count)
+{
+	if (buffer_count > URING_ENTRIES) {
+		fprintf(stderr, "too many buffers to register: %u\n",
+			buffer_count);
+		return -1;
+	}
+	if (ring->registered) {
+		// Failing to unregister only means nothing was registered.
+		io_uring_register(ring->fd, IORING_UNREGISTER_FILES, NULL, 0);
+		io_uring_register(ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		ring->registered = false;
+	}
+	if (io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, fd_count) <
+	    0) {
+		perror("io_uring_register() failed");
+		return -1;
+	}
+	if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, buffers,
+			      buffer_count) < 0) {
+		perror("io_uring_register() failed");
+		io_uring_register(ring->fd, IORING_UNREGISTER_FILES, NULL, 0);
+		return -1;
+	}
+	memcpy(ring->buffers, buffers, buffer_count * sizeof(*buffers));
+	ring->buffer_count = buffer_count;
+	ring->registered = true;
+
+	return 0;
+}
+
+static void queue(struct uring *ring, const struct uring_op *op,
+		  unsigned index)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned slot = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = (int)op->file;
+	sqe->addr = (uintptr_t)ring->buffers[op->buffer].iov_base;
+	sqe->len = op->length;
+	sqe->buf_index = (uint16_t)op->buffer;
+	sqe->user_data = index;
+	ring->sq_array[slot] = slot;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned reap(struct uring *ring, struct uring_op *ops, unsigned count)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned reaped = 0;
+
+	for (; head != tail; head++, reaped++) {
+		const struct io_uring_cqe *cqe =
+			&ring->cqes[head & *ring->cq_mask];
+		if (cqe->user_data < count) {
+			ops[cqe->user_data].result = cqe->res;
+		}
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return reaped;
+}
+
+int uring_run(struct uring *ring, struct uring_op *ops, unsigned count)
+{
+	if (count > URING_ENTRIES) {
+		fprintf(stderr, "too many queued operations: %u\n", count);
+		return -1;
+	}
+	for (unsigned i = 0; i < count; i++) {
+		if (ops[i].buffer >= ring->buffer_count ||
+		    ops[i].length > ring->buffers[ops[i].buffer].iov_len) {
+			fprintf(stderr, "operation %u is outside its buffer\n",
+				i);
+			return -1;
+		}
+		ops[i].result = -ECANCELED;
+		queue(ring, &ops[i], i);
+	}
+
+	unsigned submitted = 0;
+	unsigned completed = 0;
+	while (completed < count) {
+		int r = io_uring_enter(ring->fd, count - submitted,
+				       count - completed,
+				       IORING_ENTER_GETEVENTS);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("io_uring_enter() failed");
+			return -1;
+		}
+		submitted += (unsigned)r;
+		completed += reap(ring, ops, count);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 32
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// A minimal io_uring on top of the raw syscalls, just enough to submit a
+// tick's worth of fixed-buffer reads and writes on registered files and
+// wait for all of them with a single io_uring_enter().
+struct uring {
+	int fd;
+	bool registered;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned buffer_count;
+	struct iovec buffers[URING_ENTRIES];
+};
+
+struct uring_op {
+	bool write;
+	// Indices into the registered files and buffers.
+	unsigned file;
+	unsigned buffer;
+	unsigned length;
+	// Bytes transferred, or a negative errno.
+	int result;
+};
+
+// Build with -DIO_URING to batch sensor reads and fan writes through
+// io_uring. Without it, or on a kernel that lacks io_uring,
+// uring_open() fails and callers stay on pread() and write().
+#ifdef IO_URING
+int uring_open(struct uring *ring);
+void uring_close(struct uring *ring);
+// Replaces whatever was registered before. Every fd must be open, the
+// buffers must stay valid until the next call or uring_close().
+int uring_register(struct uring *ring, const int *fds, unsigned fd_count,
+		   const struct iovec *buffers, unsigned buffer_count);
+// Submits every op and waits until all of them completed. Fails only if
+// the ring itself does, per-op errors are left in result.
+int uring_run(struct uring *ring, struct uring_op *ops, unsigned count);
+#else
+static inline int uring_open(struct uring *ring)
+{
+	ring->fd = -1;
+	ring->registered = false;
+	return -1;
+}
+
+static inline void uring_close(struct uring *ring)
+{
+	(void)ring;
+}
+
+static inline int uring_register(struct uring *ring, const int *fds,
+				 unsigned fd_count,
+				 const struct iovec *buffers,
+				 unsigned buffer_count)
+{
+	(void)ring;
+	(void)fds;
+	(void)fd_count;
+	(void)buffers;
+	(void)buffer_count;
+	return -1;
+}
+
+static inline int uring_run(struct uring *ring, struct uring_op *ops,
+			    unsigned count)
+{
+	(void)ring;
+	(void)ops;
+	(void)count;
+	return -1;
+}
+#endif
+
+static inline bool uring_ready(const struct uring *ring)
+{
+	return ring->fd >= 0 && ring->registered;
+}
+
+#endif
@@ -0,0 +1,1241 @@
+#include "zone.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hwmon.h"
+#include "log.h"
+#include "number.h"
+
+#define DEFAULT_SENSOR_NAME "cpu"
+#define DEFAULT_SENSOR_NODE "temp1_input"
+#define DEFAULT_FAN_NAME "pwmfan"
+#define DEFAULT_FAN_NODE "pwm1"
+
+// Copies str[0, length) into a DEVICE_NAME_SIZE buffer.
+static int copy_name(char *out_name, const char *str, size_t length)
+{
+	if (!length || length >= DEVICE_NAME_SIZE) {
+		fprintf(stderr, "invalid device name: %.*s\n", (int)length,
+			str);
+		return -1;
+	}
+	memcpy(out_name, str, length);
+	out_name[length] = '\0';
+
+	return 0;
+}
+
+// Parses up to count ':'-prefixed integers from str. Returns how many were
+// found, or -1 on garbage.
+static int parse_numbers(const char *str, long *out_values, int count)
+{
+	int found = 0;
+
+	while (*str == ':' && found < count) {
+		long long value = 0;
+		if (parse_long_long(str + 1, &str, &value) || value < LONG_MIN ||
+		    value > LONG_MAX) {
+			fprintf(stderr, "invalid number in %s\n", str);
+			return -1;
+		}
+		out_values[found++] = value;
+	}
+	if (*str != '\0') {
+		fprintf(stderr, "trailing characters: %s\n", str);
+		return -1;
+	}
+
+	return found;
+}
+
+static struct zone *current_zone(struct zone_table *table)
+{
+	if (!table->zone_count && zone_table_add_zone(table, "max")) {
+		return NULL;
+	}
+	return &table->zones[table->zone_count - 1];
+}
+
+void zone_table_init(struct zone_table *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->ring.fd = -1;
+	table->ceiling = MAX_FAN_SPEED;
+}
+
+int zone_table_add_zone(struct zone_table *table, char *spec)
+{
+	if (table->zone_count == MAX_ZONES) {
+		fprintf(stderr, "too many zones, at most %d\n", MAX_ZONES);
+		return -1;
+	}
+	struct zone *zone = &table->zones[table->zone_count];
+	memset(zone, 0, sizeof(*zone));
+
+	size_t length = strcspn(spec, ":");
+	if (!strncmp(spec, "max", length) && length == 3) {
+		zone->combine = ZONE_COMBINE_MAX;
+	} else if (!strncmp(spec, "weighted", length) && length == 8) {
+		zone->combine = ZONE_COMBINE_WEIGHTED;
+	} else if (!strncmp(spec, "curve", length) && length == 5) {
+		zone->combine = ZONE_COMBINE_CURVE;
+	} else {
+		fprintf(stderr, "unknown zone combine mode: %.*s\n",
+			(int)length, spec);
+		return -1;
+	}
+
+	long values[3];
+	int found = parse_numbers(spec + length, values, 3);
+	if (found < 0) {
+		log_fail("parse_numbers", __FILE__, __LINE__);
+		return -1;
+	}
+	if (found) {
+		if (found != 3) {
+			fprintf(stderr, "zone curve needs min_temp, max_temp "
+					"and min_fan_speed\n");
+			return -1;
+		}
+		zone->has_curve = true;
+		zone->min_temp = values[0];
+		zone->max_temp = values[1];
+		if (values[2] < 0 || values[2] > MAX_FAN_SPEED) {
+			fprintf(stderr, "min_fan_speed must be in [0, %d]\n",
+				MAX_FAN_SPEED);
+			return -1;
+		}
+		zone->min_fan_speed = values[2];
+	}
+	table->zone_count++;
+
+	return 0;
+}
+
+static int find_or_add_sensor(struct zone_table *table,
+			      const struct sensor *sensor)
+{
+	for (int i = 0; i < table->sensor_count; i++) {
+		struct sensor *other = &table->sensors[i];
+		if (other->source == sensor->source &&
+		    !strcmp(other->name, sensor->name) &&
+		    !strcmp(other->node, sensor->node)) {
+			if (sensor->has_filter && other->has_filter &&
+			    memcmp(&sensor->filter_config,
+				   &other->filter_config,
+				   sizeof(sensor->filter_config))) {
+				fprintf(stderr, "%s/%s: conflicting filters\n",
+					sensor->name, sensor->node);
+				return -1;
+			}
+			if (sensor->has_filter) {
+				other->has_filter = true;
+				other->filter_config = sensor->filter_config;
+			}
+			return i;
+		}
+	}
+	if (table->sensor_count == MAX_SENSORS) {
+		fprintf(stderr, "too many sensors, at most %d\n", MAX_SENSORS);
+		return -1;
+	}
+	table->sensors[table->sensor_count] = *sensor;
+	table->sensors[table->sensor_count].fd = -1;
+
+	return table->sensor_count++;
+}
+
+static int add_sensor(struct zone_table *table, struct zone *zone, char *spec)
+{
+	if (zone->sensor_count == ZONE_MAX_SENSORS) {
+		fprintf(stderr, "too many sensors in zone, at most %d\n",
+			ZONE_MAX_SENSORS);
+		return -1;
+	}
+
+	struct sensor sensor = {
+		.source = SENSOR_SOURCE_HWMON,
+		.node = DEFAULT_SENSOR_NODE,
+	};
+	if (!strncmp(spec, "hwmon:", 6)) {
+		spec += 6;
+	} else if (!strncmp(spec, "thermal:", 8)) {
+		sensor.source = SENSOR_SOURCE_THERMAL;
+		strcpy(sensor.node, "temp");
+		spec += 8;
+	}
+	size_t length = strcspn(spec, "/~@:");
+	if (copy_name(sensor.name, spec, length)) {
+		log_fail("copy_name", __FILE__, __LINE__);
+		return -1;
+	}
+	spec += length;
+	if (*spec == '/') {
+		if (sensor.source != SENSOR_SOURCE_HWMON) {
+			fprintf(stderr, "thermal sensors have no nodes\n");
+			return -1;
+		}
+		spec++;
+		length = strcspn(spec, "~@:");
+		if (copy_name(sensor.node, spec, length)) {
+			log_fail("copy_name", __FILE__, __LINE__);
+			return -1;
+		}
+		spec += length;
+	}
+	if (*spec == '~') {
+		const char *end = NULL;
+		if (filter_parse(&sensor.filter_config, spec + 1, &end)) {
+			log_fail("filter_parse", __FILE__, __LINE__);
+			return -1;
+		}
+		sensor.has_filter = true;
+		spec = (char *)end;
+	}
+
+	struct zone_sensor *zone_sensor = &zone->sensors[zone->sensor_count];
+	memset(zone_sensor, 0, sizeof(*zone_sensor));
+	zone_sensor->weight = 1L << ZONE_WEIGHT_FRACTION_BITS;
+	if (*spec == '@') {
+		char *end = NULL;
+		errno = 0;
+		double weight = strtod(spec + 1, &end);
+		if (errno || end == spec + 1 || weight <= 0.0 ||
+		    weight > 1000.0) {
+			fprintf(stderr, "invalid sensor weight: %s\n", spec);
+			return -1;
+		}
+		zone_sensor->weight =
+			(long)(weight * (1L << ZONE_WEIGHT_FRACTION_BITS) + 0.5);
+		spec = end;
+	}
+	long values[2];
+	int found = parse_numbers(spec, values, 2);
+	if (found < 0) {
+		log_fail("parse_numbers", __FILE__, __LINE__);
+		return -1;
+	}
+	if (found) {
+		if (found != 2) {
+			fprintf(stderr,
+				"sensor curve needs min_temp and max_temp\n");
+			return -1;
+		}
+		zone_sensor->has_curve = true;
+		zone_sensor->min_temp = values[0];
+		zone_sensor->max_temp = values[1];
+	}
+
+	zone_sensor->sensor = find_or_add_sensor(table, &sensor);
+	if (zone_sensor->sensor < 0) {
+		log_fail("find_or_add_sensor", __FILE__, __LINE__);
+		return -1;
+	}
+	zone->sensor_count++;
+
+	return 0;
+}
+
+int zone_table_add_sensor(struct zone_table *table, char *spec)
+{
+	struct zone *zone = current_zone(table);
+	if (!zone) {
+		log_fail("current_zone", __FILE__, __LINE__);
+		return -1;
+	}
+
+	return add_sensor(table, zone, spec);
+}
+
+static int add_fan(struct zone_table *table, struct zone *zone, char *spec)
+{
+	struct fan fan = {
+		.node = DEFAULT_FAN_NODE,
+		.fd = -1,
+		.tach_fd = -1,
+	};
+	tach_reset(&fan.tach);
+	size_t length = strcspn(spec, "/");
+	if (copy_name(fan.name, spec, length)) {
+		log_fail("copy_name", __FILE__, __LINE__);
+		return -1;
+	}
+	if (spec[length] == '/' &&
+	    copy_name(fan.node, spec + length + 1, strlen(spec + length + 1))) {
+		log_fail("copy_name", __FILE__, __LINE__);
+		return -1;
+	}
+
+	int index = 0;
+	while (index < table->fan_count &&
+	       (strcmp(table->fans[index].name, fan.name) ||
+		strcmp(table->fans[index].node, fan.node))) {
+		index++;
+	}
+	if (index == table->fan_count) {
+		if (table->fan_count == MAX_FANS) {
+			fprintf(stderr, "too many fans, at most %d\n",
+				MAX_FANS);
+			return -1;
+		}
+		table->fans[table->fan_count++] = fan;
+	}
+	for (int i = 0; i < zone->fan_count; i++) {
+		if (zone->fans[i] == index) {
+			return 0;
+		}
+	}
+	zone->fans[zone->fan_count++] = index;
+
+	return 0;
+}
+
+int zone_table_add_fan(struct zone_table *table, char *spec)
+{
+	struct zone *zone = current_zone(table);
+	if (!zone) {
+		log_fail("current_zone", __FILE__, __LINE__);
+		return -1;
+	}
+
+	return add_fan(table, zone, spec);
+}
+
+static void init_channel(struct zone_channel *channel,
+			 const struct controller_config *defaults,
+			 long min_temp, long max_temp, int min_fan_speed,
+			 long min_interval_ms, long max_interval_ms)
+{
+	channel->config = *defaults;
+	channel->config.min_temp = min_temp;
+	channel->config.max_temp = max_temp;
+	channel->config.min_fan_speed = min_fan_speed;
+	struct curve *curve = &channel->config.curve;
+	if (channel->config.type == CONTROLLER_CURVE && !curve->point_count) {
+		*curve = (struct curve){
+			.point_count = 2,
+			.points = {
+				{ min_temp, min_fan_speed },
+				{ max_temp, MAX_FAN_SPEED },
+			},
+		};
+	} else if (channel->config.type == CONTROLLER_CURVE) {
+		// The scheduler paces sampling by the headroom to the end of
+		// the curve.
+		channel->config.min_temp = curve->points[0].temp;
+		channel->config.max_temp =
+			curve->points[curve->point_count - 1].temp;
+	}
+	if (channel->config.pid_target == PID_TARGET_UNSET) {
+		// Leave a quarter of the ramp as margin below max_temp.
+		channel->config.pid_target =
+			max_temp - (max_temp - min_temp) / 4;
+	}
+	scheduler_init(&channel->scheduler, min_interval_ms, max_interval_ms);
+}
+
+int zone_table_finish(struct zone_table *table,
+		      const struct controller_config *defaults,
+		      const struct slew_config *slew,
+		      const struct tach_config *tach,
+		      const struct filter_config *filter, long min_interval_ms,
+		      long max_interval_ms)
+{
+	table->slew = *slew;
+	table->tach = *tach;
+	if (!table->zone_count && zone_table_add_zone(table, "max")) {
+		log_fail("zone_table_add_zone", __FILE__, __LINE__);
+		return -1;
+	}
+
+	for (int i = 0; i < table->zone_count; i++) {
+		struct zone *zone = &table->zones[i];
+		if (!zone->sensor_count &&
+		    add_sensor(table, zone, DEFAULT_SENSOR_NAME)) {
+			log_fail("add_sensor", __FILE__, __LINE__);
+			return -1;
+		}
+		if (!zone->fan_count && add_fan(table, zone, DEFAULT_FAN_NAME)) {
+			log_fail("add_fan", __FILE__, __LINE__);
+			return -1;
+		}
+		if (!zone->has_curve) {
+			zone->min_temp = defaults->min_temp;
+			zone->max_temp = defaults->max_temp;
+			zone->min_fan_speed = defaults->min_fan_speed;
+		}
+		if (zone->min_temp >= zone->max_temp) {
+			fprintf(stderr, "zone %d: min_temp is >= max_temp\n",
+				i);
+			return -1;
+		}
+
+		if (zone->combine != ZONE_COMBINE_CURVE) {
+			zone->channel_count = 1;
+			init_channel(&zone->channels[0], defaults,
+				     zone->min_temp, zone->max_temp,
+				     zone->min_fan_speed, min_interval_ms,
+				     max_interval_ms);
+			continue;
+		}
+		zone->channel_count = zone->sensor_count;
+		for (int j = 0; j < zone->sensor_count; j++) {
+			struct zone_sensor *zone_sensor = &zone->sensors[j];
+			long min_temp = zone_sensor->has_curve
+						? zone_sensor->min_temp
+						: zone->min_temp;
+			long max_temp = zone_sensor->has_curve
+						? zone_sensor->max_temp
+						: zone->max_temp;
+			if (min_temp >= max_temp) {
+				fprintf(stderr,
+					"zone %d sensor %d: min_temp is >= "
+					"max_temp\n",
+					i, j);
+				return -1;
+			}
+			init_channel(&zone->channels[j], defaults, min_temp,
+				     max_temp, zone->min_fan_speed,
+				     min_interval_ms, max_interval_ms);
+		}
+	}
+	for (int i = 0; i < table->sensor_count; i++) {
+		struct sensor *sensor = &table->sensors[i];
+		if (!sensor->has_filter) {
+			sensor->filter_config = *filter;
+		}
+	}
+
+	return 0;
+}
+
+static enum device_class sensor_class(const struct sensor *sensor)
+{
+	return sensor->source == SENSOR_SOURCE_THERMAL ? DEVICE_CLASS_THERMAL
+						       : DEVICE_CLASS_HWMON;
+}
+
+static bool sensor_present(struct sensor *sensor)
+{
+	return sensor->fd >= 0 && device_present(sensor_class(sensor),
+						 sensor->name,
+						 strlen(sensor->name));
+}
+
+static bool fan_present(struct fan *fan)
+{
+	return fan->fd >= 0 &&
+	       device_present(DEVICE_CLASS_HWMON, fan->name, strlen(fan->name));
+}
+
+static void close_fd(int *fd)
+{
+	if (*fd >= 0 && close(*fd) < 0) {
+		perror("close() failed");
+	}
+	*fd = -1;
+}
+
+// Points the ring at the current fds and buffers, or leaves the table on
+// pread() and write() if the kernel refuses them.
+static void register_ring(struct zone_table *table)
+{
+	int fds[MAX_SENSORS + MAX_FANS];
+	struct iovec buffers[MAX_SENSORS + MAX_FANS];
+	unsigned count = 0;
+
+	if (table->ring.fd < 0) {
+		return;
+	}
+	for (int i = 0; i < table->sensor_count; i++, count++) {
+		struct sensor *sensor = &table->sensors[i];
+		fds[count] = sensor->fd;
+		buffers[count] = (struct iovec){
+			.iov_base = sensor->value_str,
+			.iov_len = sizeof(sensor->value_str),
+		};
+	}
+	for (int i = 0; i < table->fan_count; i++, count++) {
+		struct fan *fan = &table->fans[i];
+		fds[count] = fan->fd;
+		buffers[count] = (struct iovec){
+			.iov_base = fan->value_str,
+			.iov_len = sizeof(fan->value_str),
+		};
+	}
+	if (uring_register(&table->ring, fds, count, buffers, count)) {
+		log_fail("uring_register", __FILE__, __LINE__);
+		fprintf(stderr, "falling back to pread()\n");
+		uring_close(&table->ring);
+	}
+}
+
+// Opens fanN_input in the directory pwmN was found in. Not every pwm-fan
+// has its tachometer wired up, so a missing one is only an error when the
+// closed loop needs it.
+static void open_tach(const struct zone_table *table, struct fan *fan)
+{
+	char path[TACH_PATH_SIZE];
+	const char *number = fan->node + strlen("pwm");
+
+	if (strncmp(fan->node, "pwm", strlen("pwm")) || !*number ||
+	    strspn(number, "0123456789") != strlen(number) ||
+	    fd_path(fan->fd, path, sizeof(path))) {
+		return;
+	}
+	char *node = strrchr(path, '/');
+	if (!node ||
+	    snprintf(node, sizeof(path) - (size_t)(node - path),
+		     "/fan%s_input", number) >=
+		    (int)(sizeof(path) - (size_t)(node - path))) {
+		return;
+	}
+	fan->tach_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fan->tach_fd < 0 && table->tach.max_rpm) {
+		fprintf(stderr, "%s/%s has no tachometer, running open loop\n",
+			fan->name, fan->node);
+	}
+}
+
+// Closes whatever went away and opens everything that is not open, all in
+// a single open_devices() call. Returns -1 if anything is left closed.
+static int open_missing(struct zone_table *table)
+{
+	struct device_request requests[MAX_SENSORS + MAX_FANS];
+	int count = 0;
+
+	for (int i = 0; i < table->sensor_count; i++) {
+		struct sensor *sensor = &table->sensors[i];
+		if (sensor_present(sensor)) {
+			continue;
+		}
+		close_fd(&sensor->fd);
+		requests[count++] = (struct device_request){
+			.class = sensor_class(sensor),
+			.name = sensor->name,
+			.name_length = strlen(sensor->name),
+			.node = sensor->node,
+			.oflag = O_RDONLY,
+		};
+	}
+	int sensor_requests = count;
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		if (fan_present(fan)) {
+			continue;
+		}
+		close_fd(&fan->fd);
+		close_fd(&fan->tach_fd);
+		requests[count++] = (struct device_request){
+			.class = DEVICE_CLASS_HWMON,
+			.name = fan->name,
+			.name_length = strlen(fan->name),
+			.node = fan->node,
+			.oflag = O_RDWR,
+		};
+	}
+	if (!count) {
+		return 0;
+	}
+
+	int status = open_devices(requests, count);
+	int request = 0;
+	for (int i = 0; i < table->sensor_count && request < sensor_requests;
+	     i++) {
+		if (table->sensors[i].fd < 0) {
+			table->sensors[i].fd = requests[request++].fd;
+		}
+	}
+	for (int i = 0; i < table->fan_count && request < count; i++) {
+		struct fan *fan = &table->fans[i];
+		if (fan->fd >= 0) {
+			continue;
+		}
+		fan->fd = requests[request++].fd;
+		fan->speed = MAX_FAN_SPEED;
+		long long speed = 0;
+		if (fan->fd < 0) {
+			continue;
+		}
+		if (read_value(fan->fd, fan->value_str, sizeof(fan->value_str),
+			       &speed)) {
+			log_fail("read_value", __FILE__, __LINE__);
+			close_fd(&fan->fd);
+			status = -1;
+			continue;
+		}
+		fan->speed = speed < 0 || speed > MAX_FAN_SPEED ? MAX_FAN_SPEED
+							       : (int)speed;
+		slew_reset(&fan->slew, fan->speed);
+		tach_reset(&fan->tach);
+		fan->profile.kick_ms = 0;
+		if (tach_enabled(&table->tach)) {
+			open_tach(table, fan);
+		}
+	}
+
+	return status;
+}
+
+static int init_controllers(struct zone_table *table)
+{
+	for (int i = 0; i < table->zone_count; i++) {
+		struct zone *zone = &table->zones[i];
+		for (int j = 0; j < zone->channel_count; j++) {
+			struct zone_channel *channel = &zone->channels[j];
+			if (controller_init(&channel->controller,
+					    &channel->config)) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int zone_table_open(struct zone_table *table)
+{
+	for (int i = 0; i < table->sensor_count; i++) {
+		table->sensors[i].fd = -1;
+	}
+	for (int i = 0; i < table->fan_count; i++) {
+		table->fans[i].fd = -1;
+		table->fans[i].tach_fd = -1;
+	}
+	if (open_missing(table)) {
+		log_fail("open_missing", __FILE__, __LINE__);
+		goto cleanup;
+	}
+	if (!uring_open(&table->ring)) {
+		register_ring(table);
+	}
+	if (init_controllers(table)) {
+		log_fail("init_controllers", __FILE__, __LINE__);
+		goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	zone_table_close(table);
+
+	return -1;
+}
+
+int zone_table_simulate(struct zone_table *table)
+{
+	for (int i = 0; i < table->sensor_count; i++) {
+		table->sensors[i].fd = -1;
+		table->sensors[i].temp = 0;
+		filter_reset(&table->sensors[i].filter);
+	}
+	for (int i = 0; i < table->fan_count; i++) {
+		table->fans[i].fd = -1;
+		table->fans[i].tach_fd = -1;
+	}
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		fan->fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (fan->fd < 0) {
+			perror("open(/dev/null) failed");
+			goto cleanup;
+		}
+		fan->speed = 0;
+		fan->target = 0;
+		slew_reset(&fan->slew, fan->speed);
+		fan->profile.kick_ms = 0;
+	}
+	table->verify_elapsed_ms = 0;
+	table->stats = (struct zone_stats){ 0 };
+	if (init_controllers(table)) {
+		log_fail("init_controllers", __FILE__, __LINE__);
+		goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	zone_table_close(table);
+
+	return -1;
+}
+
+void zone_table_close(struct zone_table *table)
+{
+	for (int i = 0; i < table->fan_count; i++) {
+		close_fd(&table->fans[i].fd);
+		close_fd(&table->fans[i].tach_fd);
+	}
+	for (int i = 0; i < table->sensor_count; i++) {
+		close_fd(&table->sensors[i].fd);
+	}
+	uring_close(&table->ring);
+}
+
+bool zone_table_stale(struct zone_table *table)
+{
+	for (int i = 0; i < table->sensor_count; i++) {
+		if (!sensor_present(&table->sensors[i])) {
+			return true;
+		}
+	}
+	for (int i = 0; i < table->fan_count; i++) {
+		if (!fan_present(&table->fans[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int zone_table_refresh(struct zone_table *table)
+{
+	if (open_missing(table)) {
+		return -1;
+	}
+	register_ring(table);
+
+	return 0;
+}
+
+static struct sensor *find_open_sensor(struct zone_table *table,
+				       const struct sensor *like)
+{
+	for (int i = 0; i < table->sensor_count; i++) {
+		struct sensor *sensor = &table->sensors[i];
+		if (sensor->fd >= 0 && sensor->source == like->source &&
+		    !strcmp(sensor->name, like->name) &&
+		    !strcmp(sensor->node, like->node)) {
+			return sensor;
+		}
+	}
+	return NULL;
+}
+
+static struct fan *find_open_fan(struct zone_table *table,
+				 const struct fan *like)
+{
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		if (fan->fd >= 0 && !strcmp(fan->name, like->name) &&
+		    !strcmp(fan->node, like->node)) {
+			return fan;
+		}
+	}
+	return NULL;
+}
+
+// Moves every open sensor and fan of from that to also lists over to it,
+// together with the last reading and filter state and the fan's shadow
+// and slew state.
+static void adopt_devices(struct zone_table *to, struct zone_table *from)
+{
+	for (int i = 0; i < to->sensor_count; i++) {
+		struct sensor *sensor = &to->sensors[i];
+		struct sensor *old = find_open_sensor(from, sensor);
+		if (sensor->fd >= 0 || !old) {
+			continue;
+		}
+		sensor->fd = old->fd;
+		sensor->temp = old->temp;
+		// A filter that changed starts over from the next reading.
+		if (!memcmp(&sensor->filter_config, &old->filter_config,
+			    sizeof(sensor->filter_config))) {
+			sensor->filter = old->filter;
+			sensor->filtered = old->filtered;
+		}
+		old->fd = -1;
+	}
+	for (int i = 0; i < to->fan_count; i++) {
+		struct fan *fan = &to->fans[i];
+		struct fan *old = find_open_fan(from, fan);
+		if (fan->fd >= 0 || !old) {
+			continue;
+		}
+		fan->fd = old->fd;
+		fan->speed = old->speed;
+		fan->slew = old->slew;
+		fan->tach_fd = old->tach_fd;
+		fan->tach = old->tach;
+		fan->profile.kick_ms = old->profile.kick_ms;
+		old->fd = -1;
+		old->tach_fd = -1;
+	}
+}
+
+int zone_table_reload(struct zone_table *table, struct zone_table *next)
+{
+	for (int i = 0; i < next->sensor_count; i++) {
+		next->sensors[i].fd = -1;
+	}
+	for (int i = 0; i < next->fan_count; i++) {
+		next->fans[i].fd = -1;
+		next->fans[i].tach_fd = -1;
+	}
+	if (init_controllers(next)) {
+		log_fail("init_controllers", __FILE__, __LINE__);
+		return -1;
+	}
+	adopt_devices(next, table);
+	if (open_missing(next)) {
+		log_fail("open_missing", __FILE__, __LINE__);
+		adopt_devices(table, next);
+		zone_table_close(next);
+		return -1;
+	}
+
+	// Zones and channels are matched by position. A channel keeps its
+	// controller and scheduler state as long as its controller type
+	// stays the same.
+	for (int i = 0; i < next->zone_count && i < table->zone_count; i++) {
+		struct zone *zone = &next->zones[i];
+		struct zone *old = &table->zones[i];
+		for (int j = 0;
+		     j < zone->channel_count && j < old->channel_count; j++) {
+			zone->channels[j].controller = old->channels[j].controller;
+			scheduler_adopt(&zone->channels[j].scheduler,
+					&old->channels[j].scheduler);
+		}
+	}
+	next->verify_elapsed_ms = table->verify_elapsed_ms;
+	next->stats = table->stats;
+	next->ring = table->ring;
+	memset(&table->ring, 0, sizeof(table->ring));
+	table->ring.fd = -1;
+	// Whatever is still open in table is no longer configured.
+	zone_table_close(table);
+
+	*table = *next;
+	zone_table_init(next);
+	for (int i = 0; i < table->zone_count; i++) {
+		struct zone *zone = &table->zones[i];
+		for (int j = 0; j < zone->channel_count; j++) {
+			struct zone_channel *channel = &zone->channels[j];
+			struct controller old = channel->controller;
+			// Already checked above, this only repoints the
+			// controller at the config in its final place.
+			controller_init(&channel->controller,
+					&channel->config);
+			controller_adopt(&channel->controller, &old);
+		}
+	}
+	register_ring(table);
+
+	return 0;
+}
+
+void zone_table_lower_curves(struct zone_table *table, long delta)
+{
+	for (int i = 0; i < table->zone_count; i++) {
+		struct zone *zone = &table->zones[i];
+		for (int j = 0; j < zone->channel_count; j++) {
+			struct zone_channel *channel = &zone->channels[j];
+			struct controller_config *config = &channel->config;
+			config->min_temp -= delta;
+			config->max_temp -= delta;
+			config->pid_target -= delta;
+			for (int k = 0; k < config->curve.point_count; k++) {
+				config->curve.points[k].temp -= delta;
+			}
+			// Only rebuilds the lookup table or slope, the
+			// config was valid before and keeps its shape.
+			struct controller old = channel->controller;
+			controller_init(&channel->controller, config);
+			controller_adopt(&channel->controller, &old);
+		}
+	}
+	table->curve_shift += delta;
+}
+
+// Reads every sensor with one io_uring_enter(). Returns 1 if the ring
+// failed as a whole and was closed, so the caller should use pread().
+static int read_ring(struct zone_table *table)
+{
+	struct uring_op ops[MAX_SENSORS];
+
+	for (int i = 0; i < table->sensor_count; i++) {
+		ops[i] = (struct uring_op){
+			.file = i,
+			.buffer = i,
+			.length = SYSFS_VALUE_SIZE - 1,
+		};
+	}
+	if (uring_run(&table->ring, ops, table->sensor_count)) {
+		log_fail("uring_run", __FILE__, __LINE__);
+		fprintf(stderr, "falling back to pread()\n");
+		uring_close(&table->ring);
+		return 1;
+	}
+	for (int i = 0; i < table->sensor_count; i++) {
+		struct sensor *sensor = &table->sensors[i];
+		long long temp = 0;
+		if (ops[i].result < 0) {
+			fprintf(stderr, "reading %s/%s failed: %s\n",
+				sensor->name, sensor->node,
+				strerror(-ops[i].result));
+			return -1;
+		}
+		if (parse_value(sensor->value_str, ops[i].result, &temp)) {
+			fprintf(stderr, "reading %s/%s failed\n", sensor->name,
+				sensor->node);
+			return -1;
+		}
+		sensor->temp = (long)temp;
+	}
+
+	return 0;
+}
+
+static int read_sensors(struct zone_table *table)
+{
+	for (int i = 0; i < table->sensor_count; i++) {
+		struct sensor *sensor = &table->sensors[i];
+		long long temp = 0;
+		if (read_value(sensor->fd, sensor->value_str,
+			       sizeof(sensor->value_str), &temp)) {
+			fprintf(stderr, "reading %s/%s failed\n", sensor->name,
+				sensor->node);
+			return -1;
+		}
+		sensor->temp = (long)temp;
+	}
+
+	return 0;
+}
+
+// A tachometer that can't be read leaves its fan on open loop for the
+// tick instead of failing it.
+static void read_tachs(struct zone_table *table)
+{
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		long long rpm = TACH_RPM_UNKNOWN;
+		if (fan->tach_fd >= 0 &&
+		    read_value(fan->tach_fd, fan->tach_str,
+			       sizeof(fan->tach_str), &rpm)) {
+			rpm = TACH_RPM_UNKNOWN;
+		}
+		fan->tach.rpm = rpm < 0 ? TACH_RPM_UNKNOWN : (long)rpm;
+	}
+}
+
+int zone_table_read(struct zone_table *table)
+{
+	int status = 1;
+
+	if (uring_ready(&table->ring)) {
+		status = read_ring(table);
+	}
+	if (status > 0) {
+		status = read_sensors(table);
+	}
+	if (!status) {
+		read_tachs(table);
+	}
+
+	return status;
+}
+
+static long zone_temp(const struct zone_table *table, const struct zone *zone)
+{
+	long temp = table->sensors[zone->sensors[0].sensor].filtered;
+
+	if (zone->combine == ZONE_COMBINE_WEIGHTED) {
+		int64_t sum = 0;
+		int64_t weights = 0;
+		for (int i = 0; i < zone->sensor_count; i++) {
+			const struct zone_sensor *zone_sensor =
+				&zone->sensors[i];
+			sum += (int64_t)zone_sensor->weight *
+			       table->sensors[zone_sensor->sensor].filtered;
+			weights += zone_sensor->weight;
+		}
+		return (long)(sum / weights);
+	}
+	for (int i = 1; i < zone->sensor_count; i++) {
+		long other = table->sensors[zone->sensors[i].sensor].filtered;
+		if (other > temp) {
+			temp = other;
+		}
+	}
+	return temp;
+}
+
+long zone_table_sensor_min_temp(const struct zone_table *table, int sensor)
+{
+	long min_temp = LONG_MAX;
+
+	for (int i = 0; i < table->zone_count; i++) {
+		const struct zone *zone = &table->zones[i];
+		for (int j = 0; j < zone->sensor_count; j++) {
+			if (zone->sensors[j].sensor != sensor) {
+				continue;
+			}
+			// Per-sensor curves have a channel each, the other
+			// combines share channel 0.
+			int channel = zone->combine == ZONE_COMBINE_CURVE ? j : 0;
+			long channel_min_temp =
+				zone->channels[channel].config.min_temp;
+			if (channel_min_temp < min_temp) {
+				min_temp = channel_min_temp;
+			}
+		}
+	}
+
+	return min_temp;
+}
+
+bool zone_table_idle(const struct zone_table *table, long margin)
+{
+	for (int i = 0; i < table->fan_count; i++) {
+		if (table->fans[i].speed) {
+			return false;
+		}
+	}
+	// A zone's combined temperature is never above its hottest sensor,
+	// so checking each sensor on its own is enough.
+	for (int i = 0; i < table->sensor_count; i++) {
+		if (table->sensors[i].filtered >=
+		    zone_table_sensor_min_temp(table, i) - margin) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+long zone_table_update(struct zone_table *table,
+		       const struct controller_input *shared)
+{
+	long interval_ms = -1;
+
+	for (int i = 0; i < table->sensor_count; i++) {
+		struct sensor *sensor = &table->sensors[i];
+		sensor->filtered = filter_next(&sensor->filter,
+					       &sensor->filter_config,
+					       sensor->temp, shared->dt_ms);
+	}
+	for (int i = 0; i < table->fan_count; i++) {
+		table->fans[i].target = table->floor;
+	}
+	for (int i = 0; i < table->zone_count; i++) {
+		struct zone *zone = &table->zones[i];
+		int speed = 0;
+		int running = 0;
+		for (int j = 0; j < zone->fan_count; j++) {
+			int fan_speed = table->fans[zone->fans[j]].speed;
+			running = fan_speed > running ? fan_speed : running;
+		}
+		for (int j = 0; j < zone->channel_count; j++) {
+			struct zone_channel *channel = &zone->channels[j];
+			struct controller_input input = *shared;
+			input.speed = running;
+			input.temp = zone->combine == ZONE_COMBINE_CURVE
+					     ? table->sensors[zone->sensors[j].sensor]
+						       .filtered
+					     : zone_temp(table, zone);
+			int channel_speed =
+				controller_update(&channel->controller, &input);
+			if (channel_speed > speed) {
+				speed = channel_speed;
+			}
+			long channel_interval_ms =
+				scheduler_next(&channel->scheduler,
+					       &channel->config, input.temp,
+					       input.dt_ms);
+			if (interval_ms < 0 ||
+			    channel_interval_ms < interval_ms) {
+				interval_ms = channel_interval_ms;
+			}
+		}
+		if (speed > table->ceiling) {
+			speed = table->ceiling;
+		}
+		for (int j = 0; j < zone->fan_count; j++) {
+			struct fan *fan = &table->fans[zone->fans[j]];
+			if (speed > fan->target) {
+				fan->target = speed;
+			}
+		}
+	}
+	// The rpm loop mustn't take a fan past the ceiling either, only the
+	// floor may.
+	int ceiling = table->ceiling > table->floor ? table->ceiling
+						    : table->floor;
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		fan->target = slew_next(&fan->slew, &table->slew, fan->target,
+					shared->dt_ms);
+		bool stalled = fan->tach.stalled;
+		// A kick runs at full speed on purpose, so it's no error for
+		// the rpm loop to correct.
+		if (!profile_kicking(&fan->profile)) {
+			fan->target = tach_next(&fan->tach, &table->tach,
+						fan->target, fan->speed,
+						ceiling, shared->dt_ms);
+		}
+		bool kicking = profile_kicking(&fan->profile);
+		fan->target = profile_next(&fan->profile, fan->target,
+					   fan->speed, fan->tach.rpm,
+					   shared->dt_ms);
+		if (profile_kicking(&fan->profile)) {
+			if (!kicking) {
+				table->stats.kicks++;
+			}
+			if (interval_ms < 0 ||
+			    fan->profile.kick_ms < interval_ms) {
+				interval_ms = fan->profile.kick_ms;
+			}
+		}
+		if (fan->tach.stalled && !stalled) {
+			fprintf(stderr, "%s/%s stalled at pwm %d\n", fan->name,
+				fan->node, fan->speed);
+			table->stats.stalls++;
+		} else if (!fan->tach.stalled && stalled) {
+			fprintf(stderr, "%s/%s is turning again\n", fan->name,
+				fan->node);
+		}
+	}
+
+	return interval_ms;
+}
+
+int zone_table_verify(struct zone_table *table, long elapsed_ms)
+{
+	table->verify_elapsed_ms += elapsed_ms;
+	if (table->verify_elapsed_ms < FAN_VERIFY_INTERVAL_MS) {
+		return 0;
+	}
+	table->verify_elapsed_ms = 0;
+
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		long long speed = 0;
+		if (read_value(fan->fd, fan->value_str, sizeof(fan->value_str),
+			       &speed)) {
+			fprintf(stderr, "reading %s/%s failed\n", fan->name,
+				fan->node);
+			return -1;
+		}
+		if (speed != fan->speed) {
+			fprintf(stderr, "%s/%s changed from %d to %lld\n",
+				fan->name, fan->node, fan->speed, speed);
+			table->stats.overrides++;
+			// Anything out of range is certain to be rewritten.
+			fan->speed = speed < 0 || speed > MAX_FAN_SPEED
+					     ? -1
+					     : (int)speed;
+		}
+	}
+
+	return 0;
+}
+
+// Writes every fan that changed with one io_uring_enter(). Same return
+// values as read_ring().
+static int write_ring(struct zone_table *table)
+{
+	struct uring_op ops[MAX_FANS];
+	int fans[MAX_FANS];
+	int count = 0;
+
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		if (fan->speed == fan->target) {
+			continue;
+		}
+		int file = table->sensor_count + i;
+		fans[count] = i;
+		ops[count++] = (struct uring_op){
+			.write = true,
+			.file = file,
+			.buffer = file,
+			.length = format_long_long(fan->target, fan->value_str),
+		};
+	}
+	if (!count) {
+		return 0;
+	}
+	if (uring_run(&table->ring, ops, count)) {
+		log_fail("uring_run", __FILE__, __LINE__);
+		fprintf(stderr, "falling back to write()\n");
+		uring_close(&table->ring);
+		return 1;
+	}
+	for (int i = 0; i < count; i++) {
+		struct fan *fan = &table->fans[fans[i]];
+		if (ops[i].result < 0) {
+			fprintf(stderr, "writing %s/%s failed: %s\n", fan->name,
+				fan->node, strerror(-ops[i].result));
+			return -1;
+		}
+		// A short write is retried whole, like write_fan_speed() does.
+		if (ops[i].result < (int)ops[i].length &&
+		    write_fan_speed(fan->fd, fan->target)) {
+			fprintf(stderr, "writing %s/%s failed\n", fan->name,
+				fan->node);
+			return -1;
+		}
+		fan->speed = fan->target;
+		table->stats.writes++;
+	}
+
+	return 0;
+}
+
+int zone_table_write(struct zone_table *table)
+{
+	// Counted up front, a failed batch falls back to write() for the
+	// same fans.
+	for (int i = 0; i < table->fan_count; i++) {
+		if (table->fans[i].speed == table->fans[i].target) {
+			table->stats.skipped_writes++;
+		}
+	}
+	if (uring_ready(&table->ring)) {
+		int status = write_ring(table);
+		if (status <= 0) {
+			return status;
+		}
+	}
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		if (fan->speed == fan->target) {
+			continue;
+		}
+		if (write_fan_speed(fan->fd, fan->target)) {
+			fprintf(stderr, "writing %s/%s failed\n", fan->name,
+				fan->node);
+			return -1;
+		}
+		fan->speed = fan->target;
+		table->stats.writes++;
+	}
+
+	return 0;
+}
+
+void zone_table_force_max(struct zone_table *table)
+{
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		fan->target = MAX_FAN_SPEED;
+		slew_reset(&fan->slew, MAX_FAN_SPEED);
+	}
+}
+
+void zone_table_write_max(struct zone_table *table)
+{
+	for (int i = 0; i < table->fan_count; i++) {
+		struct fan *fan = &table->fans[i];
+		if (fan->fd >= 0 && !write_fan_speed(fan->fd, MAX_FAN_SPEED)) {
+			fan->speed = MAX_FAN_SPEED;
+		}
+	}
+}
@@ -0,0 +1,213 @@
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "controller.h"
+#include "filter.h"
+#include "hwmon.h"
+#include "number.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "slew.h"
+#include "tach.h"
+#include "uring.h"
+
+#define MAX_SENSORS 16
+#define MAX_FANS 8
+#define MAX_ZONES 8
+#define ZONE_MAX_SENSORS 8
+#define DEVICE_NAME_SIZE 64
+#define ZONE_WEIGHT_FRACTION_BITS 16
+#define FAN_VERIFY_INTERVAL_MS 5000
+
+enum sensor_source {
+	SENSOR_SOURCE_HWMON,
+	SENSOR_SOURCE_THERMAL,
+};
+
+struct sensor {
+	enum sensor_source source;
+	char name[DEVICE_NAME_SIZE];
+	char node[DEVICE_NAME_SIZE];
+	int fd;
+	// Last reading, as written by zone_table_read() or a replay.
+	long temp;
+	char value_str[SYSFS_VALUE_SIZE];
+	// Set when the sensor spec named a filter, the table's default
+	// applies otherwise.
+	bool has_filter;
+	struct filter_config filter_config;
+	struct filter filter;
+	// temp after the filter, what the curves and idle mode see.
+	long filtered;
+};
+
+struct fan {
+	char name[DEVICE_NAME_SIZE];
+	char node[DEVICE_NAME_SIZE];
+	int fd;
+	// Write-through shadow of pwm, the last value written to or read
+	// back from the hardware.
+	int speed;
+	// Highest speed requested by any zone during the current tick, after
+	// the slew stage.
+	int target;
+	struct slew slew;
+	// Also the fan's registered io_uring buffer, which targets are
+	// formatted into, so it needs room for any format_long_long().
+	char value_str[NUMBER_STR_SIZE];
+	// fanN_input next to pwmN, -1 without one or when no feature needs
+	// it.
+	int tach_fd;
+	struct tach tach;
+	char tach_str[SYSFS_VALUE_SIZE];
+	struct fan_profile profile;
+};
+
+enum zone_combine {
+	// One curve evaluated on the hottest sensor.
+	ZONE_COMBINE_MAX,
+	// One curve evaluated on the weighted mean of all sensors.
+	ZONE_COMBINE_WEIGHTED,
+	// One curve per sensor, the fastest resulting speed wins.
+	ZONE_COMBINE_CURVE,
+};
+
+struct zone_sensor {
+	int sensor;
+	// Fixed point, 1 << ZONE_WEIGHT_FRACTION_BITS is a weight of 1.
+	long weight;
+	bool has_curve;
+	long min_temp;
+	long max_temp;
+};
+
+struct zone_channel {
+	struct controller_config config;
+	struct controller controller;
+	struct scheduler scheduler;
+};
+
+struct zone {
+	enum zone_combine combine;
+	bool has_curve;
+	long min_temp;
+	long max_temp;
+	int min_fan_speed;
+	int sensor_count;
+	struct zone_sensor sensors[ZONE_MAX_SENSORS];
+	int fan_count;
+	int fans[MAX_FANS];
+	int channel_count;
+	struct zone_channel channels[ZONE_MAX_SENSORS];
+};
+
+struct zone_stats {
+	unsigned long long writes;
+	// Fan updates that found pwm already at the target.
+	unsigned long long skipped_writes;
+	// Times zone_table_verify() found a value another writer left.
+	unsigned long long overrides;
+	unsigned long long stalls;
+	// Kick-start pulses given to fans starting from standstill.
+	unsigned long long kicks;
+};
+
+// Sensors and fans are shared between zones, so a sensor listed by several
+// zones is still read once per tick and a fan driven by several zones runs
+// at the fastest speed any of them asks for.
+struct zone_table {
+	int sensor_count;
+	struct sensor sensors[MAX_SENSORS];
+	int fan_count;
+	struct fan fans[MAX_FANS];
+	int zone_count;
+	struct zone zones[MAX_ZONES];
+	struct slew_config slew;
+	struct tach_config tach;
+	// Lowest demand of every fan, on top of what the zones ask for. Set
+	// from outside before each zone_table_update().
+	int floor;
+	// Highest pwm the zones and the rpm correction may set, MAX_FAN_SPEED
+	// unless an acoustic limit holds them back. The floor, spin-up kicks
+	// and forced full speed still go above it.
+	int ceiling;
+	// Batches the reads and writes of a tick when built with IO_URING.
+	// Sensor i is registered file and buffer i, fan i follows the
+	// sensors.
+	struct uring ring;
+	// How far zone_table_lower_curves() has moved every curve down, in
+	// millidegrees.
+	long curve_shift;
+	// Time since the fan shadows were last checked against the hardware.
+	long verify_elapsed_ms;
+	struct zone_stats stats;
+};
+
+void zone_table_init(struct zone_table *table);
+// COMBINE[:MIN_TEMP:MAX_TEMP:MIN_FAN_SPEED], COMBINE is max, weighted or
+// curve. Starts a new zone that following sensors and fans are added to.
+int zone_table_add_zone(struct zone_table *table, char *spec);
+// [hwmon:|thermal:]NAME[/NODE][~FILTER][@WEIGHT][:MIN_TEMP:MAX_TEMP], see
+// filter_parse() for FILTER.
+int zone_table_add_sensor(struct zone_table *table, char *spec);
+// NAME[/NODE]
+int zone_table_add_fan(struct zone_table *table, char *spec);
+// Fills in the cpu -> pwmfan zone when nothing was configured and derives
+// every channel's controller config from defaults. slew and tach apply to
+// every fan, filter to every sensor without a filter of its own.
+int zone_table_finish(struct zone_table *table,
+		      const struct controller_config *defaults,
+		      const struct slew_config *slew,
+		      const struct tach_config *tach,
+		      const struct filter_config *filter, long min_interval_ms,
+		      long max_interval_ms);
+
+int zone_table_open(struct zone_table *table);
+void zone_table_close(struct zone_table *table);
+// Sets up a finished table without any hardware for a replay: sensor
+// temperatures are filled in by the caller instead of zone_table_read(),
+// and the fans write to /dev/null, so zone_table_write() runs unchanged.
+// All fans start stopped.
+int zone_table_simulate(struct zone_table *table);
+// Whether any sensor or fan is closed or its device went away.
+bool zone_table_stale(struct zone_table *table);
+// Reopens only the sensors and fans whose device went away, for example
+// after a driver reload. Returns -1 while any of them is still missing.
+int zone_table_refresh(struct zone_table *table);
+// Swaps next, a freshly finished table, in for table without closing the
+// devices both use and keeps the state of channels whose controller does
+// not change. next is left empty. On failure table is left as it was.
+int zone_table_reload(struct zone_table *table, struct zone_table *next);
+// Moves every channel's curve, ramp or pid target delta millidegrees
+// down, so the fans speed up that much earlier. Controller state is kept.
+void zone_table_lower_curves(struct zone_table *table, long delta);
+// Reads every sensor, and every tachometer on a best effort basis.
+int zone_table_read(struct zone_table *table);
+// Passes every sensor's reading through its filter, evaluates every zone
+// on the filtered temperatures with the shared load inputs and sets each
+// fan's target from the fastest demand through its slew stage, tachometer
+// loop and calibrated profile. Returns the delay until the next sample in
+// milliseconds, which is cut short for a kick-start pulse to end on time.
+long zone_table_update(struct zone_table *table,
+		       const struct controller_input *shared);
+// Lowest min_temp of any channel fed by sensor, LONG_MAX if none is.
+long zone_table_sensor_min_temp(const struct zone_table *table, int sensor);
+// Whether every fan is stopped and every sensor is at least margin below
+// the min_temp of the curves it feeds.
+bool zone_table_idle(const struct zone_table *table, long margin);
+// Re-reads every fan's pwm once FAN_VERIFY_INTERVAL_MS have passed and
+// takes over whatever another writer left there, so the next write puts
+// the target back.
+int zone_table_verify(struct zone_table *table, long elapsed_ms);
+// Writes every fan whose target moved by at least one step.
+int zone_table_write(struct zone_table *table);
+// Overrides every fan's target with full speed after zone_table_update().
+// The slew stages start over from full speed, so the fans ramp down at the
+// configured rate once this stops.
+void zone_table_force_max(struct zone_table *table);
+void zone_table_write_max(struct zone_table *table);
+
+#endif